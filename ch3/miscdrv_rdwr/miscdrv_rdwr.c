@@ -21,13 +21,28 @@
  * framework driver. The key difference: we use a few global data items within
  * a driver 'private' data structure throughout.
  * On init, we allocate memory to it and initialize it; one of the members
- * within is a so-called secret (the 'oursecret' member along with some fake
+ * within is a so-called secret (the 'data' member along with some fake
  * statistics and config words).
  * Importantly here, we perform (basic) I/O - reading and writing:
  * when a userpace process (or thread) opens our device file and issues a
  * read(2) upon it, we pass back the 'secret' data string to it.
  * When a user mode process writes data to us, we consider that data to be the
  * new 'secret' string and update it here (in driver memory).
+ * Additionally, to allow bulk transfers without the per-call copy, we expose a
+ * page-backed data region via mmap(2) along with a simple 'doorbell' (ioctl)
+ * protocol; see the comments in miscdrv_rdwr.h.
+ * Each open file gets it's own context (and it's own shared region), and the
+ * driver can register several independent device instances (the 'ninstances'
+ * module parameter), each with it's own 'secret' and statistics; so, unrelated
+ * clients needn't contend on - or corrupt - a single shared buffer.
+ * Optionally (the 'ring_size' module parameter), each instance becomes a
+ * streaming pipe instead: writers fill a lock-free SPSC ring buffer that
+ * readers drain, blocking - or using poll(2) - as required.
+ * splice(2) and sendfile(2) are supported as well, so the data can be moved
+ * to (or from) a file or socket without a round trip through userspace.
+ * The 'secret' is an (S)RCU-managed object: writers publish a new one by a
+ * pointer swap, so readers never take a lock, never block writers and never
+ * see a torn secret.
  *
  * For details, please refer the book, Ch 5.
  */
@@ -38,8 +53,17 @@
 #include <linux/miscdevice.h>
 #include <linux/slab.h>		// k[m|z]alloc(), k[z]free(), ...
 #include <linux/mm.h>		// kvmalloc()
+#include <linux/vmalloc.h>	// vmalloc_user(), remap_vmalloc_range()
+#include <linux/percpu.h>	// the per-cpu stats
+#include <linux/dynamic_debug.h>	// dev_dbg_path()
 #include <linux/fs.h>		// the fops
+#include <linux/uio.h>		// iov_iter, copy_[to|from]_iter()
 #include <linux/sched.h>	// get_task_comm()
+#include <linux/poll.h>		// the poll method
+#include <linux/wait.h>
+#include <linux/log2.h>		// is_power_of_2()
+#include <linux/srcu.h>		// the 'secret' is SRCU-protected
+#include <linux/overflow.h>	// struct_size()
 
 // copy_[to|from]_user()
 #include <linux/version.h>
@@ -50,6 +74,7 @@
 #endif
 
 #include "../../convenient.h"
+#include "miscdrv_rdwr.h"
 
 #define OURMODNAME   "miscdrv_rdwr"
 MODULE_AUTHOR("Kaiwan N Billimoria");
@@ -60,20 +85,387 @@ MODULE_VERSION("0.1");
 
 static int ga, gb = 1;		/* ignore for now ... */
 
+static int shm_pages = 16;
+module_param(shm_pages, int, 0444);
+MODULE_PARM_DESC(shm_pages,
+		 "Size (in pages) of the mmap-able shared data region, including the"
+		 " header page (defaults to 16)");
+static size_t shm_size;		/* in bytes, computed at init */
+
+static uint bufsize = 64 * 1024;
+module_param(bufsize, uint, 0444);
+MODULE_PARM_DESC(bufsize,
+		 "Max size (in bytes) of the 'secret' data; a single (vectored) read or"
+		 " write moves up to this much (defaults to 64 KB; min 128)");
+
+static uint ring_size;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size,
+		 "If non-zero, run in streaming mode: each instance holds a ring buffer of"
+		 " this many bytes (a power of 2, >= PAGE_SIZE) that writers fill and"
+		 " readers drain, blocking (or poll(2)-ing) as required. Defaults to 0:"
+		 " the one-slot 'secret' mailbox mode");
+
+#define MAX_INSTANCES	64
+static int ninstances = 1;
+module_param(ninstances, int, 0444);
+MODULE_PARM_DESC(ninstances,
+		 "Number of independent device instances to register (defaults to 1;"
+		 " max 64). Instance 0 is /dev/llkd_miscdrv_rdwr, instance n is"
+		 " /dev/llkd_miscdrv_rdwr<n>");
+
+/*
+ * The driver statistics: kept per-cpu, so that the (many) concurrent readers
+ * and writers never contend on - or race on - a shared counter; each simply
+ * bumps it's own CPU's copy (via the preempt-safe this_cpu_*() ops). They're
+ * folded into one total only on demand (the GETSTATS ioctl).
+ */
+struct drv_stats {
+	u64 tx, rx, err;
+	u64 allocs, frees;	/* of 'secret' objects */
+};
+
+/*
+ * The 'secret' itself. It's never modified in place: a writer builds a new one
+ * and publishes it via a pointer swap, and the old one is freed only after a
+ * grace period, i.e., once every reader that may still be copying from it is
+ * done. So readers take no lock at all - they scale with the # of CPUs and
+ * never block writers - and they can't ever see a torn (half old, half new)
+ * secret.
+ * We use SRCU (sleepable RCU) and not plain RCU, as copying to userspace can
+ * fault and hence sleep, which isn't allowed within an rcu_read_lock() section.
+ */
+struct drv_secret {
+	struct rcu_head rcu;
+	struct drv_ctx *ctx;	/* the owning instance (for the stats) */
+	size_t len;
+	char data[];
+};
+
+/*
+ * Most secrets are small (the test app's are at most MAXBYTES), so - as a
+ * write allocates a new one every time - they come from this dedicated slab
+ * cache, which recycles them from a per-cpu free list; only the larger ones
+ * take the (slower) kvmalloc() path.
+ */
+#define SECRET_CACHE_BYTES	MAXBYTES
+static struct kmem_cache *secret_cache;
+
+/* The streaming mode ring buffer; see the comments above ring_read() */
+struct drv_ring {
+	char *buf;		/* 'ring_size' bytes, kvmalloc()-ed */
+	unsigned long size;	/* a power of 2 */
+	struct mutex rd_lock, wr_lock;	/* serialize readers (and writers) amongst themselves */
+	wait_queue_head_t rq;	/* readers wait here for data ... */
+	wait_queue_head_t wq;	/* ... and writers for space */
+	/* the free-running indices, on separate cache lines */
+	unsigned long head ____cacheline_aligned_in_smp;	/* advanced only by the producer */
+	unsigned long tail ____cacheline_aligned_in_smp;	/* advanced only by the consumer */
+};
+
 /*
  * The driver 'context' (or private) data structure;
- * all relevant 'state info' regarding the driver is here.
+ * all relevant 'state info' regarding a device instance is here. There's one
+ * of these per instance; the misc device is embedded within it, so that our
+ * methods can get to the instance from the misc device (via container_of()).
  */
 struct drv_ctx {
+	struct miscdevice misc;
+	char name[32];
 	struct device *dev;
-	int tx, rx, err, myword;
+	struct drv_stats __percpu *stats;
+	int myword;
 	u32 config1, config2;
 	u64 config3;
-#define MAXBYTES    128		/* Must match the userspace app; we should actually
-				 * use a common header file for things like this */
-	char oursecret[MAXBYTES];
+	struct drv_secret __rcu *secret;	/* the current 'secret' */
+	spinlock_t secret_lock;	/* serializes the (rare) publishers */
+	struct srcu_struct srcu;	/* readers of the secret are in SRCU read sections */
+	struct drv_ring ring;	/* streaming mode only (ring.buf is NULL otherwise) */
+};
+static struct drv_ctx **ctxs;	/* the array of (ninstances) instance pointers */
+
+/*
+ * The per-open-file context; allocated on open, hung off the file's
+ * private_data and freed on release. State that belongs to one client - like
+ * the mmap-able shared region - lives here, and not in the (shared) instance.
+ */
+struct drv_file_ctx {
+	struct drv_ctx *ctx;	/* the device instance this file is open on */
+	void *shm;		/* the mmap-able shared region (vmalloc_user()-ed) */
 };
-static struct drv_ctx *ctx;
+
+/* Fold the per-cpu stats into @st */
+static void drv_stats_fold(struct drv_ctx *c, struct miscdrv_stats *st)
+{
+	int cpu;
+
+	memset(st, 0, sizeof(*st));
+	for_each_possible_cpu(cpu) {
+		const struct drv_stats *s = per_cpu_ptr(c->stats, cpu);
+
+		st->tx += READ_ONCE(s->tx);
+		st->rx += READ_ONCE(s->rx);
+		st->err += READ_ONCE(s->err);
+		st->allocs += READ_ONCE(s->allocs);
+		st->frees += READ_ONCE(s->frees);
+	}
+}
+
+/*
+ * Allocate a new 'secret' object for @len bytes of data; it's left
+ * uninitialized - the caller overwrites all of the data anyway.
+ */
+static struct drv_secret *drv_secret_alloc(struct drv_ctx *ctx, size_t len, gfp_t gfp)
+{
+	struct drv_secret *sec;
+
+	if (len <= SECRET_CACHE_BYTES)
+		sec = kmem_cache_alloc(secret_cache, gfp);
+	else
+		sec = kvmalloc(struct_size(sec, data, len), gfp);
+	if (unlikely(!sec))
+		return NULL;
+	sec->ctx = ctx;
+	sec->len = len;
+	this_cpu_inc(ctx->stats->allocs);
+	return sec;
+}
+
+static void drv_secret_free(struct drv_secret *sec)
+{
+	this_cpu_inc(sec->ctx->stats->frees);
+	if (sec->len <= SECRET_CACHE_BYTES)
+		kmem_cache_free(secret_cache, sec);
+	else
+		kvfree(sec);
+}
+
+static void drv_secret_free_rcu(struct rcu_head *rcu)
+{
+	drv_secret_free(container_of(rcu, struct drv_secret, rcu));
+}
+
+/*
+ * Publish @new as the instance's 'secret'; the old one is freed once all
+ * current readers are done with it. We never block here (a spinlock guards
+ * just the pointer swap), so it's fine for IOCB_NOWAIT writes as well.
+ */
+static void drv_secret_publish(struct drv_ctx *ctx, struct drv_secret *new)
+{
+	struct drv_secret *old;
+
+	spin_lock(&ctx->secret_lock);
+	old = rcu_dereference_protected(ctx->secret, lockdep_is_held(&ctx->secret_lock));
+	rcu_assign_pointer(ctx->secret, new);
+	spin_unlock(&ctx->secret_lock);
+	if (old)
+		call_srcu(&ctx->srcu, &old->rcu, drv_secret_free_rcu);
+}
+
+/*
+ * The scratch buffers that file_path() needs (PATH_MAX bytes) come from this
+ * dedicated slab cache; and they're only ever allocated when the debug print
+ * that uses them is actually enabled (see dev_dbg_path() below).
+ */
+static struct kmem_cache *path_cache;
+
+/*
+ * dev_dbg_path(dev, filp, fmt, ...)
+ * A dev_dbg() whose first conversion is a "%s" for @filp's pathname.
+ * Resolving the pathname is expensive - a PATH_MAX scratch buffer plus the
+ * d_path() walk - and the debug print is usually disabled; so we do it only
+ * when the dynamic debug callsite is enabled. With CONFIG_JUMP_LABEL, the
+ * DYNAMIC_DEBUG_BRANCH() check is a static key: a patched-in no-op in the
+ * (common) disabled case, so the open/release hot path costs nothing here.
+ */
+#if defined(CONFIG_DYNAMIC_DEBUG) || \
+	(defined(CONFIG_DYNAMIC_DEBUG_CORE) && defined(DYNAMIC_DEBUG_MODULE))
+#define dev_dbg_path(dev, filp, fmt, ...) do {				\
+	DEFINE_DYNAMIC_DEBUG_METADATA(descriptor, fmt);			\
+	if (DYNAMIC_DEBUG_BRANCH(descriptor)) {				\
+		char *__pbuf = kmem_cache_alloc(path_cache, GFP_KERNEL);	\
+									\
+		__dynamic_dev_dbg(&descriptor, dev, fmt,		\
+			__pbuf ? file_path(filp, __pbuf, PATH_MAX) : "?",	\
+			##__VA_ARGS__);					\
+		if (__pbuf)						\
+			kmem_cache_free(path_cache, __pbuf);		\
+	}								\
+} while (0)
+#elif defined(DEBUG)
+#define dev_dbg_path(dev, filp, fmt, ...) do {				\
+	char *__pbuf = kmem_cache_alloc(path_cache, GFP_KERNEL);	\
+									\
+	dev_printk(KERN_DEBUG, dev, fmt,				\
+		__pbuf ? file_path(filp, __pbuf, PATH_MAX) : "?",	\
+		##__VA_ARGS__);						\
+	if (__pbuf)							\
+		kmem_cache_free(path_cache, __pbuf);			\
+} while (0)
+#else
+#define dev_dbg_path(dev, filp, fmt, ...) do {				\
+	if (0)								\
+		dev_printk(KERN_DEBUG, dev, fmt, "", ##__VA_ARGS__);	\
+} while (0)
+#endif
+
+/*
+ * Return this open file's shared region, allocating it on first use; this is
+ * done lazily so that the (many) opens that never use it don't pay for it.
+ * Two threads sharing the file may race here: the loser frees it's copy.
+ */
+static void *drv_file_shm(struct drv_file_ctx *fctx)
+{
+	struct miscdrv_shm_hdr *hdr;
+	void *shm = smp_load_acquire(&fctx->shm);
+
+	if (likely(shm))
+		return shm;
+
+	/* vmalloc_user() gives us zeroed, page-aligned memory that's suitable
+	 * for mapping into userspace (via remap_vmalloc_range()) */
+	shm = vmalloc_user(shm_size);
+	if (unlikely(!shm))
+		return NULL;
+	hdr = shm;
+	hdr->magic = MISCDRV_SHM_MAGIC;
+	hdr->data_off = PAGE_SIZE;
+	hdr->data_size = shm_size - PAGE_SIZE;
+
+	if (cmpxchg(&fctx->shm, NULL, shm)) {
+		vfree(shm);
+		shm = smp_load_acquire(&fctx->shm);
+	}
+	return shm;
+}
+
+/*
+ * The (optional) streaming ring buffer mode.
+ * A power-of-2 sized ring with free-running, single-producer/single-consumer
+ * indices: the producer (writer) only ever advances 'head', the consumer
+ * (reader) only ever advances 'tail', so the two sides never take a lock
+ * against each other; the acquire/release pairs on the indices order the data
+ * accesses. Concurrent writers (or concurrent readers) are serialized amongst
+ * themselves by the per-side mutex, which is uncontended in the SPSC case.
+ */
+static bool ring_nonblock(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static inline unsigned long ring_used(struct drv_ring *r)
+{
+	return smp_load_acquire(&r->head) - smp_load_acquire(&r->tail);
+}
+
+static ssize_t ring_read(struct drv_ctx *ctx, struct kiocb *iocb, struct iov_iter *to)
+{
+	struct drv_ring *r = &ctx->ring;
+	size_t count = iov_iter_count(to), done = 0, n, copied;
+	bool nonblock = ring_nonblock(iocb);
+	unsigned long head, tail, off;
+	ssize_t ret = 0;
+
+	if (nonblock) {
+		if (!mutex_trylock(&r->rd_lock))
+			return -EAGAIN;
+	} else if (mutex_lock_interruptible(&r->rd_lock))
+		return -ERESTARTSYS;
+
+	while (count) {
+		tail = r->tail;		/* only we (the consumer) write it */
+		head = smp_load_acquire(&r->head);	/* pairs with the producer's release */
+		if (head == tail) {	/* empty */
+			if (done)
+				break;	/* return what we have, don't wait for more */
+			if (nonblock) {
+				ret = -EAGAIN;
+				break;
+			}
+			ret = wait_event_interruptible(r->rq, ring_used(r));
+			if (ret)
+				break;
+			continue;
+		}
+		off = tail & (r->size - 1);
+		n = min3(count, (size_t)(head - tail), (size_t)(r->size - off));
+		copied = copy_to_iter(r->buf + off, n, to);
+		/* done with the data; pairs with the producer's acquire of tail */
+		smp_store_release(&r->tail, tail + copied);
+		done += copied;
+		count -= copied;
+		if (wq_has_sleeper(&r->wq))
+			wake_up_interruptible(&r->wq);
+		if (unlikely(copied != n)) {
+			if (!done)
+				ret = -EFAULT;
+			break;
+		}
+	}
+	mutex_unlock(&r->rd_lock);
+
+	if (done) {
+		this_cpu_add(ctx->stats->tx, done);
+		return done;
+	}
+	if (ret == -EFAULT)
+		this_cpu_inc(ctx->stats->err);
+	return ret;
+}
+
+static ssize_t ring_write(struct drv_ctx *ctx, struct kiocb *iocb, struct iov_iter *from)
+{
+	struct drv_ring *r = &ctx->ring;
+	size_t count = iov_iter_count(from), done = 0, n, copied;
+	bool nonblock = ring_nonblock(iocb);
+	unsigned long head, tail, off;
+	ssize_t ret = 0;
+
+	if (nonblock) {
+		if (!mutex_trylock(&r->wr_lock))
+			return -EAGAIN;
+	} else if (mutex_lock_interruptible(&r->wr_lock))
+		return -ERESTARTSYS;
+
+	/* Like a pipe: a blocking write waits (for space) until it's all written */
+	while (count) {
+		head = r->head;		/* only we (the producer) write it */
+		tail = smp_load_acquire(&r->tail);	/* pairs with the consumer's release */
+		if (head - tail == r->size) {	/* full */
+			if (nonblock) {
+				if (!done)
+					ret = -EAGAIN;
+				break;
+			}
+			ret = wait_event_interruptible(r->wq, ring_used(r) < r->size);
+			if (ret)
+				break;
+			continue;
+		}
+		off = head & (r->size - 1);
+		n = min3(count, (size_t)(r->size - (head - tail)), (size_t)(r->size - off));
+		copied = copy_from_iter(r->buf + off, n, from);
+		/* publish the data; pairs with the consumer's acquire of head */
+		smp_store_release(&r->head, head + copied);
+		done += copied;
+		count -= copied;
+		if (wq_has_sleeper(&r->rq))
+			wake_up_interruptible(&r->rq);
+		if (unlikely(copied != n)) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	mutex_unlock(&r->wr_lock);
+
+	if (done) {
+		this_cpu_add(ctx->stats->rx, done);
+		return done;
+	}
+	if (ret == -EFAULT)
+		this_cpu_inc(ctx->stats->err);
+	return ret;
+}
 
 /*--- The driver 'methods' follow ---*/
 /*
@@ -85,21 +477,28 @@ static struct drv_ctx *ctx;
  * all we do here is return 0 indicating success.
  * (The nonseekable_open(), in conjunction with the fop's llseek pointer set to
  * no_llseek, tells the kernel that our device is not seek-able).
+ * Here, we also set up this open file's private context.
  */
 static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
+	/* The misc core has set private_data to our (embedded) misc device */
+	struct drv_ctx *ctx = container_of(filp->private_data, struct drv_ctx, misc);
 	struct device *dev = ctx->dev;
-	char *buf = kzalloc(PATH_MAX, GFP_KERNEL);
+	struct drv_file_ctx *fctx;
 
-	if (unlikely(!buf))
+	fctx = kzalloc(sizeof(struct drv_file_ctx), GFP_KERNEL);
+	if (unlikely(!fctx))
 		return -ENOMEM;
+	fctx->ctx = ctx;
+	filp->private_data = fctx;
+	/* Our read/write methods never block; let RWF_NOWAIT (& io_uring) in */
+	filp->f_mode |= FMODE_NOWAIT;
 
 	PRINT_CTX();	// displays process (or atomic) context info
 	ga++;
 	gb--;
-	dev_dbg(dev, " opening \"%s\" now; wrt open file: f_flags = 0x%x\n",
-		file_path(filp, buf, PATH_MAX), filp->f_flags);
-	kfree(buf);
+	dev_dbg_path(dev, filp, " opening \"%s\" now; wrt open file: f_flags = 0x%x\n",
+		     filp->f_flags);
 
 	return nonseekable_open(inode, filp);
 }
@@ -112,52 +511,72 @@ static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
  * the number of bytes read or written on success, 0 on EOF (for read), and -1
  * (-ve errno) on failure; here, we copy the 'secret' from our driver context
  * structure to the userspace app.
+ * We implement the 'iter' flavour of the method: the user buffer(s) come in
+ * wrapped in an iov_iter, so the very same code serves read(2), readv(2),
+ * preadv2(2) and io_uring - a large scatter/gather list moves in one call.
+ * We never block, so RWF_NOWAIT / IOCB_NOWAIT requests are fine as is.
+ * (In streaming mode, we instead drain the ring buffer, blocking while it's
+ * empty, unless it's a non-blocking request).
  */
-static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
-				 size_t count, loff_t *off)
+static ssize_t read_miscdrv_rdwr(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = count, secret_len = strnlen(ctx->oursecret, MAXBYTES);
+	struct drv_file_ctx *fctx = iocb->ki_filp->private_data;
+	struct drv_ctx *ctx = fctx->ctx;
+	size_t count = iov_iter_count(to), n;
 	struct device *dev = ctx->dev;
 	char tasknm[TASK_COMM_LEN];
+	struct drv_secret *sec;
+	ssize_t ret;
+	int idx;
+
+	if (ctx->ring.buf)
+		return ring_read(ctx, iocb, to);
 
 	PRINT_CTX();
 	dev_dbg(dev, "%s wants to read (upto) %zu bytes\n", get_task_comm(tasknm, current), count);
 
+	/* No lock: a concurrent writer publishes a new secret, it never touches
+	 * this one; it'll be freed only after we leave the read section */
+	idx = srcu_read_lock(&ctx->srcu);
+	sec = srcu_dereference(ctx->secret, &ctx->srcu);
 	ret = -EINVAL;
-	if (count < MAXBYTES) {
-		dev_warn(dev, "request # of bytes (%zu) is < required size"
-			" (%d), aborting read\n", count, MAXBYTES);
-		goto out_notok;
-	}
-	if (secret_len <= 0) {
+	if (!sec || sec->len == 0) {
 		dev_warn(dev, "whoops, something's wrong, the 'secret' isn't"
 			" available..; aborting read\n");
-		goto out_notok;
+		goto out_unlock;
 	}
 
 	/* In a 'real' driver, we would now actually read the content of the
-	 * device hardware (or whatever) into the user supplied buffer 'ubuf'
+	 * device hardware (or whatever) into the user supplied buffer(s)
 	 * for 'count' bytes, and then copy it to the userspace process (via
-	 * the copy_to_user() routine).
-	 * (FYI, the copy_to_user() routine is the *right* way to copy data from
-	 * userspace to kernel-space; the parameters are:
-	 *  'to-buffer' (dest), 'from-buffer' (src), count (# of bytes)
-	 * Returns 0 on success, i.e., non-zero return implies an I/O fault).
+	 * the copy_to_iter() routine).
+	 * (FYI, copy_to_iter() - a wrapper over copy_to_user() for each segment
+	 * of the iterator - is the *right* way to copy data from kernel-space
+	 * to userspace; it returns the # of bytes actually copied, less than
+	 * asked for implying an I/O fault).
 	 * Here, we simply copy the content of our context structure's 'secret'
-	 * member to userspace.
+	 * data to userspace; a smaller request gets the leading part of it.
 	 */
-	ret = -EFAULT;
-	if (copy_to_user(ubuf, ctx->oursecret, secret_len)) {
-		dev_warn(dev, "copy_to_user() failed\n");
-		goto out_notok;
+	n = min(count, sec->len);
+	ret = copy_to_iter(sec->data, n, to);
+	srcu_read_unlock(&ctx->srcu, idx);
+	if (unlikely((size_t)ret != n)) {
+		dev_warn(dev, "copy_to_iter() failed, copied %zd of %zu bytes\n", ret, n);
+		if (!ret) {	/* a partial copy is a (short) read */
+			ret = -EFAULT;
+			goto out_notok;
+		}
 	}
-	ret = secret_len;
 
 	// Update stats
-	ctx->tx += secret_len;	// our 'transmit' is wrt this driver
-	dev_dbg(dev, " %d bytes read, returning... (stats: tx=%d, rx=%d)\n",
-		secret_len, ctx->tx, ctx->rx);
+	this_cpu_add(ctx->stats->tx, ret);	// our 'transmit' is wrt this driver
+	dev_dbg(dev, " %zd bytes read, returning...\n", ret);
+	return ret;
+ out_unlock:
+	srcu_read_unlock(&ctx->srcu, idx);
  out_notok:
+	if (ret < 0)
+		this_cpu_inc(ctx->stats->err);
 	return ret;
 }
 
@@ -167,67 +586,223 @@ static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
  * functionality!
  * The POSIX standard requires that the read() and write() system calls return
  * the number of bytes read or written on success, 0 on EOF (for read), and -1
- * (-ve errno) on failure; here, we copy the 'secret' from our driver context
- * structure to the userspace app.
+ * (-ve errno) on failure; here, we copy the data passed by the userspace app
+ * into our driver context structure as the new 'secret'.
+ * As with read, this is the 'iter' flavour of the method (so writev(2) and
+ * friends work), and the data can be up to 'bufsize' bytes in one go.
+ * (In streaming mode, we instead fill the ring buffer, blocking while it's
+ * full, unless it's a non-blocking request).
  */
-static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
-				  size_t count, loff_t *off)
+static ssize_t write_miscdrv_rdwr(struct kiocb *iocb, struct iov_iter *from)
 {
-	int ret = count;
-	void *kbuf = NULL;
+	struct drv_file_ctx *fctx = iocb->ki_filp->private_data;
+	struct drv_ctx *ctx = fctx->ctx;
+	size_t count = iov_iter_count(from);
+	ssize_t ret = count;
+	struct drv_secret *new;
 	struct device *dev = ctx->dev;
 	char tasknm[TASK_COMM_LEN];
+	/* an RWF_NOWAIT / IOCB_NOWAIT request mustn't block in the allocator */
+	gfp_t gfp = (iocb->ki_flags & IOCB_NOWAIT) ? GFP_NOWAIT : GFP_KERNEL;
+
+	if (ctx->ring.buf)
+		return ring_write(ctx, iocb, from);
 
 	PRINT_CTX();
-	if (unlikely(count > MAXBYTES)) {	/* paranoia */
-		dev_warn(dev, "count %zu exceeds max # of bytes allowed, "
-			"aborting write\n", count);
+	if (unlikely(!count))
+		goto out_nomem;
+	ret = -EINVAL;
+	if (unlikely(count > bufsize)) {
+		dev_warn(dev, "count %zu exceeds max # of bytes allowed (%u), "
+			"aborting write\n", count, bufsize);
 		goto out_nomem;
 	}
 	dev_dbg(dev, "%s wants to write %zu bytes\n", get_task_comm(tasknm, current), count);
 
-	ret = -ENOMEM;
-	kbuf = kvmalloc(count, GFP_KERNEL);
-	if (unlikely(!kbuf))
+	ret = (gfp == GFP_NOWAIT) ? -EAGAIN : -ENOMEM;
+	/* The new secret object; it's invisible to readers until we publish it */
+	new = drv_secret_alloc(ctx, count, gfp);
+	if (unlikely(!new))
 		goto out_nomem;
-	memset(kbuf, 0, count);
-
-	/* Copy in the user supplied buffer 'ubuf' - the data content to write -
-	 * via the copy_from_user() macro.
-	 * (FYI, the copy_from_user() macro is the *right* way to copy data from
-	 * userspace to kernel-space; the parameters are:
-	 *  'to-buffer', 'from-buffer', count
-	 *  Returns 0 on success, i.e., non-zero return implies an I/O fault).
+
+	/* Copy in the user supplied buffer(s) - the data content to write -
+	 * via the copy_from_iter_full() routine.
+	 * (FYI, copy_from_iter[_full]() - a wrapper over copy_from_user() for
+	 * each segment of the iterator - is the *right* way to copy data from
+	 * userspace to kernel-space; the _full variant is all-or-nothing,
+	 * returning false on an I/O fault).
 	 */
 	ret = -EFAULT;
-	if (copy_from_user(kbuf, ubuf, count)) {
-		dev_warn(dev, "copy_from_user() failed\n");
+	if (!copy_from_iter_full(new->data, count, from)) {
+		dev_warn(dev, "copy_from_iter_full() failed\n");
 		goto out_cfu;
 	}
 
 	/* In a 'real' driver, we would now actually write (for 'count' bytes)
-	 * the content of the 'ubuf' buffer to the device hardware (or whatever),
+	 * the content of the user buffer(s) to the device hardware (or whatever),
 	 * and then return.
 	 * Here, we do nothing, we just pretend we've done everything :-)
+	 * (and make it the new 'secret': one pointer swap, no copy).
 	 */
-	strlcpy(ctx->oursecret, kbuf, (count > MAXBYTES ? MAXBYTES : count));
+	drv_secret_publish(ctx, new);
 #if 0
 	/* Might be useful to actually see a hex dump of the driver 'context' */
 	print_hex_dump_bytes("ctx ", DUMP_PREFIX_OFFSET,
 			     ctx, sizeof(struct drv_ctx));
 #endif
 	// Update stats
-	ctx->rx += count;	// our 'receive' is wrt userspace
+	this_cpu_add(ctx->stats->rx, count);	// our 'receive' is wrt userspace
 
-	ret = count;
-	dev_dbg(dev, " %zu bytes written, returning... (stats: tx=%d, rx=%d)\n",
-		count, ctx->tx, ctx->rx);
+	dev_dbg(dev, " %zu bytes written, returning...\n", count);
+	return count;
  out_cfu:
-	kvfree(kbuf);
+	drv_secret_free(new);
  out_nomem:
+	if (ret < 0)
+		this_cpu_inc(ctx->stats->err);
 	return ret;
 }
 
+/*
+ * mmap_miscdrv_rdwr()
+ * The driver's mmap 'method'; we map this open file's (page-backed) shared
+ * data region into the calling process's VAS. It has to be a shared mapping,
+ * else the app's writes would land in private COW pages the driver never sees.
+ */
+static int mmap_miscdrv_rdwr(struct file *filp, struct vm_area_struct *vma)
+{
+	struct drv_file_ctx *fctx = filp->private_data;
+	struct device *dev = fctx->ctx->dev;
+	void *shm;
+
+	if (!(vma->vm_flags & VM_SHARED)) {
+		dev_warn(dev, "only MAP_SHARED mappings are supported\n");
+		return -EINVAL;
+	}
+	shm = drv_file_shm(fctx);
+	if (unlikely(!shm))
+		return -ENOMEM;
+	/* remap_vmalloc_range() validates the offset and size against the region */
+	return remap_vmalloc_range(vma, shm, vma->vm_pgoff);
+}
+
+/*
+ * ioctl_miscdrv_rdwr()
+ * The driver's ioctl 'method'; here, it implements the 'doorbell' side of the
+ * mmap-ed shared region protocol (see miscdrv_rdwr.h):
+ *  MISCDRV_IOC_COMMIT : the app has placed 'len' bytes in the data area; we
+ *   consume them in place (we take the leading - up to 'bufsize' - bytes as
+ *   the new 'secret') and pass back the # of bytes we kept.
+ *  MISCDRV_IOC_FETCH  : we place our data - the 'secret' - in the data area
+ *   and pass back it's length.
+ * Also:
+ *  MISCDRV_IOC_GETSTATS : fold the per-cpu statistics and pass them back.
+ * Note that the app can scribble on the shared region at any time, so we never
+ * trust anything we read back from it; the length comes in via the ioctl.
+ */
+static long ioctl_miscdrv_rdwr(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct drv_file_ctx *fctx = filp->private_data;
+	struct drv_ctx *ctx = fctx->ctx;
+	struct device *dev = ctx->dev;
+	struct miscdrv_shm_hdr *hdr = NULL;
+	char *data = NULL;
+	size_t data_size = shm_size - PAGE_SIZE, n;
+	struct drv_secret *sec;
+	struct miscdrv_stats st;
+	u32 len;
+	int idx;
+
+	if (_IOC_TYPE(cmd) != MISCDRV_IOC_MAGIC)
+		return -ENOTTY;
+
+	if (cmd == MISCDRV_IOC_COMMIT || cmd == MISCDRV_IOC_FETCH) {
+		/* the doorbell works on the 'secret' mailbox, not on the stream */
+		if (ctx->ring.buf)
+			return -EOPNOTSUPP;
+		hdr = drv_file_shm(fctx);
+		if (unlikely(!hdr))
+			return -ENOMEM;
+		data = (char *)hdr + PAGE_SIZE;
+	}
+
+	switch (cmd) {
+	case MISCDRV_IOC_COMMIT:
+		if (get_user(len, (u32 __user *)arg))
+			goto out_fault;
+		if (unlikely(len > data_size)) {
+			dev_warn(dev, "commit of %u bytes exceeds the data area (%zu bytes)\n",
+				 len, data_size);
+			this_cpu_inc(ctx->stats->err);
+			return -EINVAL;
+		}
+		n = min_t(size_t, len, bufsize);
+		if (n) {
+			sec = drv_secret_alloc(ctx, n, GFP_KERNEL);
+			if (unlikely(!sec))
+				return -ENOMEM;
+			memcpy(sec->data, data, n);
+			drv_secret_publish(ctx, sec);
+		}
+		WRITE_ONCE(hdr->seq, hdr->seq + 1);
+		if (put_user((u32)n, (u32 __user *)arg))
+			goto out_fault;
+		this_cpu_add(ctx->stats->rx, n);
+		dev_dbg(dev, " %zu of %u bytes committed via the shared region\n", n, len);
+		return 0;
+	case MISCDRV_IOC_FETCH:
+		idx = srcu_read_lock(&ctx->srcu);
+		sec = srcu_dereference(ctx->secret, &ctx->srcu);
+		n = min(sec->len, data_size);
+		memcpy(data, sec->data, n);
+		srcu_read_unlock(&ctx->srcu, idx);
+		WRITE_ONCE(hdr->len, n);
+		WRITE_ONCE(hdr->seq, hdr->seq + 1);
+		if (put_user((u32)n, (u32 __user *)arg))
+			goto out_fault;
+		this_cpu_add(ctx->stats->tx, n);
+		dev_dbg(dev, " %zu bytes fetched via the shared region\n", n);
+		return 0;
+	case MISCDRV_IOC_GETSTATS:
+		drv_stats_fold(ctx, &st);
+		if (copy_to_user((void __user *)arg, &st, sizeof(st)))
+			goto out_fault;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+ out_fault:
+	this_cpu_inc(ctx->stats->err);
+	return -EFAULT;
+}
+
+/*
+ * poll_miscdrv_rdwr()
+ * The driver's poll 'method' (serves poll(2), select(2) and epoll). In the
+ * mailbox mode there's always a 'secret' to read and room to write; in
+ * streaming mode, we're readable when the ring has data and writable when it
+ * has space.
+ */
+static __poll_t poll_miscdrv_rdwr(struct file *filp, poll_table *wait)
+{
+	struct drv_file_ctx *fctx = filp->private_data;
+	struct drv_ring *r = &fctx->ctx->ring;
+	__poll_t mask = 0;
+	unsigned long used;
+
+	if (!r->buf)
+		return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+
+	poll_wait(filp, &r->rq, wait);
+	poll_wait(filp, &r->wq, wait);
+	used = ring_used(r);
+	if (used)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (used < r->size)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	return mask;
+}
+
 /*
  * close_miscdrv_rdwr()
  * The driver's close 'method'; this 'hook' will get invoked by the kernel VFS
@@ -236,84 +811,206 @@ static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
  */
 static int close_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
-	struct device *dev = ctx->dev;
-	char *buf = kzalloc(PATH_MAX, GFP_KERNEL);
-
-	if (unlikely(!buf))
-		return -ENOMEM;
+	struct drv_file_ctx *fctx = filp->private_data;
+	struct device *dev = fctx->ctx->dev;
 
 	PRINT_CTX();		// displays process (or intr) context info
 	ga--;
 	gb++;
-	dev_dbg(dev, " filename: \"%s\"\n", file_path(filp, buf, PATH_MAX));
-	kfree(buf);
+	dev_dbg_path(dev, filp, " filename: \"%s\"\n");
+	/* No mapping can outlive us: a mapping holds a reference to the file */
+	vfree(fctx->shm);
+	kfree(fctx);
 
 	return 0;
 }
 
 /* The driver 'functionality' is encoded via the fops */
 static const struct file_operations llkd_misc_fops = {
+	.owner = THIS_MODULE,	/* pins the module while the device is open (or mapped) */
 	.open = open_miscdrv_rdwr,
-	.read = read_miscdrv_rdwr,
-	.write = write_miscdrv_rdwr,
+	.read_iter = read_miscdrv_rdwr,
+	.write_iter = write_miscdrv_rdwr,
+	/* splice(2) / sendfile(2): the data moves device <-> pipe within the
+	 * kernel, via our read_iter / write_iter methods; it never has to
+	 * enter userspace */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read = copy_splice_read,
+#else
+	.splice_read = generic_file_splice_read,
+#endif
+	.splice_write = iter_file_splice_write,
+	.poll = poll_miscdrv_rdwr,
+	.mmap = mmap_miscdrv_rdwr,
+	.unlocked_ioctl = ioctl_miscdrv_rdwr,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	.compat_ioctl = compat_ptr_ioctl,
+#endif
 	.llseek = no_llseek,	// dummy, we don't support lseek(2)
 	.release = close_miscdrv_rdwr,
-	/* As you learn more reg device drivers, you'll realize that the
-	 * ioctl() would be a very useful method here. As an exercise,
-	 * implement an ioctl method; when issued with the 'GETSTATS' 'command',
-	 * it should return the statistics (tx, rx, errors) to the calling app.
-	 * Refer to Ch 2 - "User-Kernel Communication Pathways" for the gory
-	 * details on how to use the ioctl(), procfs, debugfs, netlink sockets
-	 * for interfacing your driver with userspace apps.
+	/* The ioctl method, when issued with the 'GETSTATS' 'command', returns
+	 * the statistics (tx, rx, errors) to the calling app.
+	 * Refer to Ch 2 - "User-Kernel Communication Pathways" (of the LKP Part 2
+	 * book) for the gory details on how to use the ioctl(), procfs, debugfs,
+	 * netlink sockets for interfacing your driver with userspace apps.
 	 */
 };
 
-static struct miscdevice llkd_miscdev = {
-	.minor = MISC_DYNAMIC_MINOR,	/* kernel dynamically assigns a free minor# */
-	.name = "llkd_miscdrv_rdwr",	/* when misc_register() is invoked, the kernel
-		 * will auto-create device file as /dev/llkd_miscdrv_rdwr;
-		 *  also populated within /sys/class/misc/ and /sys/devices/virtual/misc/ */
-	.mode = 0666,		/* ... dev node perms set as specified here */
-	.fops = &llkd_misc_fops,	/* connect to this driver's 'functionality' */
-};
-
-static int __init miscdrv_rdwr_init(void)
+/*
+ * Create and register device instance # @idx.
+ * Each instance is a separate allocation - so they don't share cache lines -
+ * with it's own misc device, 'secret' and statistics.
+ */
+static int drv_instance_create(int idx)
 {
-	int ret = 0;
-	struct device *dev;
+	struct drv_ctx *ctx;
+	struct drv_secret *sec;
+	int ret = -ENOMEM;
 
-	ret = misc_register(&llkd_miscdev);
+	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
+	if (unlikely(!ctx))
+		return -ENOMEM;
+	ctx->stats = alloc_percpu(struct drv_stats);
+	if (unlikely(!ctx->stats))
+		goto out_free_ctx;
+	ret = init_srcu_struct(&ctx->srcu);
+	if (ret)
+		goto out_free_stats;
+	spin_lock_init(&ctx->secret_lock);
+	ret = -ENOMEM;
+	sec = drv_secret_alloc(ctx, 8, GFP_KERNEL);
+	if (unlikely(!sec))
+		goto out_cleanup_srcu;
+	/* Initialize the "secret" value :-) */
+	strlcpy(sec->data, "initmsg", 8);
+	RCU_INIT_POINTER(ctx->secret, sec);	/* no readers yet */
+
+	if (ring_size) {	/* streaming mode */
+		ctx->ring.size = ring_size;
+		ctx->ring.buf = kvmalloc(ring_size, GFP_KERNEL);
+		if (unlikely(!ctx->ring.buf))
+			goto out_free_data;
+		mutex_init(&ctx->ring.rd_lock);
+		mutex_init(&ctx->ring.wr_lock);
+		init_waitqueue_head(&ctx->ring.rq);
+		init_waitqueue_head(&ctx->ring.wq);
+	}
+
+	if (idx == 0)
+		strlcpy(ctx->name, "llkd_miscdrv_rdwr", sizeof(ctx->name));
+	else
+		snprintf(ctx->name, sizeof(ctx->name), "llkd_miscdrv_rdwr%d", idx);
+	ctx->misc.minor = MISC_DYNAMIC_MINOR;	/* kernel dynamically assigns a free minor# */
+	ctx->misc.name = ctx->name;	/* when misc_register() is invoked, the kernel
+		 * will auto-create device file as /dev/<name>;
+		 *  also populated within /sys/class/misc/ and /sys/devices/virtual/misc/ */
+	ctx->misc.mode = 0666;	/* ... dev node perms set as specified here */
+	ctx->misc.fops = &llkd_misc_fops;	/* connect to this driver's 'functionality' */
+
+	ret = misc_register(&ctx->misc);
 	if (ret) {
-		pr_notice("%s: misc device registration failed, aborting\n", OURMODNAME);
-		return ret;
+		pr_notice("%s: misc device %s registration failed, aborting\n",
+			  OURMODNAME, ctx->name);
+		goto out_free_ring;
 	}
 	/* Retrieve the device pointer for this device */
-	dev = llkd_miscdev.this_device;
+	ctx->dev = ctx->misc.this_device;
+	ctxs[idx] = ctx;
 
 	pr_info("LLKD misc driver (major # 10) registered, minor# = %d,"
-		" dev node is /dev/%s\n", llkd_miscdev.minor, llkd_miscdev.name);
+		" dev node is /dev/%s\n", ctx->misc.minor, ctx->misc.name);
+	dev_dbg(ctx->dev, "A sample print via the dev_dbg(): driver initialized\n");
+	return 0;
 
-	/*
-	 * A 'managed' kzalloc(): use the 'devres' API devm_kzalloc() for mem
-	 * alloc; why? as the underlying kernel devres framework will take care of
-	 * freeing the memory automatically upon driver 'detach' or when the driver
-	 * is unloaded from memory
-	 */
-	ctx = devm_kzalloc(dev, sizeof(struct drv_ctx), GFP_KERNEL);
-	if (unlikely(!ctx))
-		return -ENOMEM;
+ out_free_ring:
+	kvfree(ctx->ring.buf);
+ out_free_data:
+	drv_secret_free(rcu_dereference_protected(ctx->secret, 1));
+ out_cleanup_srcu:
+	cleanup_srcu_struct(&ctx->srcu);
+ out_free_stats:
+	free_percpu(ctx->stats);
+ out_free_ctx:
+	kfree(ctx);
+	return ret;
+}
 
-	ctx->dev = dev;
-	/* Initialize the "secret" value :-) */
-	strlcpy(ctx->oursecret, "initmsg", 8);
-	dev_dbg(ctx->dev, "A sample print via the dev_dbg(): driver initialized\n");
+static void drv_instance_destroy(struct drv_ctx *ctx)
+{
+	misc_deregister(&ctx->misc);
+	kvfree(ctx->ring.buf);
+	/* Wait for the pending frees of the old secrets, then free the current one */
+	srcu_barrier(&ctx->srcu);
+	drv_secret_free(rcu_dereference_protected(ctx->secret, 1));
+	cleanup_srcu_struct(&ctx->srcu);
+	free_percpu(ctx->stats);
+	kfree(ctx);
+}
+
+static int __init miscdrv_rdwr_init(void)
+{
+	int i, ret = 0;
+
+	if (shm_pages < 2) {
+		pr_notice("%s: shm_pages (%d) must be >= 2 (header + data), aborting\n",
+			  OURMODNAME, shm_pages);
+		return -EINVAL;
+	}
+	if (bufsize < MAXBYTES) {
+		pr_notice("%s: bufsize (%u) must be >= %d, aborting\n",
+			  OURMODNAME, bufsize, MAXBYTES);
+		return -EINVAL;
+	}
+	if (ring_size && (!is_power_of_2(ring_size) || ring_size < PAGE_SIZE)) {
+		pr_notice("%s: ring_size (%u) must be a power of 2 >= %lu, aborting\n",
+			  OURMODNAME, ring_size, PAGE_SIZE);
+		return -EINVAL;
+	}
+	if (ninstances < 1 || ninstances > MAX_INSTANCES) {
+		pr_notice("%s: ninstances (%d) must be in the range [1-%d], aborting\n",
+			  OURMODNAME, ninstances, MAX_INSTANCES);
+		return -EINVAL;
+	}
+	shm_size = (size_t)shm_pages * PAGE_SIZE;
+
+	path_cache = kmem_cache_create("miscdrv_rdwr_path", PATH_MAX, 0, 0, NULL);
+	if (unlikely(!path_cache))
+		return -ENOMEM;
+	ret = -ENOMEM;
+	secret_cache = kmem_cache_create("miscdrv_rdwr_secret",
+			sizeof(struct drv_secret) + SECRET_CACHE_BYTES, 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (unlikely(!secret_cache))
+		goto out_fail_cache;
+	ctxs = kcalloc(ninstances, sizeof(struct drv_ctx *), GFP_KERNEL);
+	if (unlikely(!ctxs))
+		goto out_fail_secret_cache;
+	for (i = 0; i < ninstances; i++) {
+		ret = drv_instance_create(i);
+		if (ret)
+			goto out_fail;
+	}
 
 	return 0;		/* success */
+ out_fail:
+	while (--i >= 0)
+		drv_instance_destroy(ctxs[i]);
+	kfree(ctxs);
+ out_fail_secret_cache:
+	kmem_cache_destroy(secret_cache);
+ out_fail_cache:
+	kmem_cache_destroy(path_cache);
+	return ret;
 }
 
 static void __exit miscdrv_rdwr_exit(void)
 {
-	misc_deregister(&llkd_miscdev);
+	int i;
+
+	for (i = 0; i < ninstances; i++)
+		drv_instance_destroy(ctxs[i]);
+	kfree(ctxs);
+	kmem_cache_destroy(secret_cache);
+	kmem_cache_destroy(path_cache);
 	pr_info("LLKD misc (rdwr) driver deregistered, bye\n");
 }
 
@@ -0,0 +1,74 @@
+/*
+ * ch3/miscdrv_rdwr/miscdrv_rdwr.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Debugging"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Debugging
+ *
+ ****************************************************************
+ * Brief Description:
+ * The common header for the miscdrv_rdwr driver and it's userspace test app
+ * (rdwr_test_secret.c): things like the max size of the 'secret', the layout
+ * of the mmap-ed shared data region and the ioctl commands live here, so that
+ * both sides always agree on them.
+ */
+#ifndef __MISCDRV_RDWR_H__
+#define __MISCDRV_RDWR_H__
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#else
+#include <linux/types.h>
+#include <sys/ioctl.h>
+#endif
+
+/*
+ * The size of the 'secret' that the simple read/write test app works with; the
+ * driver accepts (far) larger transfers, up to it's 'bufsize' module parameter
+ * (which can't be below this)
+ */
+#define MAXBYTES    128
+
+/*
+ * The mmap-ed shared data region.
+ * The driver exposes a (page-backed) region via mmap(2); it's first page holds
+ * the control 'header' below, the data area begins at offset @data_off (the
+ * next page boundary) and is @data_size bytes long.
+ * The 'doorbell' protocol:
+ *  write side: the app places up to @data_size bytes into the data area and
+ *   then 'rings the doorbell' via ioctl(fd, MISCDRV_IOC_COMMIT, &len); the
+ *   driver consumes the data in place - no copy_from_user(), no bounce buffer -
+ *   and passes back, in len, the # of bytes it kept.
+ *  read side: ioctl(fd, MISCDRV_IOC_FETCH, &len) has the driver place it's
+ *   data into the data area; the app reads it straight from the mapping.
+ * The driver bumps @seq on every commit/fetch.
+ */
+struct miscdrv_shm_hdr {
+	__u32 magic;
+	__u32 data_off;		/* offset of the data area from the start of the mapping */
+	__u32 data_size;	/* size of the data area in bytes */
+	__u32 len;		/* # of valid bytes in the data area (after a fetch) */
+	__u64 seq;
+};
+#define MISCDRV_SHM_MAGIC	0x4c4b4421	/* "LKD!" */
+
+/* The driver statistics, as returned by the GETSTATS ioctl */
+struct miscdrv_stats {
+	__u64 tx;		/* bytes 'transmitted' (read by apps) */
+	__u64 rx;		/* bytes 'received' (written by apps) */
+	__u64 err;		/* # of failed operations */
+	__u64 allocs;		/* # of 'secret' objects allocated ... */
+	__u64 frees;		/* ... and freed (each write allocates one) */
+};
+
+/* The ioctl commands */
+#define MISCDRV_IOC_MAGIC	'L'
+#define MISCDRV_IOC_COMMIT	_IOWR(MISCDRV_IOC_MAGIC, 1, __u32)
+#define MISCDRV_IOC_FETCH	_IOR(MISCDRV_IOC_MAGIC, 2, __u32)
+#define MISCDRV_IOC_GETSTATS	_IOR(MISCDRV_IOC_MAGIC, 3, struct miscdrv_stats)
+
+#endif				/* #ifndef __MISCDRV_RDWR_H__ */
@@ -16,10 +16,33 @@
  * Also, again as a demo, we use the read(2) to retreive the 'secret' <eye-roll>
  * from the driver within kernel-space. Equivalently, one can use the write(2)
  * change the 'secret' (just plain text).
+ * The 'b' (benchmark) option compares the throughput of the usual read/write
+ * path against the driver's mmap-ed shared region + 'doorbell' (ioctl) path.
+ * The 's' option retrieves the driver's statistics (via the GETSTATS ioctl).
+ * The 'o' option is a microbenchmark of the driver's open/release path: it
+ * reports the open+close(2) pairs per second it manages.
+ * The 'v' option benchmarks batched (vectored) I/O: readv/writev(2) and
+ * preadv2(2) with RWF_NOWAIT vs the one-buffer-per-syscall read/write(2).
+ * The 'p' option streams data through the driver when it's loaded in it's
+ * streaming (ring buffer) mode: a writer process and a poll(2)-driven reader
+ * process, reporting the throughput.
+ * The 'c' option is a reader-heavy concurrency benchmark: several reader
+ * threads hammer the 'secret' while a writer thread keeps replacing it; it
+ * reports how the read rate scales with the # of readers and checks every
+ * read for a torn (half old, half new) secret.
+ * The 't' option is a load generator: N threads, each pinned to a CPU, issue a
+ * mix of reads and writes for a given duration (or # of ops), recording each
+ * op's latency in a log-linear histogram; it reports the ops/s along with the
+ * p50/p99/p99.9 and max latencies. Use it to check every change to the
+ * driver's methods for throughput and tail latency regressions.
+ * The 'z' option compares moving the driver's data into a file via read(2) +
+ * write(2) against splice(2)-ing it (device -> pipe -> file), zero-copy wrt
+ * userspace.
  *
  * For details, please refer the book, Ch 1.
  * License: Dual MIT/GPL
  */
+#define _GNU_SOURCE		/* preadv2(2) */
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -28,18 +51,896 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include "miscdrv_rdwr.h"	/* MAXBYTES, the shared region layout, ioctl's */
 
-#define MAXBYTES    128		/* Must match the driver; we should actually use a
-				 * common header file for things like this */
+#define BENCH_DEF_MB	64	/* default # of MB moved each way by the benchmark */
+#define BENCH_DEF_SECS	5	/* default duration of the open/close benchmark */
+#define BENCH_DEF_IOVCNT 64	/* default # of segments per vectored I/O call */
+#define CONC_STEP_SECS	2	/* duration of each step of the concurrency benchmark */
+#define LOAD_DEF_RDPCT	90	/* default % of reads in the load generator's mix */
 static int stay_alive;
 
 static inline void usage(char *prg)
 {
 	fprintf(stderr,
-		"Usage: %s opt=read/write device_file [\"secret-msg\"]\n"
+		"Usage: %s opt=read/write/bench/stats/openclose/vectored/pipe/concurrent/threads/zerocopy device_file [\"secret-msg\" | MB | secs | iovcnt | nreaders | nthreads [duration] [read%%] | outfile [MB]]\n"
 		" opt = 'r' => we shall issue the read(2), retrieving the 'secret' form the driver\n"
 		" opt = 'w' => we shall issue the write(2), writing the secret message <secret-msg>\n"
-		"  (max %d bytes)\n", prg, MAXBYTES);
+		"  (max %d bytes)\n"
+		" opt = 'b' => benchmark: compare read/write vs mmap+doorbell throughput,\n"
+		"  moving [MB] megabytes each way (default %d)\n"
+		" opt = 's' => retrieve and show the driver statistics\n"
+		" opt = 'o' => benchmark: open+close(2) the device file for [secs] seconds\n"
+		"  (default %d) and report the rate achieved\n"
+		" opt = 'v' => benchmark: batched I/O, [iovcnt] %d-byte segments per\n"
+		"  readv/writev(2) (default %d) vs one per read/write(2)\n"
+		" opt = 'p' => benchmark: stream [MB] megabytes (default %d) through the driver\n"
+		"  (requires it be loaded in streaming mode, i.e., with ring_size=<n>)\n"
+		" opt = 'c' => benchmark: 1, 2, 4, ... [nreaders] reader threads (default: # of\n"
+		"  CPUs) read the secret while a writer thread keeps changing it; %d s per step\n"
+		" opt = 't' => load generator: [nthreads] threads (default: # of CPUs), each pinned\n"
+		"  to a CPU, issue a read/write mix for [duration]: <n>s seconds, or <n> ops per\n"
+		"  thread (default %ds); [read%%] is the %% of reads (default %d). Reports ops/s\n"
+		"  and the p50/p99/p99.9/max latencies\n"
+		" opt = 'z' => benchmark: copy [MB] megabytes (default %d) of the driver's data to\n"
+		"  <outfile> via read+write(2) vs splice(2) (mailbox mode, bufsize >= 64 KB)\n",
+		prg, MAXBYTES, BENCH_DEF_MB, BENCH_DEF_SECS, MAXBYTES, BENCH_DEF_IOVCNT,
+		BENCH_DEF_MB, CONC_STEP_SECS, BENCH_DEF_SECS, LOAD_DEF_RDPCT, BENCH_DEF_MB);
+}
+
+/* Retrieve and show the driver's (folded per-cpu) statistics */
+static int show_stats(const char *prg, const char *devfile)
+{
+	struct miscdrv_stats st;
+	int fd = open(devfile, O_RDONLY);
+
+	if (fd == -1) {
+		fprintf(stderr, "%s: open(2) on %s failed\n", prg, devfile);
+		perror("open");
+		return -1;
+	}
+	if (ioctl(fd, MISCDRV_IOC_GETSTATS, &st) < 0) {
+		perror("ioctl(GETSTATS) failed");
+		close(fd);
+		return -1;
+	}
+	printf("%s: stats: tx=%llu rx=%llu err=%llu allocs=%llu frees=%llu\n", devfile,
+	       (unsigned long long)st.tx, (unsigned long long)st.rx,
+	       (unsigned long long)st.err, (unsigned long long)st.allocs,
+	       (unsigned long long)st.frees);
+	close(fd);
+	return 0;
+}
+
+/*------------------------ Benchmark ('b') -------------------------------*/
+
+static inline double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_report(const char *what, size_t bytes, long calls, double secs)
+{
+	printf(" %-28s: %10zu bytes in %8ld calls, %8.3f s : %10.2f MB/s, %8.0f ns/call\n",
+	       what, bytes, calls, secs, bytes / secs / (1024 * 1024), secs * 1e9 / calls);
+}
+
+/*
+ * Move 'total' bytes to and from the driver, first via the usual write(2) /
+ * read(2) path - where each call costs a copy_[from|to]_user() (plus a bounce
+ * buffer alloc on write) - then via the mmap-ed shared region, where the data's
+ * produced / consumed in place and each doorbell (ioctl) hands it over.
+ * Every call, on either path, offers MAXBYTES, and we count only the bytes
+ * the driver says it actually took (or gave); the app touches every byte it
+ * 'produces' (the memset) in both cases too, so the comparison is fair.
+ */
+static int bench(const char *prg, const char *devfile, size_t total)
+{
+	int fd, ret = -1;
+	char buf[MAXBYTES];
+	size_t done;
+	ssize_t n;
+	long calls;
+	double t0;
+	void *shm = MAP_FAILED;
+	struct miscdrv_shm_hdr *hdr;
+	size_t shm_size;
+	__u32 len;
+
+	fd = open(devfile, O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "%s: open(2) on %s failed\n", prg, devfile);
+		perror("open");
+		return -1;
+	}
+	printf("%s: benchmarking %s, %zu MB each way\n", prg, devfile, total >> 20);
+
+	/* 1. the usual write(2) path */
+	calls = 0;
+	t0 = now_sec();
+	for (done = 0; done < total; done += n, calls++) {
+		memset(buf, 'a' + (calls % 26), MAXBYTES - 1);
+		buf[MAXBYTES - 1] = '\0';
+		n = write(fd, buf, MAXBYTES);
+		if (n <= 0) {
+			perror("write failed");
+			goto out;
+		}
+	}
+	bench_report("write(2)", done, calls, now_sec() - t0);
+
+	/* 2. the usual read(2) path */
+	calls = 0;
+	t0 = now_sec();
+	for (done = 0; done < total; done += n, calls++) {
+		n = read(fd, buf, MAXBYTES);
+		if (n <= 0) {
+			perror("read failed");
+			goto out;
+		}
+	}
+	bench_report("read(2)", done, calls, now_sec() - t0);
+
+	/* 3. the mmap-ed shared region: first, query it's layout via the header */
+	hdr = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		perror("mmap (header) failed");
+		goto out;
+	}
+	if (hdr->magic != MISCDRV_SHM_MAGIC) {
+		fprintf(stderr, "%s: bad shared region magic 0x%x\n", prg, hdr->magic);
+		munmap(hdr, getpagesize());
+		goto out;
+	}
+	shm_size = hdr->data_off + hdr->data_size;
+	munmap(hdr, getpagesize());
+
+	shm = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		perror("mmap failed");
+		goto out;
+	}
+	hdr = shm;
+
+	/* the same MAXBYTES per call as above; 'len' comes back as what the driver took */
+	calls = 0;
+	t0 = now_sec();
+	for (done = 0; done < total; done += len, calls++) {
+		memset((char *)shm + hdr->data_off, 'a' + (calls % 26), MAXBYTES - 1);
+		((char *)shm + hdr->data_off)[MAXBYTES - 1] = '\0';
+		len = MAXBYTES;
+		if (ioctl(fd, MISCDRV_IOC_COMMIT, &len) < 0 || !len) {
+			perror("ioctl(COMMIT) failed");
+			goto out;
+		}
+	}
+	bench_report("mmap + doorbell (commit)", done, calls, now_sec() - t0);
+
+	calls = 0;
+	t0 = now_sec();
+	for (done = 0; done < total; done += len, calls++) {
+		if (ioctl(fd, MISCDRV_IOC_FETCH, &len) < 0 || !len) {
+			perror("ioctl(FETCH) failed");
+			goto out;
+		}
+	}
+	bench_report("mmap + doorbell (fetch)", done, calls, now_sec() - t0);
+	ret = 0;
+ out:
+	if (shm != MAP_FAILED)
+		munmap(shm, shm_size);
+	close(fd);
+	return ret;
+}
+
+/*
+ * The open/release path microbenchmark: open+close(2) the device file in a
+ * tight loop for 'secs' seconds. Run it once with the driver's open/release
+ * debug prints off (the default) and once with them on, f.e.:
+ *  echo -n "module miscdrv_rdwr +p" > /sys/kernel/debug/dynamic_debug/control
+ * to see what the (pathname-resolving) debug prints cost.
+ */
+static int bench_openclose(const char *prg, const char *devfile, int secs)
+{
+	long n = 0;
+	double t0 = now_sec(), t;
+	int fd, i;
+
+	printf("%s: open+close(2) on %s for %d s ...\n", prg, devfile, secs);
+	do {
+		/* check the clock only every so often, it's not free either */
+		for (i = 0; i < 1000; i++, n++) {
+			fd = open(devfile, O_RDONLY);
+			if (fd == -1) {
+				fprintf(stderr, "%s: open(2) on %s failed\n", prg, devfile);
+				perror("open");
+				return -1;
+			}
+			close(fd);
+		}
+		t = now_sec() - t0;
+	} while (t < secs);
+	printf(" %ld open+close pairs in %.3f s : %.0f per sec, %.0f ns per pair\n",
+	       n, t, n / t, t * 1e9 / n);
+	return 0;
+}
+
+/*
+ * The batched I/O benchmark: move BENCH_DEF_MB to and from the driver, first
+ * with one MAXBYTES buffer per read/write(2), then with 'iovcnt' MAXBYTES
+ * segments per readv/writev(2) - a single syscall (and a single pass through
+ * the driver's read_iter/write_iter methods) each - and finally via
+ * preadv2(2) with RWF_NOWAIT (the driver never blocks, so it's allowed).
+ * Note that iovcnt * MAXBYTES must not exceed the driver's 'bufsize'.
+ */
+static int bench_vec(const char *prg, const char *devfile, int iovcnt)
+{
+	size_t total = (size_t)BENCH_DEF_MB << 20, done, per_call = (size_t)iovcnt * MAXBYTES;
+	struct iovec *iov = NULL;
+	char *buf = NULL;
+	int fd, i, ret = -1;
+	long calls;
+	double t0;
+	ssize_t n;
+
+	fd = open(devfile, O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "%s: open(2) on %s failed\n", prg, devfile);
+		perror("open");
+		return -1;
+	}
+	buf = malloc(per_call);
+	iov = calloc(iovcnt, sizeof(struct iovec));
+	if (!buf || !iov) {
+		fprintf(stderr, "%s: out of memory!\n", prg);
+		goto out;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		iov[i].iov_base = buf + i * MAXBYTES;
+		iov[i].iov_len = MAXBYTES;
+	}
+	memset(buf, 'v', per_call);
+	printf("%s: benchmarking batched I/O on %s, %d MB each way, %d x %d-byte segments per vectored call\n",
+	       prg, devfile, BENCH_DEF_MB, iovcnt, MAXBYTES);
+
+	calls = 0;
+	t0 = now_sec();
+	for (done = 0; done < total; done += n, calls++) {
+		n = write(fd, buf, MAXBYTES);
+		if (n < 0) {
+			perror("write failed");
+			goto out;
+		}
+		if (n < MAXBYTES) {
+			fprintf(stderr, "%s: short write (%zd of %d bytes)\n", prg, n, MAXBYTES);
+			goto out;
+		}
+	}
+	bench_report("write(2)", done, calls, now_sec() - t0);
+
+	calls = 0;
+	t0 = now_sec();
+	for (done = 0; done < total; done += n, calls++) {
+		n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			perror("writev failed (is iovcnt * MAXBYTES > the driver's bufsize?)");
+			goto out;
+		}
+		if ((size_t)n < per_call) {
+			fprintf(stderr, "%s: short writev (%zd of %zu bytes)\n", prg, n, per_call);
+			goto out;
+		}
+	}
+	bench_report("writev(2)", done, calls, now_sec() - t0);
+
+	/* the 'secret' is now per_call bytes long; the reads below get all of it */
+	calls = 0;
+	t0 = now_sec();
+	for (done = 0; done < total; done += n, calls++) {
+		n = read(fd, buf, MAXBYTES);
+		if (n < 0) {
+			perror("read failed");
+			goto out;
+		}
+		if (n < MAXBYTES) {
+			fprintf(stderr, "%s: short read (%zd of %d bytes)\n", prg, n, MAXBYTES);
+			goto out;
+		}
+	}
+	bench_report("read(2)", done, calls, now_sec() - t0);
+
+	calls = 0;
+	t0 = now_sec();
+	for (done = 0; done < total; done += n, calls++) {
+		n = readv(fd, iov, iovcnt);
+		if (n <= 0) {
+			perror("readv failed");
+			goto out;
+		}
+	}
+	bench_report("readv(2)", done, calls, now_sec() - t0);
+
+#ifdef RWF_NOWAIT
+	calls = 0;
+	t0 = now_sec();
+	for (done = 0; done < total; done += n, calls++) {
+		n = preadv2(fd, iov, iovcnt, -1, RWF_NOWAIT);
+		if (n <= 0) {
+			perror("preadv2(RWF_NOWAIT) failed");
+			goto out;
+		}
+	}
+	bench_report("preadv2(2) + RWF_NOWAIT", done, calls, now_sec() - t0);
+#endif
+	ret = 0;
+ out:
+	free(iov);
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+/*
+ * The streaming benchmark: with the driver in streaming (ring buffer) mode, a
+ * child process drains the device - non-blocking reads, waiting in poll(2)
+ * when it's empty - while we (the parent) fill it with blocking writes.
+ */
+#define STREAM_CHUNK	(64 * 1024)
+static int bench_stream(const char *prg, const char *devfile, size_t total)
+{
+	static char buf[STREAM_CHUNK];
+	size_t done;
+	double t0, secs;
+	pid_t pid;
+	int fd, status;
+	ssize_t n;
+
+	t0 = now_sec();
+	pid = fork();
+	if (pid < 0) {
+		perror("fork failed");
+		return -1;
+	}
+	if (pid == 0) {		/* the child: the reader (consumer) */
+		struct pollfd pfd;
+
+		fd = open(devfile, O_RDONLY | O_NONBLOCK);
+		if (fd == -1) {
+			perror("open (reader)");
+			_exit(EXIT_FAILURE);
+		}
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		for (done = 0; done < total; ) {
+			n = read(fd, buf, STREAM_CHUNK);
+			if (n > 0) {
+				done += n;
+				continue;
+			}
+			if (n < 0 && errno != EAGAIN) {
+				perror("read failed");
+				_exit(EXIT_FAILURE);
+			}
+			if (poll(&pfd, 1, -1) < 0) {
+				perror("poll failed");
+				_exit(EXIT_FAILURE);
+			}
+		}
+		close(fd);
+		_exit(EXIT_SUCCESS);
+	}
+
+	/* the parent: the writer (producer) */
+	fd = open(devfile, O_WRONLY);
+	if (fd == -1) {
+		fprintf(stderr, "%s: open(2) on %s failed\n", prg, devfile);
+		perror("open");
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	memset(buf, 'p', STREAM_CHUNK);
+	for (done = 0; done < total; done += n) {
+		n = write(fd, buf, STREAM_CHUNK);
+		if (n < 0) {
+			perror("write failed (is the driver in streaming mode?)");
+			close(fd);
+			kill(pid, SIGTERM);
+			return -1;
+		}
+	}
+	close(fd);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "%s: the reader failed\n", prg);
+		return -1;
+	}
+	secs = now_sec() - t0;
+	printf("%s: streamed %zu MB through %s in %.3f s : %.2f MB/s\n",
+	       prg, total >> 20, devfile, secs, total / secs / (1024 * 1024));
+	return 0;
+}
+
+/*
+ * The zero-copy benchmark: move 'total' bytes of the driver's data into
+ * 'outfile', first via read(2) + write(2) - so every byte is copied up into
+ * our buffer and then back down again - then via splice(2): device -> pipe,
+ * pipe -> file, the data never leaving the kernel.
+ * We first make the 'secret' STREAM_CHUNK bytes long, so that each read (or
+ * splice) of the device returns that much; this needs the driver to be in it's
+ * (default) mailbox mode, with a bufsize of at least STREAM_CHUNK.
+ */
+static int bench_splice(const char *prg, const char *devfile, const char *outfile,
+			size_t total)
+{
+	static char buf[STREAM_CHUNK];
+	int fd, ofd = -1, pfd[2] = { -1, -1 }, ret = -1;
+	size_t done;
+	ssize_t n, m, left;
+	long calls;
+	double t0;
+
+	fd = open(devfile, O_RDWR);
+	if (fd == -1) {
+		fprintf(stderr, "%s: open(2) on %s failed\n", prg, devfile);
+		perror("open");
+		return -1;
+	}
+	memset(buf, 'z', STREAM_CHUNK);
+	if (write(fd, buf, STREAM_CHUNK) != STREAM_CHUNK) {
+		perror("write of the secret failed (mailbox mode, bufsize >= 64 KB?)");
+		goto out;
+	}
+	printf("%s: copying %zu MB from %s to %s ...\n", prg, total >> 20, devfile, outfile);
+
+	/* 1. read(2) + write(2) */
+	ofd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (ofd == -1) {
+		perror("open of the output file failed");
+		goto out;
+	}
+	t0 = now_sec();
+	for (done = 0, calls = 0; done < total; done += n, calls++) {
+		n = read(fd, buf, STREAM_CHUNK);
+		if (n <= 0) {
+			perror("read failed");
+			goto out;
+		}
+		if (write(ofd, buf, n) != n) {
+			perror("write failed");
+			goto out;
+		}
+	}
+	bench_report("read+write", done, calls, now_sec() - t0);
+	close(ofd);
+
+	/* 2. splice(2): device -> pipe -> file */
+	ofd = open(outfile, O_WRONLY | O_TRUNC);
+	if (ofd == -1) {
+		perror("open of the output file failed");
+		goto out;
+	}
+	if (pipe(pfd) < 0) {
+		perror("pipe failed");
+		goto out;
+	}
+	fcntl(pfd[1], F_SETPIPE_SZ, STREAM_CHUNK);
+	t0 = now_sec();
+	for (done = 0, calls = 0; done < total; done += n, calls++) {
+		n = splice(fd, NULL, pfd[1], NULL, STREAM_CHUNK, SPLICE_F_MOVE);
+		if (n <= 0) {
+			perror("splice (device -> pipe) failed");
+			goto out;
+		}
+		for (left = n; left; left -= m) {
+			m = splice(pfd[0], NULL, ofd, NULL, left, SPLICE_F_MOVE);
+			if (m <= 0) {
+				perror("splice (pipe -> file) failed");
+				goto out;
+			}
+		}
+	}
+	bench_report("splice (dev->pipe->file)", done, calls, now_sec() - t0);
+	ret = 0;
+ out:
+	if (pfd[0] != -1) {
+		close(pfd[0]);
+		close(pfd[1]);
+	}
+	if (ofd != -1)
+		close(ofd);
+	close(fd);
+	return ret;
+}
+
+/*
+ * The reader-heavy concurrency benchmark.
+ * The writer thread cycles through 26 secrets: secret k is the letter 'a'+k
+ * repeated conc_len(k) times (the lengths differ too). So a reader can verify
+ * each and every read on it's own: all bytes must be the same letter and the
+ * length must be the one that goes with it; anything else is a torn read.
+ * The driver's readers don't lock against each other (or the writer), so the
+ * aggregate read rate should scale with the # of reader threads (up to the #
+ * of CPUs), while the torn count stays at zero.
+ */
+struct conc_thread {
+	pthread_t tid;
+	const char *devfile;
+	long ops, torn;
+	int ret;
+};
+static volatile int conc_stop;
+
+static inline size_t conc_len(int k)
+{
+	return 32 + k * 3;	/* 32 .. 107 bytes, always <= MAXBYTES */
+}
+
+static void *conc_reader(void *arg)
+{
+	struct conc_thread *t = arg;
+	char buf[MAXBYTES];
+	ssize_t n, i;
+	int fd;
+
+	fd = open(t->devfile, O_RDONLY);
+	if (fd == -1) {
+		perror("open (reader)");
+		t->ret = -1;
+		return NULL;
+	}
+	while (!conc_stop) {
+		n = read(fd, buf, MAXBYTES);
+		if (n <= 0) {
+			perror("read failed");
+			t->ret = -1;
+			break;
+		}
+		t->ops++;
+		if (buf[0] < 'a' || buf[0] > 'z') {
+			/* the driver's initial secret; not written by us yet */
+			if (n == 8 && !strcmp(buf, "initmsg"))
+				continue;
+			t->torn++;
+			continue;
+		}
+		if ((size_t)n != conc_len(buf[0] - 'a')) {
+			t->torn++;
+			continue;
+		}
+		for (i = 1; i < n; i++) {
+			if (buf[i] != buf[0]) {
+				t->torn++;
+				break;
+			}
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *conc_writer(void *arg)
+{
+	struct conc_thread *t = arg;
+	char secrets[26][MAXBYTES];
+	int fd, k;
+
+	fd = open(t->devfile, O_WRONLY);
+	if (fd == -1) {
+		perror("open (writer)");
+		t->ret = -1;
+		return NULL;
+	}
+	for (k = 0; k < 26; k++)
+		memset(secrets[k], 'a' + k, conc_len(k));
+	for (k = 0; !conc_stop; k = (k + 1) % 26) {
+		if (write(fd, secrets[k], conc_len(k)) < 0) {
+			perror("write failed");
+			t->ret = -1;
+			break;
+		}
+		t->ops++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static int bench_concurrent(const char *prg, const char *devfile, int nreaders)
+{
+	struct conc_thread *rd, wr;
+	long ops, torn, total_torn = 0;
+	double t0, secs;
+	int nr, i, ret = 0;
+
+	rd = calloc(nreaders, sizeof(struct conc_thread));
+	if (!rd) {
+		perror("calloc failed");
+		return -1;
+	}
+	printf("%s: %d s per step, 1 writer thread; the driver's secret is on %s\n",
+	       prg, CONC_STEP_SECS, devfile);
+	printf(" %8s %14s %16s %14s %8s\n", "readers", "reads/s", "reads/s/reader",
+	       "writes/s", "torn");
+	/* 1, 2, 4, ... readers, ending with exactly 'nreaders' */
+	for (nr = 1; ; nr = (nr * 2 > nreaders) ? nreaders : nr * 2) {
+		conc_stop = 0;
+		memset(rd, 0, nreaders * sizeof(struct conc_thread));
+		memset(&wr, 0, sizeof(wr));
+		wr.devfile = devfile;
+		t0 = now_sec();
+		if (pthread_create(&wr.tid, NULL, conc_writer, &wr)) {
+			perror("pthread_create failed");
+			ret = -1;
+			break;
+		}
+		for (i = 0; i < nr; i++) {
+			rd[i].devfile = devfile;
+			if (pthread_create(&rd[i].tid, NULL, conc_reader, &rd[i])) {
+				perror("pthread_create failed");
+				conc_stop = 1;
+				nr = i;		/* join only the ones we created */
+				ret = -1;
+				break;
+			}
+		}
+		if (!ret)
+			sleep(CONC_STEP_SECS);
+		conc_stop = 1;
+		pthread_join(wr.tid, NULL);
+		for (i = 0; i < nr; i++)
+			pthread_join(rd[i].tid, NULL);
+		secs = now_sec() - t0;
+		if (ret)
+			break;
+
+		ops = torn = 0;
+		for (i = 0; i < nr; i++) {
+			ops += rd[i].ops;
+			torn += rd[i].torn;
+			if (rd[i].ret)
+				ret = -1;
+		}
+		if (wr.ret)
+			ret = -1;
+		total_torn += torn;
+		printf(" %8d %14.0f %16.0f %14.0f %8ld\n",
+		       nr, ops / secs, ops / secs / nr, wr.ops / secs, torn);
+		if (ret || nr == nreaders)
+			break;
+	}
+	free(rd);
+	if (!ret)
+		printf("%s: %s\n", prg, total_torn ? "*** torn reads seen! ***" : "no torn reads");
+	return ret;
+}
+
+/*
+ * A (HDR-style) log-linear latency histogram.
+ * Values below HIST_SUB get a bucket each; above that, each power of 2 range
+ * is split into HIST_SUB equal sub-buckets. So the relative error is bounded
+ * (by 1/HIST_SUB, ~3%) over the entire 64-bit range, with just a couple of
+ * thousand buckets, and recording a value is a handful of instructions.
+ */
+#define HIST_SUB_BITS	5
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+struct hist {
+	uint64_t cnt[HIST_BUCKETS];
+	uint64_t n, max;
+};
+
+static inline int hist_index(uint64_t v)
+{
+	int shift;
+
+	if (v < HIST_SUB)
+		return v;
+	shift = (63 - __builtin_clzll(v)) - HIST_SUB_BITS;
+	return shift * HIST_SUB + (int)(v >> shift);
+}
+
+/* The highest value that maps to bucket @idx */
+static inline uint64_t hist_value(int idx)
+{
+	int shift = idx / HIST_SUB - 1;
+
+	if (shift <= 0)
+		return idx;
+	return ((uint64_t)(idx - shift * HIST_SUB + 1) << shift) - 1;
+}
+
+static inline void hist_record(struct hist *h, uint64_t v)
+{
+	h->cnt[hist_index(v)]++;
+	h->n++;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void hist_merge(struct hist *to, const struct hist *from)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		to->cnt[i] += from->cnt[i];
+	to->n += from->n;
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+/* The value at percentile @pct (0-100) */
+static uint64_t hist_pct(const struct hist *h, double pct)
+{
+	uint64_t want = (uint64_t)(h->n * pct / 100.0 + 0.5), seen = 0;
+	int i;
+
+	if (!want)
+		want = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->cnt[i];
+		if (seen >= want)
+			return hist_value(i) < h->max ? hist_value(i) : h->max;
+	}
+	return h->max;
+}
+
+static void hist_report(const char *what, const struct hist *h, double secs)
+{
+	if (!h->n) {
+		printf(" %-6s: no ops\n", what);
+		return;
+	}
+	printf(" %-6s: %10llu ops, %10.0f ops/s; latency (ns): p50 %8llu  p99 %8llu"
+	       "  p99.9 %8llu  max %10llu\n", what, (unsigned long long)h->n, h->n / secs,
+	       (unsigned long long)hist_pct(h, 50), (unsigned long long)hist_pct(h, 99),
+	       (unsigned long long)hist_pct(h, 99.9), (unsigned long long)h->max);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * The load generator.
+ * Each thread has it's own fd (so, in the driver, it's own open file context)
+ * and it's own histograms, so the threads share nothing but the driver itself.
+ */
+struct load_thread {
+	pthread_t tid;
+	const char *devfile;
+	int cpu;		/* pinned to this CPU */
+	int rdpct;		/* % of reads */
+	long nops;		/* run for this many ops; 0 => until load_stop */
+	long errs;
+	struct hist rd, wr;
+};
+static volatile int load_stop;
+
+static void *load_thread(void *arg)
+{
+	struct load_thread *t = arg;
+	char buf[MAXBYTES];
+	uint32_t rnd = t->cpu * 2654435761U + 1;	/* per-thread xorshift PRNG state */
+	uint64_t t0, t1;
+	cpu_set_t cpus;
+	long i;
+	ssize_t n;
+	int fd, rd;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(t->cpu, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+		fprintf(stderr, "warning: couldn't pin a thread to CPU %d\n", t->cpu);
+	fd = open(t->devfile, O_RDWR);
+	if (fd == -1) {
+		perror("open (load thread)");
+		t->errs++;
+		return NULL;
+	}
+	memset(buf, 'a' + t->cpu % 26, MAXBYTES);
+	for (i = 0; t->nops ? i < t->nops : !load_stop; i++) {
+		rnd ^= rnd << 13;
+		rnd ^= rnd >> 17;
+		rnd ^= rnd << 5;
+		rd = (int)(rnd % 100) < t->rdpct;
+
+		t0 = now_ns();
+		n = rd ? read(fd, buf, MAXBYTES) : write(fd, buf, MAXBYTES);
+		t1 = now_ns();
+		if (n < 0) {
+			perror(rd ? "read failed" : "write failed");
+			t->errs++;
+			break;
+		}
+		hist_record(rd ? &t->rd : &t->wr, t1 - t0);
+	}
+	close(fd);
+	return NULL;
+}
+
+static int bench_load(const char *prg, const char *devfile, int nthreads, int secs,
+		      long nops, int rdpct)
+{
+	struct load_thread *th;
+	struct hist *rd, *wr, *all;
+	int ncpus = sysconf(_SC_NPROCESSORS_ONLN), i, ret = 0;
+	double t0, elapsed;
+	long errs = 0;
+
+	if (ncpus <= 0)
+		ncpus = 1;
+	th = calloc(nthreads, sizeof(struct load_thread));
+	rd = calloc(3, sizeof(struct hist));
+	if (!th || !rd) {
+		perror("calloc failed");
+		free(th);
+		free(rd);
+		return -1;
+	}
+	wr = rd + 1;
+	all = rd + 2;
+
+	if (nops)
+		printf("%s: %d thread(s), %ld ops each, %d%% reads, on %s ...\n",
+		       prg, nthreads, nops, rdpct, devfile);
+	else
+		printf("%s: %d thread(s) for %d s, %d%% reads, on %s ...\n",
+		       prg, nthreads, secs, rdpct, devfile);
+	load_stop = 0;
+	t0 = now_sec();
+	for (i = 0; i < nthreads; i++) {
+		th[i].devfile = devfile;
+		th[i].cpu = i % ncpus;
+		th[i].rdpct = rdpct;
+		th[i].nops = nops;
+		if (pthread_create(&th[i].tid, NULL, load_thread, &th[i])) {
+			perror("pthread_create failed");
+			nthreads = i;	/* join only the ones we created */
+			nops = 0;
+			ret = -1;
+			break;
+		}
+	}
+	if (!nops && !ret)
+		sleep(secs);
+	load_stop = 1;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(th[i].tid, NULL);
+	elapsed = now_sec() - t0;
+
+	for (i = 0; i < nthreads; i++) {
+		hist_merge(rd, &th[i].rd);
+		hist_merge(wr, &th[i].wr);
+		errs += th[i].errs;
+	}
+	hist_merge(all, rd);
+	hist_merge(all, wr);
+	hist_report("read", rd, elapsed);
+	hist_report("write", wr, elapsed);
+	hist_report("all", all, elapsed);
+	if (errs) {
+		fprintf(stderr, "%s: %ld thread(s) hit errors\n", prg, errs);
+		ret = -1;
+	}
+	free(th);
+	free(rd);
+	return ret;
 }
 
 int main(int argc, char **argv)
@@ -56,10 +957,105 @@ int main(int argc, char **argv)
 	}
 
 	opt = argv[1][0];
-	if (opt != 'r' && opt != 'w') {
+	if (opt != 'r' && opt != 'w' && opt != 'b' && opt != 's' && opt != 'o' && opt != 'v'
+	    && opt != 'p' && opt != 'c' && opt != 't' && opt != 'z') {
 		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
+	if ('z' == opt) {
+		if (argc < 4) {
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		if (argc == 5)
+			num = strtoul(argv[4], NULL, 0);
+		if (!num)
+			num = BENCH_DEF_MB;
+		if (bench_splice(argv[0], argv[2], argv[3], num << 20) < 0)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+	if ('t' == opt) {
+		int nthreads = (argc >= 4 ? atoi(argv[3]) : 0), secs = BENCH_DEF_SECS;
+		int rdpct = (argc >= 6 ? atoi(argv[5]) : LOAD_DEF_RDPCT);
+		long nops = 0;
+		char *end;
+
+		if (nthreads <= 0)
+			nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads <= 0)
+			nthreads = 1;
+		if (argc >= 5) {	/* "<n>s" is a duration, plain "<n>" an op count */
+			nops = strtol(argv[4], &end, 0);
+			if (*end == 's') {
+				secs = nops;
+				nops = 0;
+			}
+			if (nops < 0 || secs <= 0) {
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (rdpct < 0 || rdpct > 100) {
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		if (bench_load(argv[0], argv[2], nthreads, secs, nops, rdpct) < 0)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+	if ('c' == opt) {
+		int nreaders = (argc == 4 ? atoi(argv[3]) : 0);
+
+		if (nreaders <= 0)
+			nreaders = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nreaders <= 0)
+			nreaders = 1;
+		if (bench_concurrent(argv[0], argv[2], nreaders) < 0)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+	if ('p' == opt) {
+		if (argc == 4)
+			num = strtoul(argv[3], NULL, 0);
+		if (!num)
+			num = BENCH_DEF_MB;
+		if (bench_stream(argv[0], argv[2], num << 20) < 0)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+	if ('v' == opt) {
+		int iovcnt = (argc == 4 ? atoi(argv[3]) : 0);
+
+		if (iovcnt <= 0 || iovcnt > IOV_MAX)
+			iovcnt = BENCH_DEF_IOVCNT;
+		if (bench_vec(argv[0], argv[2], iovcnt) < 0)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+	if ('o' == opt) {
+		int secs = (argc == 4 ? atoi(argv[3]) : 0);
+
+		if (secs <= 0)
+			secs = BENCH_DEF_SECS;
+		if (bench_openclose(argv[0], argv[2], secs) < 0)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+	if ('s' == opt) {
+		if (show_stats(argv[0], argv[2]) < 0)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+	if ('b' == opt) {
+		if (argc == 4)
+			num = strtoul(argv[3], NULL, 0);
+		if (!num)
+			num = BENCH_DEF_MB;
+		if (bench(argv[0], argv[2], num << 20) < 0)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
 	if ((opt == 'w' && argc != 4) || (opt == 'r' && argc != 3)) {
 		usage(argv[0]);
 		exit(EXIT_FAILURE);
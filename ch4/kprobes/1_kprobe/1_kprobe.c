@@ -17,6 +17,10 @@
  * perhaps being issued often... leading to your thinking that the kprobe
  * isn't working. It is... so, trying with other functions can be helpful
  * at times...
+ * With the 'kret' module parameter set to 1, we instead set up a kretprobe
+ * that measures the function's true duration - entry to return - into a
+ * latency histogram; see it via
+ *  cat /sys/kernel/debug/1_kprobe/duration
  *
  * For details, please refer the book, Ch 4.
  */
@@ -32,16 +36,31 @@
 #include <linux/ptrace.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/debugfs.h>
 #include "../../../convenient.h"
+#include "../common/kp_kret.h"
 
 MODULE_AUTHOR("<insert your name here>");
 MODULE_DESCRIPTION("LKD book:ch4/kprobes/1_kprobe: simple Kprobes 1st demo module");
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_VERSION("0.1");
 
+#if 1
+#define PROBE_FUNC	"do_sys_open"
+#else
+#define PROBE_FUNC	"kmem_cache_alloc"
+#endif
+
+static int kret;
+module_param(kret, int, 0444);
+MODULE_PARM_DESC(kret, "Set to 1 to measure " PROBE_FUNC "()'s true duration (entry to"
+		 " return) via a kretprobe, instead of the kprobe (defaults to 0)");
+
 static spinlock_t lock;
 static struct kprobe kpb;
 static u64 tm_start, tm_end;
+static struct kp_kret kr;
+static struct dentry *dbgfs_dir;
 
 /*
  * This probe runs just prior to the function "do_sys_open()" is invoked.
@@ -87,6 +106,21 @@ NOKPROBE_SYMBOL(handler_fault);
 
 static int __init kprobe_lkm_init(void)
 {
+	int ret;
+
+	if (kret) {
+		ret = kp_kret_register(&kr, PROBE_FUNC, NULL);
+		if (ret) {
+			pr_alert("register_kretprobe on %s() failed (%d)!\n", PROBE_FUNC, ret);
+			return ret;
+		}
+		dbgfs_dir = debugfs_create_dir(KBUILD_MODNAME, NULL);
+		debugfs_create_file("duration", 0644, dbgfs_dir, &kr, &kp_kret_fops);
+		pr_info("registered kretprobe @ '%s()'; see <debugfs>/%s/duration\n",
+			PROBE_FUNC, KBUILD_MODNAME);
+		return 0;
+	}
+
 	/* Register the kprobe handler */
 	kpb.pre_handler = handler_pre;
 	kpb.post_handler = handler_post;
@@ -94,16 +128,12 @@ static int __init kprobe_lkm_init(void)
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 14, 0)
 	kpb.fault_handler = handler_fault;
 #endif
-#if 1
-	kpb.symbol_name = "do_sys_open";
-#else
-	kpb.symbol_name = "kmem_cache_alloc";
-#endif
+	kpb.symbol_name = PROBE_FUNC;
 	if (register_kprobe(&kpb)) {
-		pr_alert("register_kprobe on do_sys_open() failed!\n");
+		pr_alert("register_kprobe on %s() failed!\n", PROBE_FUNC);
 		return -EINVAL;
 	}
-	pr_info("registering kernel probe @ 'do_sys_open()'\n");
+	pr_info("registering kernel probe @ '%s()'\n", PROBE_FUNC);
 	spin_lock_init(&lock);
 
 	return 0;		/* success */
@@ -111,8 +141,12 @@ static int __init kprobe_lkm_init(void)
 
 static void __exit kprobe_lkm_exit(void)
 {
-	unregister_kprobe(&kpb);
-	pr_info("bye, unregistering kernel probe @ 'do_sys_open()'\n");
+	if (kret) {
+		debugfs_remove_recursive(dbgfs_dir);
+		kp_kret_unregister(&kr);
+	} else
+		unregister_kprobe(&kpb);
+	pr_info("bye, unregistering kernel probe @ '%s()'\n", PROBE_FUNC);
 }
 
 module_init(kprobe_lkm_init);
@@ -15,6 +15,28 @@
  * soft-coding it via a module parameter (to the open system call);
  * via a module parameter.
  *
+ * With the 'kret' module parameter set to 1, we instead set up a kretprobe
+ * that measures the function's true duration - entry to return - into a
+ * latency histogram; see it via
+ *  cat /sys/kernel/debug/2_kprobe/duration
+ *
+ * Which tasks we care about is decided at runtime, via the filter (see
+ * ../common/kp_filter.h): pass the initial one via the 'filter' module
+ * parameter (f.e. filter="comm=vi*"), and change it via
+ *  echo "pid=1234 cpus=0-1" > /sys/kernel/debug/2_kprobe/filter
+ *
+ * With evring=<n>, we don't printk at all: each hit's written - as a binary
+ * record, with the function's args - into a per-cpu event ring (see
+ * ../common/kp_evring.h) that userspace mmap()s:
+ *  ../common/kp_evdecode -f /sys/kernel/debug/2_kprobe/events
+ *
+ * What's reported - printk'ed or logged as events - can be cut down at
+ * runtime, via 1-in-N sampling and/or a max rate (see ../common/kp_ratectl.h):
+ *  echo "sample=10 rate=100" > /sys/kernel/debug/2_kprobe/ratectl
+ * (or via the sample / max_rate module parameters); reading the file shows
+ * the counts, and, with selftime=1, the handler's own overhead. In kretprobe
+ * mode, they cut down the invocations that are timed.
+ *
  * For details, please refer the book, Ch 4.
  */
 #define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
@@ -29,15 +51,26 @@
 #include <linux/ptrace.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/debugfs.h>
 #include "../../../convenient.h"
+#include "../common/kp_kret.h"
+#include "../common/kp_filter.h"
+#include "../common/kp_evring.h"
+#include "../common/kp_ratectl.h"
 
 MODULE_AUTHOR("<insert your name here>");
 MODULE_DESCRIPTION("LKD book:ch4/2_kprobes/2_kprobe: simple Kprobes demo module with modparam");
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_VERSION("0.1");
 
+/* Build with SKIP_IF_NOT_VI defined to have the filter default to 'vi' */
 #undef SKIP_IF_NOT_VI
 //#define SKIP_IF_NOT_VI
+#ifdef SKIP_IF_NOT_VI
+#define DEF_FILTER	"comm=vi*"
+#else
+#define DEF_FILTER	NULL
+#endif
 
 static spinlock_t lock;
 static struct kprobe kpb;
@@ -52,6 +85,39 @@ static int verbose;
 module_param(verbose, int, 0644);
 MODULE_PARM_DESC(verbose, "Set to 1 to get verbose printk's (defaults to 0).");
 
+static int kret;
+module_param(kret, int, 0444);
+MODULE_PARM_DESC(kret, "Set to 1 to measure the function's true duration (entry to return)"
+		 " via a kretprobe, instead of the kprobe (defaults to 0)");
+static struct kp_kret kr;
+static struct dentry *dbgfs_dir;
+
+static char *filter = DEF_FILTER;
+module_param(filter, charp, 0);
+MODULE_PARM_DESC(filter, "The initial task filter, f.e. \"comm=vi*,bash cpus=0-3\"; see"
+		 " ../common/kp_filter.h (change it at runtime via <debugfs>/" KBUILD_MODNAME "/filter)");
+static struct kp_filter filt;
+
+static int evring;
+module_param(evring, int, 0444);
+MODULE_PARM_DESC(evring, "# of records in the per-cpu binary event rings, used instead of"
+		 " printk; 0 (the default) disables them");
+static struct kp_evring evr;
+
+static struct kp_ratectl rc;
+module_param_named(sample, rc.sample, uint, 0644);
+MODULE_PARM_DESC(sample, "Report only 1 in every 'sample' (filtered) hits; 0 (the default)"
+		 " or 1 => all of them");
+module_param_named(max_rate, rc.max_rate, uint, 0644);
+MODULE_PARM_DESC(max_rate, "Report at most these many hits a second; 0 (the default) => no limit");
+
+static int selftime;
+module_param(selftime, int, 0644);
+MODULE_PARM_DESC(selftime, "Set to 1 to measure the pre-handler's own overhead; see"
+		 " <debugfs>/" KBUILD_MODNAME "/ratectl (defaults to 0)");
+/* did this CPU's last pre-handler report the hit? (so that the post-handler does too) */
+static DEFINE_PER_CPU(bool, reported);
+
 /*
  * This probe runs just prior to the function "kprobe_func()" is invoked.
  * Here, we're assuming you've setup a kprobe into the do_sys_open():
@@ -59,19 +125,33 @@ MODULE_PARM_DESC(verbose, "Set to 1 to get verbose printk's (defaults to 0).");
  */
 static int handler_pre(struct kprobe *p, struct pt_regs *regs)
 {
-#ifdef SKIP_IF_NOT_VI
-	/* For the purpose of this demo, we only log information when the process
-	 * context is 'vi'
+	u64 t0 = kp_selftime_begin(selftime);
+
+	/* For the purpose of this demo, we only log information for the tasks
+	 * that pass the filter (f.e. when the process context is 'vi'), and, of
+	 * those, only what the sampling / rate limit allows
 	 */
-	if (strncmp(current->comm, "vi", 2))
-		return 0;
-#endif
+	__this_cpu_write(reported, false);
+	if (!kp_filter_match(&filt) || !kp_rate_allow(&rc))
+		goto out;
 
+	if (evring) {
+		struct kp_ev *ev = kp_evring_reserve(&evr, 0, KP_EV_ENTRY);
+
+		if (ev) {
+			kp_ev_args(ev, regs);
+			kp_evring_commit(&evr);
+		}
+		goto out;
+	}
+
+	__this_cpu_write(reported, true);
 	PRINT_CTX();
 	spin_lock(&lock);
 	tm_start = ktime_get_real_ns();
 	spin_unlock(&lock);
-
+ out:
+	kp_selftime_end(&rc, t0);
 	return 0;
 }
 
@@ -80,10 +160,8 @@ static int handler_pre(struct kprobe *p, struct pt_regs *regs)
  */
 static void handler_post(struct kprobe *p, struct pt_regs *regs, unsigned long flags)
 {
-#ifdef SKIP_IF_NOT_VI
-    if (strncmp(current->comm, "vi", 2))
-        return;
-#endif
+	if (!__this_cpu_read(reported))
+		return;
 
 	spin_lock(&lock);
 	tm_end = ktime_get_real_ns();
@@ -95,6 +173,16 @@ static void handler_post(struct kprobe *p, struct pt_regs *regs, unsigned long f
 	spin_unlock(&lock);
 }
 
+/*
+ * In kretprobe mode: only time the invocations made by the tasks passing the
+ * filter, and, of those, the ones the sampling / rate limit let through
+ */
+static bool kret_skip(struct kp_kret *k, struct pt_regs *regs)
+{
+	return !kp_filter_match(&filt) || !kp_rate_allow(&rc);
+}
+NOKPROBE_SYMBOL(kret_skip);
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 14, 0)
 /*
  * fault_handler: this is called if an exception is generated for any
@@ -112,6 +200,8 @@ NOKPROBE_SYMBOL(handler_fault);
 
 static int __init kprobe_lkm_init(void)
 {
+	int ret;
+
 	/* Verify that the function to kprobe has been passed as a parameter to
 	 * this module
 	 */
@@ -126,6 +216,40 @@ static int __init kprobe_lkm_init(void)
 	 * __kprobes or nokprobe_inline annotation nor marked via the NOKPROBE_SYMBOL
 	 * macro
 	 */
+	ret = kp_filter_init(&filt, filter);
+	if (ret) {
+		pr_warn("invalid filter \"%s\" (%d)\n", filter, ret);
+		return ret;
+	}
+	ret = kp_ratectl_init(&rc, rc.sample, rc.max_rate);
+	if (ret) {
+		kp_filter_exit(&filt);
+		return ret;
+	}
+	dbgfs_dir = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("filter", 0644, dbgfs_dir, &filt, &kp_filter_fops);
+	debugfs_create_file("ratectl", 0644, dbgfs_dir, &rc, &kp_ratectl_fops);
+
+	if (kret) {
+		ret = kp_kret_register(&kr, kprobe_func, kret_skip);
+		if (ret) {
+			pr_alert("register_kretprobe on '%s' failed (%d)!\n", kprobe_func, ret);
+			goto out_fail;
+		}
+		debugfs_create_file("duration", 0644, dbgfs_dir, &kr, &kp_kret_fops);
+		pr_info("registered kretprobe @ '%s'; see <debugfs>/%s/duration\n",
+			kprobe_func, KBUILD_MODNAME);
+		return 0;
+	}
+
+	if (evring) {
+		ret = kp_evring_init(&evr, evring);
+		if (ret)
+			goto out_fail;
+		/* the regular debugfs file's proxy doesn't do mmap */
+		debugfs_create_file_unsafe("events", 0600, dbgfs_dir, &evr, &kp_evring_fops);
+	}
+
 	/* Register the kprobe handler */
 	kpb.pre_handler = handler_pre;
 	kpb.post_handler = handler_post;
@@ -137,20 +261,34 @@ static int __init kprobe_lkm_init(void)
 		pr_alert("register_kprobe failed!\n\
 Check: is function '%s' invalid, static, inline; or blacklisted: attribute-marked '__kprobes'\n\
 or nokprobe_inline, or is marked with the NOKPROBE_SYMBOL macro?\n", kprobe_func);
-		return -EINVAL;
+		ret = -EINVAL;
+		goto out_fail;
 	}
 	pr_info("registering kernel probe @ '%s'\n", kprobe_func);
-#ifdef SKIP_IF_NOT_VI
-	pr_info("NOTE: Skipping if not vi ...\n");
-#endif
+	if (filter)
+		pr_info("NOTE: only tracing the tasks passing the filter \"%s\" ...\n", filter);
 	spin_lock_init(&lock);
 
 	return 0;		/* success */
+
+ out_fail:
+	debugfs_remove_recursive(dbgfs_dir);
+	kp_evring_free(&evr);
+	kp_ratectl_free(&rc);
+	kp_filter_exit(&filt);
+	return ret;
 }
 
 static void __exit kprobe_lkm_exit(void)
 {
-	unregister_kprobe(&kpb);
+	debugfs_remove_recursive(dbgfs_dir);
+	if (kret)
+		kp_kret_unregister(&kr);
+	else
+		unregister_kprobe(&kpb);
+	kp_evring_free(&evr);
+	kp_ratectl_free(&rc);
+	kp_filter_exit(&filt);
 	pr_info("bye, unregistering kernel probe @ '%s'\n", kprobe_func);
 }
 
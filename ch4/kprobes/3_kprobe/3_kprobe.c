@@ -16,6 +16,24 @@
  * opened (useful!).
  * To gain access to the second parameter (holding the pointer to the file
  * being opened), we use our knowledge of the relevant processor ABI.
+ * The pathname's copied in - without sleeping, as we're in atomic context -
+ * into a slot of this CPU's ring of records; read the file to drain them all
+ * (in batches; it's 'EOF' once they're all consumed):
+ *  cat /sys/kernel/debug/3_kprobe/fnames
+ * The per-cpu ring has a single producer - the handler, on that CPU - and a
+ * single consumer - the reader - so it's lock-free; when a ring's full, the new
+ * records are dropped (and counted; see the 'fnames_stats' file).
+ *
+ * With the 'kret' module parameter set to 1, we instead set up a kretprobe
+ * that measures the function's true duration - entry to return - into a
+ * latency histogram; see it via
+ *  cat /sys/kernel/debug/3_kprobe/duration
+ *
+ * Which tasks we care about is decided at runtime, via the filter (see
+ * ../common/kp_filter.h); by default, it's just 'vi' (skip_if_not_vi=1).
+ * Pass another via the 'filter' module parameter, or change it on the fly:
+ *  echo "comm=bash cgroup=$(stat -c %i /sys/fs/cgroup/user.slice)" > \
+ *      /sys/kernel/debug/3_kprobe/filter
  *
  * For details, please refer the book, Ch 4.
  */
@@ -31,7 +49,13 @@
 #include <linux/ptrace.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
 #include "../../../convenient.h"
+#include "../common/kp_kret.h"
+#include "../common/kp_filter.h"
 
 MODULE_AUTHOR("<insert your name here>");
 MODULE_DESCRIPTION("LKD book:ch4/kprobes/3_kprobe: simple Kprobes demo module with fname displayed");
@@ -41,7 +65,6 @@ MODULE_VERSION("0.1");
 static spinlock_t lock;
 static struct kprobe kpb;
 static u64 tm_start, tm_end;
-static char *fname;
 
 #define MAX_FUNCNAME_LEN  64
 static char kprobe_func[MAX_FUNCNAME_LEN];
@@ -52,9 +75,190 @@ static int verbose;
 module_param(verbose, int, 0644);
 MODULE_PARM_DESC(verbose, "Set to 1 to get verbose printk's (defaults to 0).");
 
+static int kret;
+module_param(kret, int, 0444);
+MODULE_PARM_DESC(kret, "Set to 1 to measure the function's true duration (entry to return)"
+		 " via a kretprobe, instead of the kprobe (defaults to 0)");
+static struct kp_kret kr;
+static struct dentry *dbgfs_dir;
+
 static int skip_if_not_vi = 1;
-module_param(skip_if_not_vi, int, 0644);
-MODULE_PARM_DESC(skip_if_not_vi, "Set to 1 to ONLY see printk's when vi runs and opens files (default=1).");
+module_param(skip_if_not_vi, int, 0444);
+MODULE_PARM_DESC(skip_if_not_vi, "Set to 1 to ONLY see printk's when vi runs and opens files (default=1)."
+		 " Just sets the initial filter to \"comm=vi*\", if 'filter' isn't passed.");
+
+static char *filter;
+module_param(filter, charp, 0);
+MODULE_PARM_DESC(filter, "The initial task filter, f.e. \"comm=vi*,bash cpus=0-3\"; see"
+		 " ../common/kp_filter.h (change it at runtime via <debugfs>/" KBUILD_MODNAME "/filter)");
+static struct kp_filter filt;
+
+static int ring_entries = 256;
+module_param(ring_entries, int, 0444);
+MODULE_PARM_DESC(ring_entries, "# of pathname records per-cpu ring (rounded up to a power of 2; default 256)");
+
+/* One captured pathname; longer ones are truncated */
+#define FNAME_LEN	256
+struct fname_rec {
+	u64 ts;
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
+	char name[FNAME_LEN];
+};
+
+/*
+ * A per-cpu ring: the producer (the handler) advances head, the consumer (the
+ * reader) tail; both are free running, the slot's at (index & (entries-1))
+ */
+struct fname_ring {
+	unsigned long head, tail;
+	unsigned long dropped, faults;
+	struct fname_rec *recs;
+};
+static DEFINE_PER_CPU(struct fname_ring, fname_rings);
+static DEFINE_MUTEX(drain_lock);	/* serializes the consumers */
+#define FNAMES_READ_MAX	(128 * 1024)
+
+/*
+ * Copy the pathname at @ufname into the next free slot of this CPU's ring;
+ * called from the kprobe handler, so: no sleeping (we use the 'nofault' copy,
+ * which simply fails if the page isn't resident) and no locking.
+ */
+static void fname_capture(const char __user *ufname)
+{
+	struct fname_ring *r = this_cpu_ptr(&fname_rings);
+	unsigned long head = r->head;
+	struct fname_rec *rec;
+	long len;
+
+	if (head - smp_load_acquire(&r->tail) >= ring_entries) {
+		r->dropped++;
+		return;
+	}
+	rec = &r->recs[head & (ring_entries - 1)];
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	len = strncpy_from_user_nofault(rec->name, ufname, FNAME_LEN);
+#else
+	len = strncpy_from_unsafe_user(rec->name, ufname, FNAME_LEN);
+#endif
+	if (len < 0) {
+		r->faults++;
+		return;
+	}
+	rec->name[FNAME_LEN - 1] = '\0';
+	rec->ts = ktime_get_real_ns();
+	rec->pid = current->pid;
+	memcpy(rec->comm, current->comm, TASK_COMM_LEN);
+	/* publish the record: the consumer's acquire pairs with this */
+	smp_store_release(&r->head, head + 1);
+}
+NOKPROBE_SYMBOL(fname_capture);
+
+/*
+ * debugfs: reading the 'fnames' file drains (consumes) as many of the captured
+ * records - from all the CPUs' rings - as fit, as text lines:
+ *  timestamp(ns) cpu pid comm pathname
+ * A buffer too small for even the first pending record gets -EINVAL (not 0:
+ * that'd look like EOF to the reader, with records still queued).
+ */
+static ssize_t fnames_read(struct file *file, char __user *ubuf,
+			   size_t count, loff_t *ppos)
+{
+	char line[FNAME_LEN + 64], *kbuf;
+	size_t n = 0;
+	ssize_t ret;
+	bool full = false;
+	int cpu, len;
+
+	if (!count)
+		return 0;
+	count = min_t(size_t, count, FNAMES_READ_MAX);
+	kbuf = kvmalloc(count, GFP_KERNEL);
+	if (!kbuf)
+		return -ENOMEM;
+
+	mutex_lock(&drain_lock);
+	for_each_possible_cpu(cpu) {
+		struct fname_ring *r = per_cpu_ptr(&fname_rings, cpu);
+		unsigned long tail = r->tail, head = smp_load_acquire(&r->head);
+
+		for (; tail != head; tail++) {
+			struct fname_rec *rec = &r->recs[tail & (ring_entries - 1)];
+
+			len = snprintf(line, sizeof(line), "%llu %3d %7d %-16s %s\n",
+				       rec->ts, cpu, rec->pid, rec->comm, rec->name);
+			if (n + len > count)
+				break;
+			memcpy(kbuf + n, line, len);
+			n += len;
+		}
+		/* hand the consumed slots back to the producer */
+		smp_store_release(&r->tail, tail);
+		if (tail != head) {	/* the user buffer's full */
+			full = true;
+			break;
+		}
+	}
+	mutex_unlock(&drain_lock);
+
+	ret = (!n && full) ? -EINVAL : n;
+	if (n && copy_to_user(ubuf, kbuf, n))
+		ret = -EFAULT;
+	kvfree(kbuf);
+	return ret;
+}
+
+static const struct file_operations fnames_fops = {
+	.owner = THIS_MODULE,
+	.open = nonseekable_open,
+	.read = fnames_read,
+};
+
+/* debugfs: the 'fnames_stats' file: per-cpu ring occupancy and losses */
+static int fnames_stats_show(struct seq_file *m, void *unused)
+{
+	int cpu;
+
+	seq_printf(m, "%3s %10s %12s %10s %10s\n", "cpu", "pending", "captured", "dropped", "faults");
+	for_each_possible_cpu(cpu) {
+		struct fname_ring *r = per_cpu_ptr(&fname_rings, cpu);
+		unsigned long head = READ_ONCE(r->head);
+
+		seq_printf(m, "%3d %10lu %12lu %10lu %10lu\n", cpu, head - READ_ONCE(r->tail),
+			   head, READ_ONCE(r->dropped), READ_ONCE(r->faults));
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fnames_stats);
+
+static void fname_rings_free(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kvfree(per_cpu_ptr(&fname_rings, cpu)->recs);
+		per_cpu_ptr(&fname_rings, cpu)->recs = NULL;
+	}
+}
+
+static int fname_rings_alloc(void)
+{
+	int cpu;
+
+	if (ring_entries < 2)
+		ring_entries = 2;
+	ring_entries = roundup_pow_of_two(ring_entries);
+	for_each_possible_cpu(cpu) {
+		struct fname_ring *r = per_cpu_ptr(&fname_rings, cpu);
+
+		r->recs = kvcalloc(ring_entries, sizeof(struct fname_rec), GFP_KERNEL);
+		if (!r->recs) {
+			fname_rings_free();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
 
 /*
  * This probe runs just prior to the function "kprobe_func()" is invoked.
@@ -67,13 +271,11 @@ static int handler_pre(struct kprobe *p, struct pt_regs *regs)
 {
 	char *param_fname_reg;
 
-	if (skip_if_not_vi) {
-	    /* For the purpose of this demo, we only log information when the process
-	     * context is 'vi'
-	     */
-		if (strncmp(current->comm, "vi", 2))
-			return 0;
- 	}
+	/* For the purpose of this demo, we only log information for the tasks
+	 * that pass the filter (by default, when the process context is 'vi')
+	 */
+	if (!kp_filter_match(&filt))
+		return 0;
 
 #ifdef CONFIG_X86
 	param_fname_reg = (char __user *)regs->si;
@@ -97,7 +299,8 @@ static int handler_pre(struct kprobe *p, struct pt_regs *regs)
 	param_fname_reg = (char __user *)regs->regs[1];
 #endif
 
-	PRINT_CTX();
+	if (verbose)
+		PRINT_CTX();
 	/*
 	 * We want the filename; to get it, we *must* copy it in from it's userspace
 	 * buffer, the pointer to which is in an arch-specific register.
@@ -107,31 +310,13 @@ static int handler_pre(struct kprobe *p, struct pt_regs *regs)
 	 * [ 2552.898142] BUG: sleeping function called from invalid context at lib/strncpy_from_user.c:117
 	 * [ 2552.904085] in_atomic(): 1, irqs_disabled(): 0, non_block: 0, pid: 390, name: systemd-journal
 	 * [ ... ]
-	 * [ 2542.112886] Call Trace:
-	 * [ 2542.112892]  dump_stack+0xbd/0xfa
-	 * [ 2542.112897]  ___might_sleep.cold+0x63/0x74
-	 * [ 2542.112902]  __might_sleep+0x73/0xe0
-	 * [ 2542.112908]  __might_fault+0x52/0xd0
-	 * [ 2542.112912]  strncpy_from_user+0x2b/0x280
-	 * [ 2542.112919]  ? handler_pre+0x1dd/0x2e0 [kprobe_lkm]
-	 * [ 2542.118917] [390] kprobe_lkm:handler_pre(): 003)  systemd-journal :390   |  ...1   \* handler_pre() *\
-	 * [ 2542.124541]  handler_pre+0x97/0x2e0 [kprobe_lkm]
-	 * [ ... ]
 	 * (shows up ONLY on our debug kernel!)
-	 * Not really much choice here, we use it ...   :-/
+	 * So we use the 'nofault' variant instead: it never sleeps (it fails if the
+	 * user page isn't resident; that's rare here, as the process has just
+	 * passed the pathname). And we copy into this CPU's own ring slot - not a
+	 * global buffer - so concurrent opens on other CPUs don't clobber it.
 	 */
-#if 1
-	if (!strncpy_from_user(fname, param_fname_reg, PATH_MAX))
-#else
-	/* Attempting to use the 'usual' copy_from_user() here simply causes a hard
-	 * hang... avoid it */
-	if (!copy_from_user(fname, (const char __user *)regs->si,
-			    strnlen_user((const char __user *)regs->si, PATH_MAX)))
-#endif
-		return -EFAULT;
-
-	pr_info("FILE being opened: reg:0x%px   fname:%s\n",
-		(void *)param_fname_reg, fname);
+	fname_capture((const char __user *)param_fname_reg);
 
 	spin_lock(&lock);
 	tm_start = ktime_get_real_ns();
@@ -145,13 +330,8 @@ static int handler_pre(struct kprobe *p, struct pt_regs *regs)
  */
 static void handler_post(struct kprobe *p, struct pt_regs *regs, unsigned long flags)
 {
-	if (skip_if_not_vi) {
-	    /* For the purpose of this demo, we only log information when the process
-	     * context is 'vi'
-	     */
-		if (strncmp(current->comm, "vi", 2))
-			return;
-	}
+	if (!kp_filter_match(&filt))
+		return;
 
 	spin_lock(&lock);
 	tm_end = ktime_get_real_ns();
@@ -163,6 +343,13 @@ static void handler_post(struct kprobe *p, struct pt_regs *regs, unsigned long f
 	spin_unlock(&lock);
 }
 
+/* In kretprobe mode: honour the filter as well */
+static bool kret_skip(struct kp_kret *k, struct pt_regs *regs)
+{
+	return !kp_filter_match(&filt);
+}
+NOKPROBE_SYMBOL(kret_skip);
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 14, 0)
 /*
  * fault_handler: this is called if an exception is generated for any
@@ -180,6 +367,8 @@ NOKPROBE_SYMBOL(handler_fault);
 
 static int __init kprobe_lkm_init(void)
 {
+	int ret;
+
 	/* Verify that the function to kprobe has been passed as a parameter to
 	 * this module
 	 */
@@ -187,7 +376,16 @@ static int __init kprobe_lkm_init(void)
 		pr_warn("expect a valid kprobe_func=<func_name> module parameter");
 		return -EINVAL;
 	}
-	pr_info("FYI, skip_if_not_vi is %s, verbose=%d\n", (skip_if_not_vi==1?"on":"off"), verbose);
+	if (!filter && skip_if_not_vi)
+		filter = "comm=vi*";
+	pr_info("FYI, filter is \"%s\", verbose=%d\n", filter ? filter : "(none)", verbose);
+	ret = kp_filter_init(&filt, filter);
+	if (ret) {
+		pr_warn("invalid filter \"%s\" (%d)\n", filter, ret);
+		return ret;
+	}
+	dbgfs_dir = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("filter", 0644, dbgfs_dir, &filt, &kp_filter_fops);
 
 	/********* Possible SECURITY concern:
 	 * We just assume the function pointer passed is valid and okay.
@@ -195,9 +393,23 @@ static int __init kprobe_lkm_init(void)
 	 * __kprobes or nokprobe_inline annotation nor marked via the NOKPROBE_SYMBOL
 	 * macro (and isn't blacklisted).
 	 */
-	fname = kzalloc(PATH_MAX, GFP_ATOMIC);
-	if (unlikely(!fname))
-		return -ENOMEM;
+	if (kret) {
+		ret = kp_kret_register(&kr, kprobe_func, kret_skip);
+		if (ret) {
+			pr_alert("register_kretprobe on '%s' failed (%d)!\n", kprobe_func, ret);
+			goto out_fail;
+		}
+		debugfs_create_file("duration", 0644, dbgfs_dir, &kr, &kp_kret_fops);
+		pr_info("registered kretprobe @ '%s'; see <debugfs>/%s/duration\n",
+			kprobe_func, KBUILD_MODNAME);
+		return 0;
+	}
+
+	ret = fname_rings_alloc();
+	if (ret)
+		goto out_fail;
+	debugfs_create_file("fnames", 0444, dbgfs_dir, NULL, &fnames_fops);
+	debugfs_create_file("fnames_stats", 0444, dbgfs_dir, NULL, &fnames_stats_fops);
 
 	/* Register the kprobe handler */
 	kpb.pre_handler = handler_pre;
@@ -210,18 +422,31 @@ static int __init kprobe_lkm_init(void)
 		pr_alert("register_kprobe failed!\n\
 Check: is function '%s' invalid, static, inline; or blacklisted: attribute-marked '__kprobes'\n\
 or nokprobe_inline, or is marked with the NOKPROBE_SYMBOL macro?\n", kprobe_func);
-		return -EINVAL;
+		ret = -EINVAL;
+		goto out_fail;
 	}
-	pr_info("registering kernel probe @ '%s'\n", kprobe_func);
+	pr_info("registering kernel probe @ '%s'; pathnames via <debugfs>/%s/fnames\n",
+		kprobe_func, KBUILD_MODNAME);
 	spin_lock_init(&lock);
 
 	return 0;		/* success */
+
+ out_fail:
+	debugfs_remove_recursive(dbgfs_dir);
+	fname_rings_free();
+	kp_filter_exit(&filt);
+	return ret;
 }
 
 static void __exit kprobe_lkm_exit(void)
 {
-	kfree(fname);
-	unregister_kprobe(&kpb);
+	debugfs_remove_recursive(dbgfs_dir);
+	if (kret)
+		kp_kret_unregister(&kr);
+	else
+		unregister_kprobe(&kpb);
+	fname_rings_free();	/* only once the handlers can no longer run */
+	kp_filter_exit(&filt);
 	pr_info("bye, unregistering kernel probe @ '%s'\n", kprobe_func);
 }
 
@@ -12,19 +12,51 @@
  ****************************************************************
  * Brief Description:
  * Our kprobes demo #4:
- * Traditional, semi-automated manual approach: a helper script generates a
- * template for both the kernel module C code and the Makefile, enabling
- * attaching a kprobe to a given function via module parameter.
+ * A generic, resident, kprobe 'helper' module: it's built (and inserted) just
+ * once; the set of functions it probes is then changed at runtime by writing
+ * to it's control file:
+ *  echo "+do_sys_open,vfs_read" > /sys/kernel/debug/helper_kp/control
+ *  echo "-vfs_read" > /sys/kernel/debug/helper_kp/control
+ *  echo "clear" > /sys/kernel/debug/helper_kp/control
+ * (reading it shows the functions currently probed). The helper script
+ * kp_load.sh builds and inserts the module if required, and then just writes
+ * to the control file; so attaching a probe is a matter of milliseconds, not
+ * of a kernel module build. The 'funcname' module parameter optionally gives
+ * the initial set of functions to probe.
  *
- * This 'C' source will act as a template:
- * the helper script kp_load.sh will:
- *  copy it into a tmp/ folder (with name-timestamp.c format), a 
- *  Makefile built for it, it will be built (as a .ko) and, finally, 
- *  will be passed the name of a kernel or kernel module's function and 
- *  verbosity flag (during insmod).
- *
- * The job of this "helper" module is to setup the kprobe given the address.
  * The function must not be marked 'static' or 'inline' in the kernel / LKM.
+ * Several functions can be probed at once: a control file write (as well as
+ * 'funcname') can be a comma-separated list (kp_load.sh expands globs - like
+ * 'vfs_*' - into one); they're all registered in one batch, via
+ * register_kprobes().
+ *
+ * The latencies are recorded - locklessly - into per-cpu histograms (and not
+ * printk'ed on every hit), one per probed function; read them via debugfs:
+ *  cat /sys/kernel/debug/helper_kp/latency
+ * (writing to the file resets them), and a one-line-per-function summary
+ * (hits, min/avg/max, ...) via:
+ *  cat /sys/kernel/debug/helper_kp/stats
+ * With kret=1, we use kretprobes instead, measuring the functions' true
+ * duration (entry to return); the histograms are in the 'duration' file.
+ * Only the tasks passing the filter (see ../common/kp_filter.h) are counted;
+ * set it via the 'filter' module parameter and/or, on the fly, via
+ *  echo "comm=bash,vi* cpus=0-3" > /sys/kernel/debug/helper_kp/filter
+ * With evring=<n>, every (filtered) hit is also written - as a binary record:
+ * the function's entry args, and the latency - into a per-cpu event ring
+ * (see ../common/kp_evring.h) that userspace mmap()s; f.e.:
+ *  ../common/kp_evdecode -f -m /sys/kernel/debug/helper_kp/probe_ids \
+ *      /sys/kernel/debug/helper_kp/events
+ * With show_stack=2, the call paths to the probed functions are profiled:
+ * each (filtered) hit's kernel stack is saved and counted in a table of the
+ * unique stacks (see ../common/kp_stackmap.h) - far cheaper than show_stack=1's
+ * dump_stack() - read out as folded stacks, ready for a flame graph:
+ *  cat /sys/kernel/debug/helper_kp/stacks | flamegraph.pl > kp.svg
+ * What's reported - events, verbose printk's, stacks; not the histograms,
+ * which see every hit - can be cut down per probe, at runtime, via 1-in-N
+ * sampling and/or a max rate (see ../common/kp_ratectl.h):
+ *  echo "vfs_read sample=100 rate=1000" > /sys/kernel/debug/helper_kp/ratectl
+ * ('*' for all the probes); reading the file shows the counts, and, with
+ * selftime=1, the handlers' own overhead.
  *
  * For details, please refer the book, Ch 6.
  * License: MIT
@@ -33,12 +65,27 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
-#include <linux/spinlock.h>
 #include <linux/kprobes.h>
 #include <linux/ptrace.h>
-#include "../../../../convenient.h"
+#include <linux/sched/clock.h>
+#include <linux/debugfs.h>
+#include <linux/hashtable.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include "../../../convenient.h"
+#include "../common/kp_hist.h"
+#include "../common/kp_kret.h"
+#include "../common/kp_filter.h"
+#include "../common/kp_evring.h"
+#include "../common/kp_stackmap.h"
+#include "../common/kp_ratectl.h"
+
+#define MODULE_VER 		"0.2"
 
-#define MODULE_VER 		"0.1"
+#define MAX_SYMS	128	/* max # of functions probed at once */
+#define CTL_MAX_BYTES	(32 * 1024)	/* max size of a control file write */
 
 static char *funcname;
 /* module_param (var, type, sysfs_entry_permissions); 
@@ -46,7 +93,9 @@ static char *funcname;
  */
 module_param(funcname, charp, 0);
 MODULE_PARM_DESC(funcname,
-"Function name of the target (LKM's) function to attach probe to.");
+"Function name of the target (LKM's) function to initially attach probe to; or a"
+" comma-separated list of them (max " __stringify(MAX_SYMS) "). Optional; the probe set"
+" can be changed at runtime via <debugfs>/" KBUILD_MODNAME "/control");
 
 static int verbose;
 module_param(verbose, int, 0644);
@@ -54,29 +103,132 @@ MODULE_PARM_DESC(verbose, "Set to 1 to get verbose printk's (defaults to 0).");
 
 static int show_stack;
 module_param(show_stack, int, 0644);
-MODULE_PARM_DESC(show_stack, "Set to 1 to dump the kernel-mode stack; defaults to 0).");
+MODULE_PARM_DESC(show_stack, "Set to 1 to dump the kernel-mode stack, to 2 to just count the"
+		 " unique stacks (read them via <debugfs>/" KBUILD_MODNAME "/stacks); defaults to 0");
+static struct kp_stackmap stacks;
+
+static int kret;
+module_param(kret, int, 0444);
+MODULE_PARM_DESC(kret, "Set to 1 to measure the function's true duration (entry to return)"
+		 " via a kretprobe, instead of the kprobe (defaults to 0)");
+
+static char *filter;
+module_param(filter, charp, 0);
+MODULE_PARM_DESC(filter, "The initial task filter, f.e. \"comm=vi*,bash cpus=0-3\"; see"
+		 " ../common/kp_filter.h (change it at runtime via <debugfs>/" KBUILD_MODNAME "/filter)");
+static struct kp_filter filt;
+
+static int evring;
+module_param(evring, int, 0444);
+MODULE_PARM_DESC(evring, "# of records in the per-cpu binary event rings; 0 (the default)"
+		 " disables them");
+static struct kp_evring evr;
 
-static struct kprobe kpb;
-static u64 tm_start = 0, tm_end = 0;
-static int running_avg=0;
-static spinlock_t lock;
+static unsigned int sample;
+module_param(sample, uint, 0644);
+MODULE_PARM_DESC(sample, "Report only 1 in every 'sample' (filtered) hits of the probes added"
+		 " hence; 0 (the default) or 1 => all of them. Per probe, via <debugfs>/"
+		 KBUILD_MODNAME "/ratectl");
+static unsigned int max_rate;
+module_param(max_rate, uint, 0644);
+MODULE_PARM_DESC(max_rate, "Report at most these many hits a second, per probe, for the"
+		 " probes added hence; 0 (the default) => no limit");
+static int selftime;
+module_param(selftime, int, 0644);
+MODULE_PARM_DESC(selftime, "Set to 1 to measure the handlers' own overhead; see"
+		 " <debugfs>/" KBUILD_MODNAME "/ratectl (defaults to 0)");
 
 /*
- * This probe runs just prior to the function "funcname()" is invoked.
+ * One probed function. Only one of the kprobe / kretprobe is used, as per the
+ * 'kret' parameter; the handlers get to their kp_sym via container_of().
+ * The registered probes are on sym_list (in the order they were added; it's
+ * what the debugfs output walks) and in a hash table keyed by the probe
+ * address: that's how we spot aliases (different names, same address), which
+ * would otherwise be probed - and counted - twice.
+ * sym_lock protects both, and nsyms; the probe handlers never look at them.
  */
-static int handler_pre(struct kprobe *p, struct pt_regs *regs)
+struct kp_sym {
+	struct kprobe kp;
+	struct kp_kret kr;
+	struct kp_hist __percpu *hist;	/* kprobe mode; in kret mode, it's kr's */
+	struct hlist_node node;
+	struct list_head list;
+	char *name;
+	u32 id;				/* the event records' probe_id */
+	struct kp_ratectl rc;		/* what's reported: events, printk's, stacks */
+};
+static LIST_HEAD(sym_list);
+static int nsyms;
+#define SYM_HASH_BITS	8
+static DEFINE_HASHTABLE(sym_hash, SYM_HASH_BITS);
+static DEFINE_MUTEX(sym_lock);
+static u32 next_id;		/* never reused, so stale records can't be misattributed */
+
+/*
+ * The pre and post handlers of a given hit run on the same CPU (with
+ * preemption disabled in between), so the start timestamp is simply per-cpu;
+ * no lock, and CPUs hitting the probe concurrently don't clobber each other's
+ * timestamp. (And kprobes don't nest, so one slot serves all our probes).
+ */
+static DEFINE_PER_CPU(u64, tm_start);
+/* did this CPU's last pre-handler report the hit? (then the post-handler does too) */
+static DEFINE_PER_CPU(bool, reported);
+static struct dentry *dbgfs_dir;
+
+static inline void *sym_addr(struct kp_sym *s)
+{
+	return kret ? s->kr.krp.kp.addr : s->kp.addr;
+}
+
+static inline unsigned long sym_nmissed(struct kp_sym *s)
+{
+	return kret ? s->kr.krp.nmissed : s->kp.nmissed;
+}
+
+/*
+ * Report a (filtered) function entry - as per the probe's sampling / rate
+ * limit: as an event, and/or a verbose printk, and/or the stack. Returns
+ * whether it was reported.
+ */
+static __always_inline bool report_entry(struct kp_sym *s, struct pt_regs *regs, void *addr)
 {
-	spin_lock(&lock);
-	tm_start = ktime_get_real_ns();
-	spin_unlock(&lock);
+	struct kp_ev *ev;
 
+	if (!kp_rate_allow(&s->rc))
+		return false;
+	ev = kp_evring_reserve(&evr, s->id, KP_EV_ENTRY);
+	if (ev) {
+		kp_ev_args(ev, regs);
+		kp_evring_commit(&evr);
+	}
 	if (verbose) {
-		pr_debug_ratelimited("%s:%s():Pre '%s'.\n", KBUILD_MODNAME, __func__, funcname);
+		pr_debug_ratelimited("%s:%s():Entry '%s'.\n", KBUILD_MODNAME, __func__, s->name);
 		PRINT_CTX();
 	}
-	if (show_stack)
+	if (show_stack == 1)
 		dump_stack();
+	else if (show_stack == 2)
+		kp_stackmap_record(&stacks, addr);
+	return true;
+}
 
+/*
+ * This probe runs just prior to the function "funcname()" is invoked.
+ */
+static int handler_pre(struct kprobe *p, struct pt_regs *regs)
+{
+	struct kp_sym *s = container_of(p, struct kp_sym, kp);
+	u64 t0 = kp_selftime_begin(selftime);
+
+	if (!kp_filter_match(&filt)) {
+		kp_selftime_end(&s->rc, t0);
+		return 0;
+	}
+	__this_cpu_write(reported, report_entry(s, regs, p->addr));
+	kp_selftime_end(&s->rc, t0);
+
+	/* last, so that the above isn't counted */
+	__this_cpu_write(tm_start, local_clock());
 	return 0;
 }
 
@@ -86,55 +238,619 @@ static int handler_pre(struct kprobe *p, struct pt_regs *regs)
 static void handler_post(struct kprobe *p, struct pt_regs *regs,
 		unsigned long flags)
 {
-	spin_lock(&lock);
-	tm_end = ktime_get_real_ns();
+	struct kp_sym *s = container_of(p, struct kp_sym, kp);
+	struct kp_ev *ev;
+	u64 lat;
+
+	if (!kp_filter_match(&filt))
+		return;
+	lat = local_clock() - __this_cpu_read(tm_start);
+	kp_hist_record(s->hist, lat);
+	if (!__this_cpu_read(reported))
+		return;
+	ev = kp_evring_reserve(&evr, s->id, KP_EV_LATENCY);
+	if (ev) {
+		ev->args[0] = lat;
+		ev->nargs = 1;
+		kp_evring_commit(&evr);
+	}
 
 	if (verbose) {
 		pr_debug_ratelimited("%s:%s():%s:%d. Post '%s'.\n",
-			KBUILD_MODNAME, __func__, current->comm, current->pid, funcname);
+			KBUILD_MODNAME, __func__, current->comm, current->pid, p->symbol_name);
 	}
+}
+
+/*
+ * kretprobe mode: runs on function entry, just before the entry timestamp's
+ * taken; we skip the tasks not passing the filter, and do the reporting
+ * (events, verbose, show_stack) here.
+ */
+static bool kret_entry(struct kp_kret *k, struct pt_regs *regs)
+{
+	struct kp_sym *s = container_of(k, struct kp_sym, kr);
+	u64 t0 = kp_selftime_begin(selftime);
+	bool skip = !kp_filter_match(&filt);
 
-	SHOW_DELTA(tm_end, tm_start);
-	spin_unlock(&lock);
+	if (!skip)
+		report_entry(s, regs, k->krp.kp.addr);
+	kp_selftime_end(&s->rc, t0);
+	return skip;
 }
+NOKPROBE_SYMBOL(kret_entry);
 
-static int __init helper_kp_init_module(void)
+/* Allocate and set up - but don't register - a probe on @name */
+static struct kp_sym *sym_alloc(const char *name)
 {
-	if (!funcname) {
-		pr_info("%s:%s():Must pass funcname as a module parameter\n", KBUILD_MODNAME, __func__);
-		return -EINVAL;
+	struct kp_sym *s;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return NULL;
+	s->name = kstrdup(name, GFP_KERNEL);
+	if (!s->name)
+		goto out_free;
+	s->id = next_id++;
+	if (kp_ratectl_init(&s->rc, sample, max_rate))
+		goto out_free;
+	if (kret) {
+		if (kp_kret_init(&s->kr, s->name, kret_entry))
+			goto out_free;
+		s->hist = s->kr.hist;
+	} else {
+		s->hist = alloc_percpu(struct kp_hist);
+		if (!s->hist)
+			goto out_free;
+		s->kp.pre_handler = handler_pre;
+		s->kp.post_handler = handler_post;
+		s->kp.symbol_name = s->name;
 	}
-	spin_lock_init(&lock);
-	pr_info("%s:%s():kprobe'ing function %s, verbose mode? %s, show stack? %s\n",
-		KBUILD_MODNAME, __func__, funcname, (verbose==1?"Y":"N"), (show_stack==1?"Y":"N"));
+	return s;
+
+ out_free:
+	kp_ratectl_free(&s->rc);
+	kfree(s->name);
+	kfree(s);
+	return NULL;
+}
+
+/* Free @s; it must not be registered (anymore) */
+static void sym_free(struct kp_sym *s)
+{
+	if (kret)
+		kp_kret_free(&s->kr);
+	else
+		free_percpu(s->hist);
+	kp_ratectl_free(&s->rc);
+	kfree(s->name);
+	kfree(s);
+}
+
+static struct kp_sym *sym_find(struct list_head *head, const char *name)
+{
+	struct kp_sym *s;
+
+	list_for_each_entry(s, head, list)
+		if (!strcmp(s->name, name))
+			return s;
+	return NULL;
+}
+
+/* The already probed function that's at the same address as @s, if any */
+static struct kp_sym *sym_alias(struct kp_sym *s)
+{
+	struct kp_sym *t;
+
+	hash_for_each_possible(sym_hash, t, node, (unsigned long)sym_addr(s))
+		if (sym_addr(t) == sym_addr(s))
+			return t;
+	return NULL;
+}
+
+/*
+ * Unregister the @n probes on the list @head, in one batch - so that we wait
+ * for the handlers to drain just once - and free them.
+ */
+static void syms_unregister(struct list_head *head, int n)
+{
+	struct kp_sym *s, *tmp;
+	void **probes;
+	int i = 0;
+
+	probes = kcalloc(n, sizeof(void *), GFP_KERNEL);
+	list_for_each_entry(s, head, list) {
+		if (probes)
+			probes[i++] = kret ? (void *)&s->kr.krp : (void *)&s->kp;
+		else if (kret)
+			unregister_kretprobe(&s->kr.krp);
+		else
+			unregister_kprobe(&s->kp);
+	}
+	if (probes) {
+		if (kret)
+			unregister_kretprobes((struct kretprobe **)probes, i);
+		else
+			unregister_kprobes((struct kprobe **)probes, i);
+		kfree(probes);
+	}
+	list_for_each_entry_safe(s, tmp, head, list) {
+		list_del(&s->list);
+		sym_free(s);
+	}
+}
+
+/*
+ * Register probes on the comma-separated list of functions @names (split in
+ * place), in one batch; the ones already probed are skipped. It's
+ * all-or-nothing: if any one fails, the kernel unregisters those already done;
+ * so, then, we try them one by one just to report the culprit(s).
+ * Called with sym_lock held.
+ */
+static int syms_add(char *names)
+{
+	LIST_HEAD(batch);
+	struct kp_sym *s, *t, *tmp;
+	void **probes;
+	char *name;
+	int n = 0, i = 0, ret;
+
+	while ((name = strsep(&names, ",")) != NULL) {
+		name = strim(name);
+		if (!*name || sym_find(&sym_list, name) || sym_find(&batch, name))
+			continue;
+		if (nsyms + n >= MAX_SYMS) {
+			pr_info("%s:%s():too many functions, max is %d\n",
+				KBUILD_MODNAME, __func__, MAX_SYMS);
+			ret = -E2BIG;
+			goto out_free;
+		}
+		s = sym_alloc(name);
+		if (!s) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+		list_add_tail(&s->list, &batch);
+		n++;
+	}
+	if (!n)
+		return 0;
+
+	probes = kcalloc(n, sizeof(void *), GFP_KERNEL);
+	if (!probes) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	list_for_each_entry(s, &batch, list)
+		probes[i++] = kret ? (void *)&s->kr.krp : (void *)&s->kp;
 
 	/********* Possible SECURITY concern:
- 	 * We just assume the pointer passed is valid and okay.
+ 	 * We just assume the function names passed are valid and okay.
 	 * Our kp_load.sh script has performed basic verification...
  	 */
-	/* Register the kprobe handler */
-	kpb.pre_handler = handler_pre;
-	kpb.post_handler = handler_post;
-	kpb.symbol_name = funcname;
-	if (register_kprobe(&kpb)) {
-		pr_alert("%s:%s():register_kprobe failed!\n"
-		"Check: is function '%s' invalid, static, inline or attribute-marked '__kprobes' ?\n", 
-			KBUILD_MODNAME, __func__, funcname);
-		return -EINVAL;
-	}
-	pr_info("%s:%s():registered kprobe for function %s\n", KBUILD_MODNAME, __func__, funcname);
+	if (kret)
+		ret = register_kretprobes((struct kretprobe **)probes, n);
+	else
+		ret = register_kprobes((struct kprobe **)probes, n);
+	kfree(probes);
+	if (ret) {
+		pr_alert("%s:%s():register_%s failed (%d)!\n", KBUILD_MODNAME, __func__,
+			 kret ? "kretprobes" : "kprobes", ret);
+		list_for_each_entry(s, &batch, list) {
+			int err;
+
+			/* the failed batch may have left the address filled in */
+			if (kret) {
+				s->kr.krp.kp.addr = NULL;
+				err = register_kretprobe(&s->kr.krp);
+				if (!err)
+					unregister_kretprobe(&s->kr.krp);
+			} else {
+				s->kp.addr = NULL;
+				err = register_kprobe(&s->kp);
+				if (!err)
+					unregister_kprobe(&s->kp);
+			}
+			if (err)
+				pr_alert("Check: is function '%s' invalid, static, inline or"
+					 " attribute-marked '__kprobes' ? (%d)\n", s->name, err);
+		}
+		goto out_free;
+	}
+
+	list_for_each_entry_safe(s, tmp, &batch, list) {
+		t = sym_alias(s);
+		if (t) {
+			pr_info("%s:%s():%s is an alias of %s, dropping it\n",
+				KBUILD_MODNAME, __func__, s->name, t->name);
+			if (kret)
+				unregister_kretprobe(&s->kr.krp);
+			else
+				unregister_kprobe(&s->kp);
+			list_del(&s->list);
+			sym_free(s);
+			continue;
+		}
+		hash_add(sym_hash, &s->node, (unsigned long)sym_addr(s));
+		list_move_tail(&s->list, &sym_list);
+		nsyms++;
+	}
+	return 0;
+
+ out_free:
+	list_for_each_entry_safe(s, tmp, &batch, list) {
+		list_del(&s->list);
+		sym_free(s);
+	}
+	return ret;
+}
+
+/*
+ * Unregister (in one batch) the probes on the comma-separated list of
+ * functions @names; a NULL @names means all of them.
+ * Called with sym_lock held.
+ */
+static int syms_remove(char *names)
+{
+	LIST_HEAD(victims);
+	struct kp_sym *s, *tmp;
+	char *name;
+	int n = 0, ret = 0;
+
+	if (!names) {
+		list_for_each_entry_safe(s, tmp, &sym_list, list) {
+			hash_del(&s->node);
+			list_move_tail(&s->list, &victims);
+			n++;
+		}
+	}
+	while (names && (name = strsep(&names, ",")) != NULL) {
+		name = strim(name);
+		if (!*name)
+			continue;
+		s = sym_find(&sym_list, name);
+		if (!s) {
+			pr_info("%s:%s():function '%s' isn't being probed\n",
+				KBUILD_MODNAME, __func__, name);
+			ret = -ENOENT;
+			continue;
+		}
+		hash_del(&s->node);
+		list_move_tail(&s->list, &victims);
+		n++;
+	}
+	if (n)
+		syms_unregister(&victims, n);
+	nsyms -= n;
+	return ret;
+}
+
+/*
+ * debugfs: reading the 'latency' (or 'duration') file shows the histograms,
+ * writing to it resets them
+ */
+static int latency_show(struct seq_file *m, void *unused)
+{
+	char title[192];
+	struct kp_sym *s;
+	int ret = 0;
+
+	mutex_lock(&sym_lock);
+	list_for_each_entry(s, &sym_list, list) {
+		snprintf(title, sizeof(title), "%s @ %s : %s (missed: %lu)",
+			 kret ? "kretprobe" : "kprobe", s->name,
+			 kret ? "entry -> return duration" : "pre -> post handler latency",
+			 sym_nmissed(s));
+		ret = kp_hist_show(m, s->hist, title);
+		if (ret)
+			break;
+		seq_putc(m, '\n');
+	}
+	mutex_unlock(&sym_lock);
+	return ret;
+}
+
+static int latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, latency_show, NULL);
+}
+
+static ssize_t latency_write(struct file *file, const char __user *ubuf,
+			     size_t count, loff_t *ppos)
+{
+	struct kp_sym *s;
+
+	mutex_lock(&sym_lock);
+	list_for_each_entry(s, &sym_list, list)
+		kp_hist_reset(s->hist);
+	mutex_unlock(&sym_lock);
+	return count;
+}
+
+static const struct file_operations latency_fops = {
+	.owner = THIS_MODULE,
+	.open = latency_open,
+	.read = seq_read,
+	.write = latency_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* debugfs: the 'stats' file: a one-line summary per probed function */
+static int stats_show(struct seq_file *m, void *unused)
+{
+	struct kp_hist *t;
+	struct kp_sym *s;
+
+	t = kmalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+	seq_printf(m, "%-18s %-32s %12s %8s %10s %10s %10s %10s\n", "address", "function",
+		   "hits", "missed", "min(ns)", "avg(ns)", "p99(ns)", "max(ns)");
+	mutex_lock(&sym_lock);
+	list_for_each_entry(s, &sym_list, list) {
+		kp_hist_fold(s->hist, t);
+		seq_printf(m, "%-18px %-32s %12llu %8lu %10llu %10llu %10llu %10llu\n",
+			   sym_addr(s), s->name, t->n, sym_nmissed(s), t->min,
+			   t->n ? div64_u64(t->sum, t->n) : 0, kp_hist_pct(t, 990), t->max);
+	}
+	mutex_unlock(&sym_lock);
+	kfree(t);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+/* debugfs: the 'probe_ids' file: the event records' probe_id => function */
+static int probe_ids_show(struct seq_file *m, void *unused)
+{
+	struct kp_sym *s;
+
+	mutex_lock(&sym_lock);
+	list_for_each_entry(s, &sym_list, list)
+		seq_printf(m, "%u %s\n", s->id, s->name);
+	mutex_unlock(&sym_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(probe_ids);
+
+/*
+ * debugfs: the 'ratectl' file. Reading it shows each probe's sampling / rate
+ * limit settings and counts (see ../common/kp_ratectl.h). Writing to it
+ * changes them, a line at a time:
+ *  func|* [sample=N] [rate=N] [reset]
+ */
+static int ratectl_show(struct seq_file *m, void *unused)
+{
+	struct kp_sym *s;
+
+	mutex_lock(&sym_lock);
+	list_for_each_entry(s, &sym_list, list) {
+		seq_printf(m, "%-32s ", s->name);
+		kp_ratectl_show(m, &s->rc);
+	}
+	mutex_unlock(&sym_lock);
+	return 0;
+}
+
+static int ratectl_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ratectl_show, NULL);
+}
+
+/* Apply @spec - the line, past the function name - to the probe(s) matching @name */
+static int ratectl_apply(const char *name, const char *spec)
+{
+	struct kp_sym *s;
+	int ret = -ENOENT;
+
+	list_for_each_entry(s, &sym_list, list) {
+		char *buf;
+
+		if (strcmp(name, "*") && strcmp(name, s->name))
+			continue;
+		buf = kstrdup(spec, GFP_KERNEL);	/* the parsing modifies it */
+		if (!buf)
+			return -ENOMEM;
+		ret = kp_ratectl_parse(&s->rc, buf);
+		kfree(buf);
+		if (ret)
+			break;
+	}
+	return ret;
+}
+
+static ssize_t ratectl_write(struct file *file, const char __user *ubuf,
+			     size_t count, loff_t *ppos)
+{
+	char *kbuf, *p, *line, *name;
+	int ret = 0;
+
+	if (count > CTL_MAX_BYTES)
+		return -E2BIG;
+	kbuf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(kbuf))
+		return PTR_ERR(kbuf);
+
+	mutex_lock(&sym_lock);
+	p = kbuf;
+	while (!ret && (line = strsep(&p, "\n")) != NULL) {
+		line = skip_spaces(line);
+		name = strsep(&line, " \t");
+		if (!*name)
+			continue;
+		ret = ratectl_apply(name, line ? line : "");
+	}
+	mutex_unlock(&sym_lock);
+	kfree(kbuf);
+	return ret ? ret : count;
+}
+
+static const struct file_operations ratectl_fops = {
+	.owner = THIS_MODULE,
+	.open = ratectl_open,
+	.read = seq_read,
+	.write = ratectl_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * debugfs: the 'control' file. Reading it shows the functions being probed,
+ * one per line. Writing to it changes the probe set; it's a (whitespace
+ * separated) sequence of:
+ *  [+]func[,func...]  : probe these function(s) as well
+ *  -func[,func...]    : stop probing these function(s)
+ *  clear              : stop probing all functions
+ */
+static int control_show(struct seq_file *m, void *unused)
+{
+	struct kp_sym *s;
+
+	mutex_lock(&sym_lock);
+	seq_printf(m, "# %s mode: %d of max %d functions probed\n",
+		   kret ? "kretprobe" : "kprobe", nsyms, MAX_SYMS);
+	list_for_each_entry(s, &sym_list, list)
+		seq_printf(m, "%s\n", s->name);
+	mutex_unlock(&sym_lock);
+	return 0;
+}
+
+static int control_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, control_show, NULL);
+}
+
+static ssize_t control_write(struct file *file, const char __user *ubuf,
+			     size_t count, loff_t *ppos)
+{
+	char *kbuf, *p, *tok;
+	int ret = 0;
+
+	if (count > CTL_MAX_BYTES)
+		return -E2BIG;
+	kbuf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(kbuf))
+		return PTR_ERR(kbuf);
+
+	mutex_lock(&sym_lock);
+	p = kbuf;
+	while (!ret && (tok = strsep(&p, " \t\n")) != NULL) {
+		if (!*tok)
+			continue;
+		if (!strcmp(tok, "clear"))
+			ret = syms_remove(NULL);
+		else if (*tok == '-')
+			ret = syms_remove(tok + 1);
+		else if (*tok == '+')
+			ret = syms_add(tok + 1);
+		else
+			ret = syms_add(tok);
+	}
+	mutex_unlock(&sym_lock);
+	kfree(kbuf);
+	return ret ? ret : count;
+}
+
+static const struct file_operations control_fops = {
+	.owner = THIS_MODULE,
+	.open = control_open,
+	.read = seq_read,
+	.write = control_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init helper_kp_init_module(void)
+{
+	char *initial;
+	int ret;
+
+	pr_info("%s:%s():v%s: %s mode, verbose mode? %s, show stack? %s\n",
+		KBUILD_MODNAME, __func__, MODULE_VER, kret ? "kretprobe" : "kprobe",
+		(verbose==1?"Y":"N"), (show_stack==1?"Y":(show_stack==2?"counted":"N")));
+
+	ret = kp_filter_init(&filt, filter);
+	if (ret) {
+		pr_warn("%s:%s():invalid filter \"%s\" (%d)\n", KBUILD_MODNAME, __func__, filter, ret);
+		return ret;
+	}
+	ret = kp_evring_init(&evr, evring);
+	if (ret)
+		goto out_filter;
+	/* show_stack can be set to 2 anytime, so the table's always there */
+	ret = kp_stackmap_init(&stacks);
+	if (ret)
+		goto out_evring;
+
+	/* the control file is our interface; unlike the others, we can't do without it */
+	dbgfs_dir = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	if (IS_ERR_OR_NULL(dbgfs_dir)) {
+		pr_warn("%s:%s():debugfs dir creation failed\n", KBUILD_MODNAME, __func__);
+		ret = dbgfs_dir ? PTR_ERR(dbgfs_dir) : -ENODEV;
+		goto out_stackmap;
+	}
+	if (IS_ERR_OR_NULL(debugfs_create_file("control", 0644, dbgfs_dir, NULL, &control_fops))) {
+		ret = -ENOMEM;
+		goto out_rm_dbgfs;
+	}
+	debugfs_create_file(kret ? "duration" : "latency", 0644, dbgfs_dir, NULL, &latency_fops);
+	debugfs_create_file("stats", 0444, dbgfs_dir, NULL, &stats_fops);
+	debugfs_create_file("filter", 0644, dbgfs_dir, &filt, &kp_filter_fops);
+	debugfs_create_file("probe_ids", 0444, dbgfs_dir, NULL, &probe_ids_fops);
+	debugfs_create_file("stacks", 0644, dbgfs_dir, &stacks, &kp_stackmap_fops);
+	debugfs_create_file("ratectl", 0644, dbgfs_dir, NULL, &ratectl_fops);
+	/* the regular debugfs file's proxy doesn't do mmap */
+	if (evring)
+		debugfs_create_file_unsafe("events", 0600, dbgfs_dir, &evr, &kp_evring_fops);
+
+	if (funcname) {
+		initial = kstrdup(funcname, GFP_KERNEL);
+		if (!initial) {
+			ret = -ENOMEM;
+			goto out_rm_dbgfs;
+		}
+		mutex_lock(&sym_lock);
+		ret = syms_add(initial);
+		mutex_unlock(&sym_lock);
+		kfree(initial);
+		if (ret)
+			goto out_rm_dbgfs;
+	}
+	pr_info("%s:%s():registered %d %s(s); control file: <debugfs>/%s/control\n",
+		KBUILD_MODNAME, __func__, nsyms, kret ? "kretprobe" : "kprobe", KBUILD_MODNAME);
 	return 0;	/* success */
+
+ out_rm_dbgfs:
+	debugfs_remove_recursive(dbgfs_dir);
+ out_stackmap:
+	kp_stackmap_free(&stacks);
+ out_evring:
+	kp_evring_free(&evr);
+ out_filter:
+	kp_filter_exit(&filt);
+	return ret;
 }
 
 static void helper_kp_cleanup_module(void)
 {
-	unregister_kprobe(&kpb);
-	pr_info("%s:%s():unregistered kprobe @ function %s\n", KBUILD_MODNAME, __func__, funcname);
+	int n;
+
+	/* the debugfs files may be open: remove them - waiting out any reader or writer - first */
+	debugfs_remove_recursive(dbgfs_dir);
+	mutex_lock(&sym_lock);
+	n = nsyms;
+	syms_remove(NULL);
+	mutex_unlock(&sym_lock);
+	kp_stackmap_free(&stacks);
+	kp_evring_free(&evr);
+	kp_filter_exit(&filt);
+	pr_info("%s:%s():unregistered %d %s(s)\n", KBUILD_MODNAME, __func__, n,
+		kret ? "kretprobe" : "kprobe");
 }
 
 module_init(helper_kp_init_module);
 module_exit(helper_kp_cleanup_module);
 
 MODULE_AUTHOR("Kaiwan N Billimoria");
-MODULE_DESCRIPTION("Helper Kprobe module; registers a kprobe to the passed function");
+MODULE_DESCRIPTION("Helper Kprobe module; resident, probes the function(s) written to it's control file");
 MODULE_LICENSE("Dual MIT/GPL");
+MODULE_VERSION(MODULE_VER);
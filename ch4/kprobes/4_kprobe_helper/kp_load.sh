@@ -12,17 +12,20 @@
 #***************************************************************
 # Brief Description:
 # Our kprobes demo #4:
-# Traditional, semi-automated manual approach: a helper script generates a
-# template for both the kernel module C code and the Makefile, enabling
-# attaching a kprobe to a given function via module parameter.
+# Semi-automated approach: a generic, resident, kprobe helper module
+# (helper_kp.ko) is built - and inserted - just once; after that, attaching a
+# kprobe to a given function (or to several) is simply a write to it's debugfs
+# control file, taking milliseconds, not a kernel module build.
 # (See the 'usage' screen by just typing the script's name with no arguments).
 # 
 # Notes:
 # - The function to kprobe must not be marked 'static' or 'inline' in the kernel
 #   / LKM or be blacklisted by the kprobes machinery
-# - This script dynamically "generates" an LKM in <pwd>/tmp/ .
-# Filename format: ${BASEFILE}-${FUNCTION}-$(date +%d%m%y).ko
-# To do so, it generates a Makefile and builds the LKM, and even insmod's it!
+# - The helper module is (re)built here only if it's missing or out of date;
+#   whether it uses kprobes or kretprobes (--kret) is fixed when it's inserted,
+#   so switching between them needs an --unload first.
+# - The probes accumulate: each run adds the function(s) passed to the ones
+#   already being probed; see the --remove, --clear and --list options.
 #
 # Author: Kaiwan N Billimoria
 # License: MIT
@@ -32,6 +35,10 @@ source ./common.sh || {
  echo "$name: could not source common.sh , aborting..."
  exit 1
 }
+source ./kp_symcache.sh || {
+ echo "$name: could not source kp_symcache.sh , aborting..."
+ exit 1
+}
 
 # Function to validate passed as first parameter
 check_function()
@@ -44,13 +51,37 @@ if [ -z "${FUNC}" ]; then
 fi
 ShowTitle "[ Validate the to-be-kprobed function ${FUNC} ]"
 
+# Fast path: look it up in the (sorted) symbol cache; see kp_symcache.sh
+if [ -n "${SYMCACHE_DIR}" ]; then
+  symcache_blacklisted ${FUNC} && {
+   echo "
+*** ${name}: FATAL: the symbol '${FUNC}' is blacklisted by the Kprobes
+framework. Aborting..."
+   exit 1
+  }
+  local hits=$(symcache_lookup ${FUNC})
+  [ -z "${hits}" ] && {
+   echo "
+*** ${name}: FATAL: Symbol '${FUNC}' not found!
+[Either it's invalid -or- Could it be static or inline?]. Aborting..."
+   echo "--- Possible close matches ---"
+   symcache_suggest ${FUNC}
+   exit 1
+  }
+  echo "${hits}"
+  [ $(echo "${hits}" | wc -l) -gt 1 ] && echo "
+ ### $name: WARNING! Symbol '${FUNC}' - multiple instances found!
+"
+  return
+fi
+
 # Attempt to find out if it's valid in the kernel.
 # In any case, if the function is invalid, it will be caught on the 
 # register_kprobe(), which will then fail..
 
 if [ ! -f /proc/kallsyms ]; then
   if [ ! -f /boot/System.map-$(uname -r) ]; then
-  	echo
+	  echo
     echo "$name: WARNING! Both /proc/kallsyms and /boot/System.map-$(uname -r) not present!?
 [Possibly an embedded system]. 
 So, we'll Not attempt to check validity of ${FUNC} right now; if invalid, it will 
@@ -99,27 +130,172 @@ num=$(grep -w "[tT] ${FUNC}" ${SYMLOC} |wc -l)
  }
 }
 
-# Insert the helper_kp kernel module that will set up our custom kprobe
+# expand_probes "func1,func2,glob*,..."
+# The --probe= list may hold several functions and globs (f.e. 'vfs_*'); the
+# globs are expanded against the kernel's text symbols, leaving out the ones
+# blacklisted by kprobes and the compiler-generated (.isra, .cold, ...) ones,
+# as well as aliases (names at the same address); the plain names are
+# validated via check_function(). Sets PROBE_LIST to the resulting
+# comma-separated list (as the helper module expects it) and NUM_PROBES.
+# Uses the symbol cache (kp_symcache.sh) when we have it.
+expand_probes()
+{
+local pat matches
+PROBE_LIST=""
+for pat in $(echo "$1" | tr ',' ' '); do
+  case "${pat}" in
+    *[*?[]*)
+	[ ! -f /proc/kallsyms ] && {
+	  echo "${name}: globs need /proc/kallsyms, aborting..."
+	  exit 1
+	}
+	if [ -n "${SYMCACHE_DIR}" ]; then
+	  matches=$(symcache_glob "${pat}" | sort -u | tr '\n' ',')
+	else
+	  local blist=/dev/null
+	  [ -n "${DBGFS_MNT}" -a -f ${DBGFS_MNT}/kprobes/blacklist ] && \
+		  blist=${DBGFS_MNT}/kprobes/blacklist
+	  # glob -> (awk) ERE
+	  local re=$(echo "${pat}" | sed -e 's/\./\\./g' -e 's/\*/.*/g' -e 's/?/./g')
+	  matches=$(awk -v re="^${re}$" '
+		  FILENAME == ARGV[1] { bl[$2] = 1; next }	# the blacklist: "start-end sym"
+		  # (with kptr_restrict, all the addresses are 0: no alias dedupe then)
+		  ($2 == "t" || $2 == "T") && $3 ~ re && $3 !~ /\./ && !($3 in bl) && ($1 ~ /^0+$/ || !seen[$1]++) { print $3 }
+		  ' ${blist} /proc/kallsyms | sort -u | tr '\n' ',')
+	fi
+	[ -z "${matches}" ] && {
+	  echo "${name}: no (probe-able) function matches '${pat}', aborting..."
+	  exit 1
+	}
+	echo "'${pat}' matches: ${matches%,}"
+	PROBE_LIST="${PROBE_LIST}${matches}"
+	;;
+    *)
+	check_function ${pat}
+	PROBE_LIST="${PROBE_LIST}${pat},"
+	;;
+  esac
+done
+PROBE_LIST=${PROBE_LIST%,}
+NUM_PROBES=$(echo "${PROBE_LIST}" | tr ',' '\n' | wc -l)
+[ ${NUM_PROBES} -gt ${MAX_PROBES} ] && {
+  echo "${name}: ${NUM_PROBES} functions to probe, the max is ${MAX_PROBES}; pl narrow it down. Aborting..."
+  exit 1
+}
+echo "${NUM_PROBES} function(s) to probe"
+}
+
+# Build the helper_kp kernel module, if it isn't built or is out of date
+build_helperkp_module()
+{
+local src stale=0
+[ ! -f ${KPMOD}.ko ] && stale=1
+for src in ${KPMOD}.c ${BASEFILE_H} ${COMMON_HDRS}; do
+  if [ ! -f ${src} ]; then
+    echo "${name}: source file ${src} missing?"
+    exit 1
+  fi
+  [ ${src} -nt ${KPMOD}.ko ] && stale=1
+done
+[ ${stale} -eq 0 ] && return
+echo "--- make ---------------------------------------------------"
+make || {
+  echo "${name}: failed to 'make'. Aborting..."
+  exit 1
+}
+ls -l ${KPMOD}.ko
+}
+
+# Insert the (resident) helper_kp kernel module, if it isn't already, and
+# apply the --verbose / --showstack / --filter settings to it; the filter's in
+# place before any probe's added, so busy functions are never probed unfiltered
 load_helperkp_module()
 {
- echo "/sbin/insmod ./${KPMOD}.ko funcname=${FUNCTION} verbose=${VERBOSE} show_stack=${SHOWSTACK}"
- /sbin/insmod ./${KPMOD}.ko funcname=${FUNCTION} verbose=${VERBOSE} show_stack=${SHOWSTACK} || {
+ local params="kret=${KRET} evring=${EVRING}"
+
+ if [ ! -d ${KPMOD_SYSFS} ]; then
+   build_helperkp_module
+   echo "/sbin/insmod ./${KPMOD}.ko ${params}${FILTER:+ filter=\"${FILTER}\"}"
+   # (the quotes - for the kernel's param parser - keep a multi-term filter one value)
+   /sbin/insmod ./${KPMOD}.ko ${params} ${FILTER:+"filter=\"${FILTER}\""} || {
 	echo "${name}: insmod ${KPMOD} unsuccessful, aborting now.."
-	if [ ${PROBE_KERNEL} -eq 0 ]; then
+	echo "dmesg|tail"
+	dmesg|tail
+	exit 7
+   }
+ elif [ $(cat ${KPMOD_SYSFS}/parameters/kret) -ne ${KRET} ]; then
+   echo "${name}: ${KPMOD} is loaded in $([ ${KRET} -eq 1 ] && echo kprobe || echo kretprobe) mode;"
+   echo " to switch, first unload it (${name} --unload), aborting now.."
+   exit 7
+ elif [ -n "${FILTER}" ]; then
+   echo "${FILTER}" > ${KPMOD_DBGFS}/filter || exit 1
+ fi
+ [ -n "${FILTER}" ] && { echo -n "filter: " ; cat ${KPMOD_DBGFS}/filter ; }
+ echo ${VERBOSE} > ${KPMOD_SYSFS}/parameters/verbose
+ echo ${SHOWSTACK} > ${KPMOD_SYSFS}/parameters/show_stack
+ # the sampling / rate limit of the probes we're about to add
+ echo ${SAMPLE} > ${KPMOD_SYSFS}/parameters/sample
+ echo ${MAXRATE} > ${KPMOD_SYSFS}/parameters/max_rate
+ # the verbose o/p is via pr_debug(); turn it on (a no-op without dynamic debug)
+ [ ${VERBOSE} -eq 1 -a -f ${DBGFS_MNT}/dynamic_debug/control ] && \
+	echo "module ${KPMOD} +p" > ${DBGFS_MNT}/dynamic_debug/control
+}
+
+# Add the probe(s) in PROBE_LIST, via the helper's control file
+add_probes()
+{
+ load_helperkp_module
+ echo "echo \"+${PROBE_LIST}\" > ${KPMOD_CTL}"
+ echo "+${PROBE_LIST}" > ${KPMOD_CTL} || {
+	echo "${name}: adding the probe(s) failed, aborting now.."
+	if [ ${PROBE_KERNEL} -eq 0 -a ${already_inserted} -eq 0 ]; then
 		/sbin/rmmod ${TARGET_MODULE} 2>/dev/null
 	fi
 	echo "dmesg|tail"
 	dmesg|tail
 	exit 7
  }
+ local histfile=latency
+ [ ${KRET} -eq 1 ] && histfile=duration
+ echo "The latency histogram: cat ${KPMOD_DBGFS}/${histfile}"
+ echo "Functions being probed: cat ${KPMOD_CTL}"
+ [ ${SHOWSTACK} -eq 2 ] && echo "The call paths (folded stacks): cat ${KPMOD_DBGFS}/stacks | flamegraph.pl > ${KPMOD}.svg"
+ [ -f ${KPMOD_DBGFS}/events ] && \
+   echo "Events: ../common/kp_evdecode -f -m ${KPMOD_DBGFS}/probe_ids ${KPMOD_DBGFS}/events"
 }
 
-# If not already inserted, insert the LKM (kernel module) ${KPMOD}
-# Running as root here...
+# remove_probes "func1,glob*,..."
+# The globs are matched against the functions currently being probed.
+remove_probes()
+{
+local pat f list=""
+[ ! -f ${KPMOD_CTL} ] && {
+  echo "${name}: ${KPMOD} isn't loaded, nothing to remove"
+  exit 1
+}
+for pat in $(echo "$1" | tr ',' ' '); do
+  for f in $(grep -v '^#' ${KPMOD_CTL}); do
+    [[ ${f} == ${pat} ]] && list="${list}${f},"
+  done
+done
+[ -z "${list}" ] && {
+  echo "${name}: no function being probed matches '$1'"
+  exit 1
+}
+echo "echo \"-${list%,}\" > ${KPMOD_CTL}"
+echo "-${list%,}" > ${KPMOD_CTL} || {
+  echo "dmesg|tail"
+  dmesg|tail
+  exit 7
+}
+}
+
+# If not already inserted, insert the target LKM (kernel module), and then add
+# the probe(s). Running as root here...
 insert_kprobe()
 {
+already_inserted=0
 if [ ${PROBE_KERNEL} -eq 0 ] ; then
- local already_inserted=0
  local kmod_name=$(basename ${TARGET_MODULE::-3})  # rm the .ko too...
  lsmod|grep -w ${kmod_name} >/dev/null && already_inserted=1
 
@@ -140,26 +316,49 @@ if [ ${PROBE_KERNEL} -eq 0 ] ; then
 	echo "dmesg|tail"
 	dmesg|tail
  else
-    echo " kernel module ${KPMOD} is already inserted... proceeding..."
+    echo " kernel module ${kmod_name} is already inserted... proceeding..."
  fi
- load_helperkp_module
+ add_probes
 else # probing a kernel func..
- load_helperkp_module
+ add_probes
  echo "${name}: successful."
  echo "dmesg|tail"
  dmesg|tail
- cd ..
 fi
 }
 
 usage()
 {
-	echo "Usage: ${name} [--verbose] [--help] [--mod=module-pathname] --probe=function-to-probe
+	echo "Usage: ${name} [--verbose] [--help] [--showstack|--stacks] [--kret] [--mod=module-pathname] --probe=function-to-probe
+       ${name} --remove=function-to-unprobe | --filter=spec | --clear | --list | --unload
        ---probe=probe-this-function  : if module-pathname is not passed, 
                                            then we assume the function to be kprobed is in the kernel itself.
+                                       Can be a comma-separated list of functions and/or globs, f.e.
+                                        --probe=do_sys_open,vfs_*  (max ${MAX_PROBES} functions in all)
+                                       These are added to the functions already being probed
        [--mod=module-pathname]       : pathname of kernel module that has the function-to-probe
        [--verbose]                   : run in verbose mode; shows PRINT_CTX() o/p, etc
        [--showstack]                 : display kernel-mode stack, see how we got here!
+       [--stacks]                    : count the unique kernel-mode stacks instead (far cheaper);
+                                       read them - as folded stacks, for flamegraph.pl - via
+                                        ${KPMOD_DBGFS}/stacks
+       [--kret]                      : use a kretprobe to measure the function's true duration
+                                       (entry to return), instead of the kprobe
+       [--evring=n]                  : also log every hit as a binary record into per-cpu rings of
+                                       n records, read via ../common/kp_evdecode (when inserting)
+       [--sample=N]                  : report (events, verbose o/p, stacks) only 1 in N hits of
+                                       the probe(s) being added
+       [--max-rate=N]                : report at most N hits a second, per probe; both can be
+                                       changed later via ${KPMOD_DBGFS}/ratectl
+       [--remove=func]               : stop probing this function; can be a comma-separated
+                                       list of functions and/or globs too
+       [--filter=\"spec\"]            : only count the tasks passing this filter, f.e.
+                                        --filter=\"comm=vi*,bash cpus=0-3 pid=1234\"
+                                       (see ../common/kp_filter.h); 'clear' removes it. With
+                                       --probe, it's in place before the probe(s) are added
+       [--clear]                     : stop probing all functions
+       [--list]                      : show the functions being probed
+       [--unload]                    : remove the helper module (and thus all probes)
        [--help]                      : show this help screen"
 	exit
 }
@@ -196,6 +395,10 @@ echo " OK
 #  and we shall accordingly treat the first parameter as the name of the function
 #  to kprobe.
 PROBE_KERNEL=1
+MAX_PROBES=128	# keep in sync with helper_kp.c:MAX_SYMS
+KPMOD=helper_kp
+BASEFILE_H=../../../convenient.h
+COMMON_HDRS="../common/kp_hist.h ../common/kp_kret.h ../common/kp_filter.h ../common/kp_evring.h ../common/kp_evring_abi.h ../common/kp_stackmap.h ../common/kp_ratectl.h"
 
 SEP="-------------------------------------------------------------------------------"
 name=$(basename $0)
@@ -209,9 +412,18 @@ if [ $? -eq 0 ]; then
   DBGFS_MNT=$(mount|grep -w debugfs|awk '{print $3}')
 fi
 kprobes_check
+symcache_init || echo "(no symbol cache; falling back to scanning /proc/kallsyms)"
+KPMOD_SYSFS=/sys/module/${KPMOD}
+KPMOD_DBGFS=${DBGFS_MNT:-/sys/kernel/debug}/${KPMOD}
+KPMOD_CTL=${KPMOD_DBGFS}/control
 
 VERBOSE=0
 SHOWSTACK=0
+KRET=0
+EVRING=0
+SAMPLE=0
+MAXRATE=0
+CTL_OP=""
 optspec=":h?-:"
 while getopts "${optspec}" opt
 do
@@ -231,12 +443,38 @@ do
 				PROBE_KERNEL=0 ;;
 			  verbose) VERBOSE=1 ;;
 			  showstack) SHOWSTACK=1 ;;
+			  stacks) SHOWSTACK=2 ;;
+			  kret) KRET=1 ;;
+			  evring=*) EVRING=${OPTARG#evring=} ;;
+			  sample=*) SAMPLE=${OPTARG#sample=} ;;
+			  max-rate=*) MAXRATE=${OPTARG#max-rate=} ;;
+			  remove=*) CTL_OP=remove
+				REMOVE=$(echo "${OPTARG}" |cut -d'=' -f2) ;;
+			  filter=*) FILTER=${OPTARG#filter=} ;;
+			  clear) CTL_OP=clear ;;
+			  list) CTL_OP=list ;;
+			  unload) CTL_OP=unload ;;
 			  *) echo "Unknown option '${OPTARG}'" #; usage
 				;;
-  	        esac
-  	esac
+	          esac
+	  esac
 done
 shift $((OPTIND-1))
+# --filter on it's own just changes the filter; with --probe, it's applied
+# (at insmod, or before the probe's added) by load_helperkp_module()
+[ -n "${FILTER}" -a -z "${FUNCTION}" -a -z "${CTL_OP}" ] && CTL_OP=filter
+
+case "${CTL_OP}" in
+  remove) remove_probes ${REMOVE} ; exit 0 ;;
+  filter) [ ! -f ${KPMOD_DBGFS}/filter ] && {
+	    echo "${KPMOD} isn't loaded" ; exit 1
+	  }
+	  echo "${FILTER}" > ${KPMOD_DBGFS}/filter || exit 1
+	  echo -n "filter: " ; cat ${KPMOD_DBGFS}/filter ; exit 0 ;;
+  clear)  [ -f ${KPMOD_CTL} ] && echo clear > ${KPMOD_CTL} ; exit 0 ;;
+  list)   [ -f ${KPMOD_CTL} ] && cat ${KPMOD_CTL} || echo "${KPMOD} isn't loaded" ; exit 0 ;;
+  unload) [ -d ${KPMOD_SYSFS} ] && /sbin/rmmod ${KPMOD} ; exit 0 ;;
+esac
 
 [ ${VERBOSE} -eq 1 ] && echo "FUNCTION=${FUNCTION} PROBE_KERNEL=${PROBE_KERNEL} TARGET_MODULE=${TARGET_MODULE} ; VERBOSE=${VERBOSE} SHOWSTACK=${SHOWSTACK}"
 [ -z "${FUNCTION}" ] && {
@@ -247,7 +485,7 @@ shift $((OPTIND-1))
 echo -n "Verbose mode is "
 [ ${VERBOSE} -eq 1 ] && echo "on" || echo "off"
 
-check_function ${FUNCTION}
+expand_probes ${FUNCTION}
 
 if [ ${PROBE_KERNEL} -eq 0 ]; then
 	if [ ! -f ${TARGET_MODULE} ]; then
@@ -257,74 +495,5 @@ if [ ${PROBE_KERNEL} -eq 0 ]; then
 	echo "Target kernel Module: ${TARGET_MODULE}"
 fi
 
-################ Generate a kernel module to probe this particular function ###############
-BASEFILE_C=helper_kp.c
-BASEFILE_H=../../../convenient.h
-BASEFILE=helper_kp
-
-if [ ! -f ${BASEFILE_C} ]; then
-  echo "${name}: base file ${BASEFILE_C} missing?"
-  exit 1
-fi
-if [ ! -f ${BASEFILE_H} ]; then
-  echo "${name}: base file ${BASEFILE_H} missing?"
-  exit 1
-fi
-
-export KPMOD=${BASEFILE}-${FUNCTION}-$(date +%d%b%y)
-#export KPMOD=${BASEFILE}-${FUNCTION}-$(date +%d%m%y_%H%M%S)
-echo $SEP
-echo "KPMOD=${KPMOD}"
-
-rm -rf tmp/ 2>/dev/null
-mkdir -p tmp/
-cd tmp
-cp ../${BASEFILE_C} ${KPMOD}.c || exit 1
-
-echo "--- Generating tmp/Makefile ---------------------------------------------------"
-# Generate the Makefile
-cat > Makefile << @MYMARKER@
-# Makefile for kernel module
-### Specifically: Kprobe helpers !
-
-ifneq (\$(KERNELRELEASE),)
-  \$(info --- Dynamic Makefile for helper_kprobes util ---)
-  \$(info Building with KERNELRELEASE = ${KERNELRELEASE})
-  # If you choose to keep the define USE_FTRACE_PRINT , we'll use
-  # trace_printk() , else the regular printk()
-  EXTRA_CFLAGS += -DDEBUG  # use regular pr_*()
-  obj-m += ${KPMOD}.o
-
-else
-	#########################################
-	# To support cross-compiling for the ARM:
-	# For ARM, invoke make as:
-	# make ARCH=arm CROSS_COMPILE=arm-none-linux-gnueabi- 
-	ifeq (\$(ARCH),arm)
-	# Update 'KDIR' below to point to the ARM Linux kernel source tree
-		KDIR ?= ~/5.4
-	else
-		KDIR ?= /lib/modules/\$(shell uname -r)/build 
-	endif
-	#########################################
-	PWD   := \$(shell pwd)
-default:
-	\$(MAKE) -C \$(KDIR) M=\$(PWD) modules
-install:
-	\$(MAKE) -C \$(KDIR) M=\$(PWD) modules_install
-endif
-clean:
-	\$(MAKE) -C \$(KDIR) SUBDIRS=\$(PWD) clean
-@MYMARKER@
-
-echo "--- make ---------------------------------------------------"
-make || {
-  echo "${name}: failed to 'make'. Aborting..."
-  cd ..
-  exit 1
-}
-
-ls -l ${KPMOD}.ko
 insert_kprobe
-
 exit 0
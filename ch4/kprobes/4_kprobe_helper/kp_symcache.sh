@@ -0,0 +1,185 @@
+#!/bin/bash
+# ch4/kprobes/4_kprobe_helper/kp_symcache.sh
+# ***************************************************************
+# This program is part of the source code released for the book
+#  "Linux Kernel Debugging"
+#  (c) Author: Kaiwan N Billimoria
+#  Publisher:  Packt
+#  GitHub repository:
+#  https://github.com/PacktPublishing/Linux-Kernel-Debugging
+#
+# From: Ch 4: Debug via Instrumentation - Kprobes
+#***************************************************************
+# Brief Description:
+# A cache of the kernel's text symbols and of the kprobes blacklist, for
+# kp_load.sh (which sources this file) to validate the functions to probe.
+# /proc/kallsyms is generated afresh on every read - and, with 200k+ symbols
+# and lots of modules, that's slow - so we read it just once, into files
+# sorted by symbol name; a lookup's then a binary search, via look(1), not a
+# scan of all of kallsyms (and of the blacklist) for every function.
+#
+# The cache lives in ${KP_SYMCACHE_DIR}/<kernel build-id>/ and is rebuilt
+# when the set of loaded modules changes, as well as after a reboot (KASLR
+# moves the symbols about; we use their addresses to spot aliases).
+#
+# Standalone usage:
+#  kp_symcache.sh [--rebuild] [--lookup=func] [--suggest=func] [--glob=pattern]
+#
+# Author: Kaiwan N Billimoria
+# License: MIT
+#------------------------------------------------------------------------------
+KP_SYMCACHE_DIR=${KP_SYMCACHE_DIR:-/var/cache/kp_symcache}
+SYMCACHE_DIR=""
+
+# symcache_key
+# The kernel's GNU build-id (the NT_GNU_BUILD_ID ELF note in /sys/kernel/notes);
+# failing that, a hash of the kernel version string.
+symcache_key()
+{
+local id=""
+[ -r /sys/kernel/notes ] && \
+ id=$(od -An -v -tx1 /sys/kernel/notes 2>/dev/null | awk '
+	function byte(i) { return (index("0123456789abcdef", substr(b[i], 1, 1)) - 1) * 16 + \
+				  index("0123456789abcdef", substr(b[i], 2, 1)) - 1 }
+	function le32(i) { return byte(i) + byte(i+1) * 256 + byte(i+2) * 65536 + byte(i+3) * 16777216 }
+	{ for (i = 1; i <= NF; i++) b[n++] = $i }
+	END {
+		# each note: namesz, descsz, type (u32 each), name, desc (4-byte aligned)
+		for (off = 0; off + 12 <= n; ) {
+			namesz = le32(off); descsz = le32(off+4); type = le32(off+8)
+			name = off + 12; desc = name + int((namesz + 3) / 4) * 4
+			if (type == 3 && namesz == 4 && b[name] == "47" && b[name+1] == "4e" && b[name+2] == "55") {
+				for (i = desc; i < desc + descsz; i++)
+					printf "%s", b[i]
+				exit
+			}
+			off = desc + int((descsz + 3) / 4) * 4
+		}
+	}')
+[ -z "${id}" ] && id=$(md5sum < /proc/version | cut -d' ' -f1)
+echo ${id}
+}
+
+# symcache_stamp
+# What the cache's contents depend on, besides the kernel build: this boot
+# (KASLR) and the set of loaded modules (names and sizes).
+symcache_stamp()
+{
+echo "$(cat /proc/sys/kernel/random/boot_id 2>/dev/null) $(awk '{print $1, $2}' /proc/modules 2>/dev/null | md5sum | cut -d' ' -f1)"
+}
+
+# symcache_build dir
+# syms      : "name addr type [module]" for every text symbol, sorted by name
+# blacklist : the names of the functions blacklisted by kprobes, sorted
+symcache_build()
+{
+local dir=$1 tmp dbgfs
+mkdir -p $(dirname ${dir}) || return 1
+tmp=$(mktemp -d ${dir}.XXXXXX) || return 1
+awk '$2 == "t" || $2 == "T" { print $3, $1, $2, $4 }' /proc/kallsyms | \
+	LC_ALL=C sort -k1,1 > ${tmp}/syms
+dbgfs=${DBGFS_MNT:-$(mount | awk '$5 == "debugfs" { print $3; exit }')}
+if [ -n "${dbgfs}" -a -f ${dbgfs}/kprobes/blacklist ]; then
+	awk '{ print $2 }' ${dbgfs}/kprobes/blacklist | LC_ALL=C sort -u > ${tmp}/blacklist
+else
+	> ${tmp}/blacklist
+fi
+symcache_stamp > ${tmp}/stamp
+rm -rf ${dir}
+mv ${tmp} ${dir}
+}
+
+# symcache_init [force]
+# Sets SYMCACHE_DIR to an up to date cache, (re)building it if required
+# (or if 'force' is passed). Fails if there's no /proc/kallsyms to cache.
+symcache_init()
+{
+local dir=${KP_SYMCACHE_DIR}/$(symcache_key)
+[ -r /proc/kallsyms ] || return 1
+if [ "$1" = "force" -o ! -f ${dir}/syms -o "$(cat ${dir}/stamp 2>/dev/null)" != "$(symcache_stamp)" ]; then
+	symcache_build ${dir} || return 1
+fi
+SYMCACHE_DIR=${dir}
+}
+
+# symcache_look prefix file
+# The lines of the (sorted) file starting with prefix: a binary search via
+# look(1) if we have it; else a scan that at least stops at the last match.
+symcache_look()
+{
+if which look >/dev/null 2>&1; then
+	LC_ALL=C look -- "$1" $2
+else
+	LC_ALL=C awk -v p="$1" 'index($0, p) == 1 { print; found = 1; next } found { exit }' $2
+fi
+}
+
+# symcache_lookup func
+# The text symbol entries named func (more than one if it's not unique)
+symcache_lookup()
+{
+symcache_look "$1 " ${SYMCACHE_DIR}/syms
+}
+
+# symcache_blacklisted func
+symcache_blacklisted()
+{
+symcache_look "$1" ${SYMCACHE_DIR}/blacklist | grep -q -x -F -- "$1"
+}
+
+# symcache_suggest func
+# Close matches: the functions sharing the longest '_'-separated prefix with
+# func (f.e. do_sys_opne -> do_sys_*), leaving out the compiler-generated ones.
+symcache_suggest()
+{
+local pfx=$1 look_for=$1 out
+while :; do
+	out=$(symcache_look "${look_for}" ${SYMCACHE_DIR}/syms | awk '$1 !~ /\./ { print $1 }' | uniq | head -20)
+	[ -n "${out}" ] && {
+		echo "${out}"
+		return
+	}
+	[ "${pfx%_*}" = "${pfx}" ] && return
+	pfx=${pfx%_*}
+	look_for=${pfx}_
+done
+}
+
+# symcache_glob pattern
+# The probe-able functions matching the glob pattern: leaving out the
+# blacklisted and the compiler-generated (.isra, .cold, ...) ones, as well as
+# aliases (names at the same address). Only the symbols starting with the
+# pattern's literal prefix are looked at.
+symcache_glob()
+{
+local pfx=${1%%[*?[]*}
+local re=$(echo "$1" | sed -e 's/\./\\./g' -e 's/\*/.*/g' -e 's/?/./g')
+symcache_look "${pfx}" ${SYMCACHE_DIR}/syms | \
+ awk -v re="^${re}$" '
+	FILENAME == ARGV[1] { bl[$1] = 1; next }
+	# (kptr_restrict may zero all the addresses: then, aliases can not be told apart)
+	$1 ~ re && $1 !~ /\./ && !($1 in bl) && ($2 ~ /^0+$/ || !seen[$2]++) { print $1 }
+	' ${SYMCACHE_DIR}/blacklist -
+}
+
+# Run standalone (not sourced)?
+if [ "${BASH_SOURCE[0]}" = "$0" ]; then
+	name=$(basename $0)
+	[ $# -eq 0 ] && {
+		echo "Usage: ${name} [--rebuild] [--lookup=func] [--suggest=func] [--glob=pattern]"
+		exit 1
+	}
+	[ "$1" = "--rebuild" ] && force=force || force=""
+	symcache_init ${force} || {
+		echo "${name}: couldn't set up the symbol cache (no /proc/kallsyms?)"
+		exit 1
+	}
+	echo "symbol cache: ${SYMCACHE_DIR}"
+	for arg; do
+		case "${arg}" in
+		  --lookup=*) symcache_lookup ${arg#*=} ;;
+		  --suggest=*) symcache_suggest ${arg#*=} ;;
+		  --glob=*) symcache_glob "${arg#*=}" ;;
+		esac
+	done
+fi
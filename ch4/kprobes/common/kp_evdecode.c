@@ -0,0 +1,236 @@
+/*
+ * ch4/kprobes/common/kp_evdecode.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Debugging"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Debugging
+ *
+ * From: Ch 4: Debug via Instrumentation - Kprobes
+ ****************************************************************
+ * Brief Description:
+ * The userspace decoder for our kprobe modules' binary event rings (see
+ * kp_evring.h / kp_evring_abi.h): it mmap()s the module's debugfs 'events'
+ * file and consumes the records in place, straight from the per-cpu rings;
+ * no system call per event. It prints them, one per line:
+ *  timestamp(s) cpu pid type probe args...
+ * (per-cpu batches; pipe through 'sort -n' for a global order), or, with -s,
+ * just a per-probe summary.
+ *
+ * Usage:
+ *  kp_evdecode [-f] [-s] [-m probe-id-map] <debugfs>/<module>/events
+ *   -f : follow: keep consuming (till ^C), else drain the rings once and exit
+ *   -s : summary only: the # of events per probe (and those lost)
+ *   -m : a file of 'id name' lines, to show the probes by name (for
+ *        helper_kp, it's <debugfs>/helper_kp/probe_ids)
+ *
+ * For details, please refer the book, Ch 4.
+ * License: Dual MIT/GPL
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "kp_evring_abi.h"
+
+#define MAX_PROBE_IDS	4096
+
+static volatile sig_atomic_t stop;
+static char *probe_name[MAX_PROBE_IDS];
+static unsigned long long probe_hits[MAX_PROBE_IDS];
+
+static void sig_stop(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static void load_map(const char *prg, const char *mapfile)
+{
+	char line[256], name[224];
+	unsigned int id;
+	FILE *fp;
+
+	fp = fopen(mapfile, "r");
+	if (!fp) {
+		fprintf(stderr, "%s: fopen %s: %s\n", prg, mapfile, strerror(errno));
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "%u %223s", &id, name) == 2 && id < MAX_PROBE_IDS)
+			probe_name[id] = strdup(name);
+	fclose(fp);
+}
+
+static const char *type_name(unsigned int type)
+{
+	switch (type) {
+	case KP_EV_HIT:
+		return "hit";
+	case KP_EV_ENTRY:
+		return "entry";
+	case KP_EV_LATENCY:
+		return "latency";
+	}
+	return "?";
+}
+
+static void show_event(const struct kp_ev *ev)
+{
+	unsigned int i;
+
+	printf("%llu.%09llu %3u %7u %-7s ", (unsigned long long)ev->ts_ns / 1000000000ULL,
+	       (unsigned long long)ev->ts_ns % 1000000000ULL, ev->cpu, ev->pid, type_name(ev->type));
+	if (ev->probe_id < MAX_PROBE_IDS && probe_name[ev->probe_id])
+		printf("%-24s", probe_name[ev->probe_id]);
+	else
+		printf("%-24u", ev->probe_id);
+	if (ev->type == KP_EV_LATENCY)
+		printf(" %llu ns", (unsigned long long)ev->args[0]);
+	else
+		for (i = 0; i < ev->nargs && i < KP_EV_NARGS; i++)
+			printf(" 0x%llx", (unsigned long long)ev->args[i]);
+	putchar('\n');
+}
+
+/* Consume all the records now in the rings; returns how many */
+static unsigned long drain(void *base, const struct kp_evring_hdr *h, int summary)
+{
+	unsigned long n = 0;
+	unsigned int cpu;
+
+	for (cpu = 0; cpu < h->ncpus; cpu++) {
+		struct kp_evring_ctl *c = base + h->ring_off + cpu * h->ring_stride;
+		const struct kp_ev *recs = base + h->ring_off + cpu * h->ring_stride + h->data_off;
+		__u32 tail = c->tail;
+		__u32 head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+
+		for (; tail != head; tail++, n++) {
+			const struct kp_ev *ev = &recs[tail & (h->nrec - 1)];
+
+			if (summary) {
+				if (ev->probe_id < MAX_PROBE_IDS)
+					probe_hits[ev->probe_id]++;
+			} else
+				show_event(ev);
+		}
+		/* hand the slots back to the kernel */
+		__atomic_store_n(&c->tail, tail, __ATOMIC_RELEASE);
+	}
+	return n;
+}
+
+static void show_summary(void *base, const struct kp_evring_hdr *h,
+			 unsigned long long total, double secs)
+{
+	unsigned long long lost = 0;
+	unsigned int cpu, id;
+
+	for (cpu = 0; cpu < h->ncpus; cpu++)
+		lost += ((struct kp_evring_ctl *)(base + h->ring_off + cpu * h->ring_stride))->lost;
+	printf("%-24s %14s\n", "probe", "events");
+	for (id = 0; id < MAX_PROBE_IDS; id++) {
+		if (!probe_hits[id])
+			continue;
+		if (probe_name[id])
+			printf("%-24s %14llu\n", probe_name[id], probe_hits[id]);
+		else
+			printf("%-24u %14llu\n", id, probe_hits[id]);
+	}
+	printf("total %llu events in %.3f s (%.0f/s); lost (rings full): %llu\n",
+	       total, secs, secs > 0 ? total / secs : 0, lost);
+}
+
+static double now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, fd, follow = 0, summary = 0;
+	unsigned long long total = 0;
+	struct kp_evring_hdr h;
+	double t0;
+	void *base;
+
+	while ((opt = getopt(argc, argv, "fsm:")) != -1) {
+		switch (opt) {
+		case 'f':
+			follow = 1;
+			break;
+		case 's':
+			summary = 1;
+			break;
+		case 'm':
+			load_map(argv[0], optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+
+	fd = open(argv[optind], O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open %s: %s\n", argv[0], argv[optind], strerror(errno));
+		exit(1);
+	}
+	/* first, just the header, to learn the size (and check the layout) */
+	base = mmap(NULL, sizeof(h), PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %s (is the module's event ring enabled?)\n",
+			argv[0], strerror(errno));
+		exit(1);
+	}
+	memcpy(&h, base, sizeof(h));
+	munmap(base, sizeof(h));
+	if (h.magic != KP_EVRING_MAGIC || h.version != KP_EVRING_VERSION ||
+	    h.rec_size != sizeof(struct kp_ev)) {
+		fprintf(stderr, "%s: %s: unknown event ring layout (magic 0x%x version %u)\n",
+			argv[0], argv[optind], h.magic, h.version);
+		exit(1);
+	}
+	base = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %s\n", argv[0], strerror(errno));
+		exit(1);
+	}
+
+	signal(SIGINT, sig_stop);
+	signal(SIGTERM, sig_stop);
+	t0 = now_secs();
+	do {
+		unsigned long n = drain(base, &h, summary);
+
+		total += n;
+		if (!n && follow)
+			usleep(10000);	/* nothing pending: don't spin */
+		if (!summary)
+			fflush(stdout);
+	} while (follow && !stop);
+
+	if (summary)
+		show_summary(base, &h, total, now_secs() - t0);
+	munmap(base, h.size);
+	close(fd);
+	exit(0);
+
+ usage:
+	fprintf(stderr, "Usage: %s [-f] [-s] [-m probe-id-map] <debugfs>/<module>/events\n"
+		" -f : follow: keep consuming (till ^C); else drain the rings once and exit\n"
+		" -s : summary only: the # of events per probe (and those lost)\n"
+		" -m : a file of 'id name' lines, to show the probes by name\n", argv[0]);
+	exit(1);
+}
@@ -0,0 +1,188 @@
+/*
+ * ch4/kprobes/common/kp_evring.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Debugging"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Debugging
+ *
+ * From: Ch 4: Debug via Instrumentation - Kprobes
+ ****************************************************************
+ * Brief Description:
+ * A binary event transport for our kprobe modules: instead of a printk per
+ * hit (which, at a high rate, floods the log buffer and the console and costs
+ * microseconds a pop), a handler writes a fixed size record - timestamp, cpu,
+ * pid, probe id, args - into it's CPU's ring. The rings are in one
+ * vmalloc_user()'ed region that userspace mmap()s via a debugfs file and
+ * consumes in place - no system call per event. See kp_evring_abi.h for the
+ * layout and the protocol, and kp_evdecode.c for the userspace side.
+ *
+ * Usage:
+ *  static struct kp_evring evr;
+ *  kp_evring_init(&evr, 4096);		// records per CPU
+ *  debugfs_create_file_unsafe("events", 0600, dir, &evr, &kp_evring_fops);
+ *  ...in the handler:
+ *   struct kp_ev *ev = kp_evring_reserve(&evr, id, KP_EV_ENTRY);
+ *   if (ev) {
+ *	kp_ev_args(ev, regs);		// and/or fill in ev->args[] yourself
+ *	kp_evring_commit(&evr);
+ *   }
+ *  kp_evring_free(&evr);		// after the probe's unregistered
+ * (The 'unsafe' debugfs file: the regular one's proxy doesn't do mmap; the
+ * file pins the module - fops.owner - while it's open, and so the region).
+ *
+ * Kprobe handlers run with preemption disabled and don't nest on a CPU, so
+ * there's ever only one producer per ring.
+ *
+ * For details, please refer the book, Ch 4.
+ */
+#ifndef __KP_EVRING_H__
+#define __KP_EVRING_H__
+
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/smp.h>
+#include <linux/log2.h>
+#include <linux/timekeeping.h>
+#include <linux/ptrace.h>
+#include "kp_evring_abi.h"
+
+struct kp_evring {
+	void *base;		/* the whole region; NULL => disabled */
+	u32 nrec;
+	size_t ring_stride;
+};
+
+static __always_inline struct kp_evring_ctl *kp_evring_ctl(struct kp_evring *er, int cpu)
+{
+	return er->base + PAGE_SIZE + cpu * er->ring_stride;
+}
+
+/*
+ * Set up the rings: @nrec records per CPU (rounded up to a power of 2); 0
+ * leaves the transport disabled (kp_evring_reserve() then always fails).
+ */
+static inline int kp_evring_init(struct kp_evring *er, unsigned int nrec)
+{
+	struct kp_evring_hdr *h;
+	size_t size;
+
+	er->base = NULL;
+	if (!nrec)
+		return 0;
+	er->nrec = roundup_pow_of_two(max(nrec, 2U));
+	/* the ctl block gets a page of it's own: it's what the consumer writes to */
+	er->ring_stride = PAGE_SIZE + PAGE_ALIGN(er->nrec * sizeof(struct kp_ev));
+	size = PAGE_SIZE + nr_cpu_ids * er->ring_stride;
+
+	er->base = vmalloc_user(size);	/* zeroed, and mmap-able */
+	if (!er->base)
+		return -ENOMEM;
+	h = er->base;
+	h->magic = KP_EVRING_MAGIC;
+	h->version = KP_EVRING_VERSION;
+	h->ncpus = nr_cpu_ids;
+	h->nrec = er->nrec;
+	h->rec_size = sizeof(struct kp_ev);
+	h->ring_off = PAGE_SIZE;
+	h->ring_stride = er->ring_stride;
+	h->data_off = PAGE_SIZE;
+	h->size = size;
+	return 0;
+}
+
+static inline void kp_evring_free(struct kp_evring *er)
+{
+	vfree(er->base);
+	er->base = NULL;
+}
+
+/*
+ * Get the next free record in this CPU's ring, with the header fields filled
+ * in; NULL if the transport's disabled or the ring's full (the latter's
+ * counted). Call from the probe handler (preemption disabled) and follow up
+ * with kp_evring_commit().
+ */
+static __always_inline struct kp_ev *kp_evring_reserve(struct kp_evring *er, u32 probe_id, u16 type)
+{
+	struct kp_evring_ctl *c;
+	struct kp_ev *ev;
+	int cpu;
+	u32 head;
+
+	if (!er->base)
+		return NULL;
+	cpu = smp_processor_id();
+	c = kp_evring_ctl(er, cpu);
+	head = c->head;
+	if (head - smp_load_acquire(&c->tail) >= er->nrec) {
+		WRITE_ONCE(c->lost, c->lost + 1);
+		return NULL;
+	}
+	ev = (struct kp_ev *)((void *)c + PAGE_SIZE) + (head & (er->nrec - 1));
+	ev->ts_ns = ktime_get_mono_fast_ns();
+	ev->pid = current->pid;
+	ev->cpu = cpu;
+	ev->type = type;
+	ev->probe_id = probe_id;
+	ev->nargs = 0;
+	return ev;
+}
+
+/* Publish the record kp_evring_reserve() returned */
+static __always_inline void kp_evring_commit(struct kp_evring *er)
+{
+	struct kp_evring_ctl *c = kp_evring_ctl(er, smp_processor_id());
+
+	smp_store_release(&c->head, c->head + 1);
+}
+
+/*
+ * Fill in the probed function's first (few) arguments from @regs - valid at
+ * function entry, i.e., in a kprobe pre-handler or a kretprobe entry handler -
+ * as per the processor ABI (see 3_kprobe.c for more on this).
+ */
+static __always_inline void kp_ev_args(struct kp_ev *ev, struct pt_regs *regs)
+{
+#if defined(CONFIG_X86_64)
+	ev->args[0] = regs->di;
+	ev->args[1] = regs->si;
+	ev->args[2] = regs->dx;
+	ev->args[3] = regs->cx;
+	ev->args[4] = regs->r8;
+	ev->nargs = 5;
+#elif defined(CONFIG_ARM64)
+	int i;
+
+	for (i = 0; i < KP_EV_NARGS; i++)
+		ev->args[i] = regs->regs[i];
+	ev->nargs = KP_EV_NARGS;
+#elif defined(CONFIG_ARM)
+	ev->args[0] = regs->ARM_r0;
+	ev->args[1] = regs->ARM_r1;
+	ev->args[2] = regs->ARM_r2;
+	ev->args[3] = regs->ARM_r3;
+	ev->nargs = 4;
+#endif
+}
+
+static int kp_evring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct kp_evring *er = file->private_data;
+
+	if (!er->base)
+		return -ENODEV;
+	return remap_vmalloc_range(vma, er->base, vma->vm_pgoff);
+}
+
+static const struct file_operations kp_evring_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.mmap = kp_evring_mmap,
+};
+
+#endif				/* #ifndef __KP_EVRING_H__ */
@@ -0,0 +1,84 @@
+/*
+ * ch4/kprobes/common/kp_evring_abi.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Debugging"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Debugging
+ *
+ * From: Ch 4: Debug via Instrumentation - Kprobes
+ ****************************************************************
+ * Brief Description:
+ * The common header for the kprobe event rings (kp_evring.h) and their
+ * userspace decoder (kp_evdecode.c): the layout of the mmap-ed region and of
+ * the (fixed size, binary) event records live here, so that both sides always
+ * agree on them.
+ *
+ * The region - all offsets are from it's start:
+ *  0                          : struct kp_evring_hdr
+ *  ring_off + cpu*ring_stride : cpu's ring; it begins with a struct kp_evring_ctl,
+ *                               the records (nrec of them) are at data_off within it
+ * Each ring has a single producer - the probe handler(s) on that CPU - and a
+ * single consumer - the process that mmap-ed it. 'head' and 'tail' are free
+ * running (32-bit, wrapping) counts of the records produced and consumed; the
+ * record at index i is in slot (i & (nrec - 1)). The producer publishes a
+ * record by store-releasing 'head' (the consumer load-acquires it); the
+ * consumer hands slots back by store-releasing 'tail'. When the ring's full,
+ * the new records are dropped and counted in 'lost'.
+ */
+#ifndef __KP_EVRING_ABI_H__
+#define __KP_EVRING_ABI_H__
+
+#include <linux/types.h>
+
+#define KP_EVRING_MAGIC		0x6b706576	/* 'kpev' */
+#define KP_EVRING_VERSION	1
+#define KP_EV_NARGS		5
+
+enum kp_ev_type {
+	KP_EV_HIT = 1,		/* the probe was hit (no args) */
+	KP_EV_ENTRY,		/* function entry; args[] are the function's arguments */
+	KP_EV_LATENCY,		/* args[0] is a latency / duration, in ns */
+};
+
+/* One event record; 64 bytes */
+struct kp_ev {
+	__u64 ts_ns;		/* monotonic clock (CLOCK_MONOTONIC), ns */
+	__u32 pid;
+	__u16 cpu;
+	__u16 type;		/* enum kp_ev_type */
+	__u32 probe_id;		/* which probe, the module decides (helper_kp: see <debugfs>/helper_kp/probe_ids) */
+	__u32 nargs;
+	__u64 args[KP_EV_NARGS];
+};
+
+/* At offset 0 of the region */
+struct kp_evring_hdr {
+	__u32 magic;
+	__u32 version;
+	__u32 ncpus;		/* # of rings: one per possible CPU id */
+	__u32 nrec;		/* # of records per ring; a power of 2 */
+	__u32 rec_size;		/* sizeof(struct kp_ev) */
+	__u32 rsvd;
+	__u64 ring_off;
+	__u64 ring_stride;
+	__u64 data_off;
+	__u64 size;		/* of the whole region */
+};
+
+/*
+ * At the start of each ring. What the producer and the consumer write are on
+ * different cache lines (we assume 64 byte lines), so they don't ping-pong it.
+ */
+struct kp_evring_ctl {
+	__u32 head;		/* written by the producer (kernel) */
+	__u32 rsvd;
+	__u64 lost;		/* ditto */
+	__u8 pad1[64 - 16];
+	__u32 tail;		/* written by the consumer (userspace) */
+	__u8 pad2[64 - 4];
+};
+
+#endif				/* #ifndef __KP_EVRING_ABI_H__ */
@@ -0,0 +1,374 @@
+/*
+ * ch4/kprobes/common/kp_filter.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Debugging"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Debugging
+ *
+ * From: Ch 4: Debug via Instrumentation - Kprobes
+ ****************************************************************
+ * Brief Description:
+ * A runtime-configurable 'who do we care about' filter for our kprobe
+ * handlers, so that we can probe busy, system-wide functions (like
+ * do_sys_open()) while paying next to nothing for the tasks we aren't
+ * interested in. The filter can match on:
+ *  cpus=<cpulist>      : only hits on these CPUs (f.e. cpus=0-3,6)
+ *  pid=<pid>[,<pid>..] : only these processes (the TGID, so all their threads)
+ *  cgroup=<id>         : only tasks in this (cgroup v2) cgroup; the id is the
+ *                        cgroup directory's inode #: stat -c %i /sys/fs/cgroup/<path>
+ *  comm=<name>[,...]   : only tasks with these names; a trailing '*' makes it a
+ *                        prefix (f.e. comm=vi*,bash)
+ * All of the conditions given must hold (the comm's, pid's, etc are OR-ed among
+ * themselves). The handler calls kp_filter_match() first thing; with no filter
+ * set, that's a single load and branch. The conditions are checked cheapest
+ * first: a cpumask bit, a PID bitmap bit, the cgroup id, and the comm - a hash
+ * set lookup - last.
+ *
+ * Usage:
+ *  static struct kp_filter filt;
+ *  kp_filter_init(&filt, "comm=vi*");		// or NULL: no filter
+ *  debugfs_create_file("filter", 0644, dir, &filt, &kp_filter_fops);
+ *  ...in the handler:  if (!kp_filter_match(&filt)) return 0;
+ *  kp_filter_exit(&filt);	// after the probe's unregistered
+ * Reading the debugfs file shows the filter; writing to it replaces it
+ * ('clear', or an empty write, removes it).
+ *
+ * The filter's swapped in as a whole, via RCU; kprobe handlers run with
+ * preemption disabled, which is an RCU read-side critical section.
+ *
+ * For details, please refer the book, Ch 4.
+ */
+#ifndef __KP_FILTER_H__
+#define __KP_FILTER_H__
+
+#include <linux/sched.h>
+#include <linux/kprobes.h>
+#include <linux/cgroup.h>
+#include <linux/cpumask.h>
+#include <linux/bitmap.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/threads.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+
+#define KP_F_CPUS	0x1
+#define KP_F_PID	0x2
+#define KP_F_CGROUP	0x4
+#define KP_F_COMM	0x8
+
+#define KP_FILTER_COMMS		32	/* comm hash set slots; a power of 2 */
+#define KP_FILTER_MAX_COMMS	(KP_FILTER_COMMS / 2)
+#define KP_FILTER_PREFIXES	8
+#define KP_FILTER_MAX_SPEC	4096
+
+#if defined(CONFIG_CGROUPS) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 7, 0)
+#define KP_FILTER_HAVE_CGROUP
+#endif
+
+struct kp_filter_set {
+	unsigned int want;		/* KP_F_* : the conditions that apply */
+	cpumask_var_t cpus;
+	unsigned long *pids;		/* a bitmap of PID_MAX_LIMIT bits */
+	u64 cgroup_id;
+	int ncomms, nprefixes;
+	char comm[KP_FILTER_COMMS][TASK_COMM_LEN];	/* open addressing, by jhash */
+	char prefix[KP_FILTER_PREFIXES][TASK_COMM_LEN];
+};
+
+struct kp_filter {
+	struct kp_filter_set __rcu *set;	/* NULL => everything matches */
+	struct mutex lock;			/* serializes the updaters */
+};
+
+static __always_inline u32 kp_filter_comm_slot(const char *comm, int len)
+{
+	return jhash(comm, len, 0) & (KP_FILTER_COMMS - 1);
+}
+
+static __always_inline bool kp_filter_comm_match(const struct kp_filter_set *s)
+{
+	char comm[TASK_COMM_LEN];
+	int i, len;
+	u32 slot;
+
+	memcpy(comm, current->comm, TASK_COMM_LEN);
+	comm[TASK_COMM_LEN - 1] = '\0';
+	len = strlen(comm);
+
+	for (i = 0; i < s->nprefixes; i++)
+		if (!strncmp(comm, s->prefix[i], strlen(s->prefix[i])))
+			return true;
+	if (!s->ncomms)
+		return false;
+	/* the set's at most half full, so there's always an empty slot to stop at */
+	for (slot = kp_filter_comm_slot(comm, len); s->comm[slot][0];
+	     slot = (slot + 1) & (KP_FILTER_COMMS - 1))
+		if (!strcmp(s->comm[slot], comm))
+			return true;
+	return false;
+}
+
+static __always_inline bool kp_filter_cgroup_match(const struct kp_filter_set *s)
+{
+#ifdef KP_FILTER_HAVE_CGROUP
+	bool match;
+
+	rcu_read_lock();
+	match = cgroup_id(task_dfl_cgroup(current)) == s->cgroup_id;
+	rcu_read_unlock();
+	return match;
+#else
+	return false;
+#endif
+}
+
+static noinline bool __kp_filter_match(const struct kp_filter_set *s)
+{
+	if ((s->want & KP_F_CPUS) && !cpumask_test_cpu(raw_smp_processor_id(), s->cpus))
+		return false;
+	if ((s->want & KP_F_PID) &&
+	    (current->tgid >= PID_MAX_LIMIT || !test_bit(current->tgid, s->pids)))
+		return false;
+	if ((s->want & KP_F_CGROUP) && !kp_filter_cgroup_match(s))
+		return false;
+	if ((s->want & KP_F_COMM) && !kp_filter_comm_match(s))
+		return false;
+	return true;
+}
+NOKPROBE_SYMBOL(__kp_filter_match);
+
+/*
+ * Does the current context pass the filter? Call it from the probe handler
+ * (i.e., with preemption disabled), before doing anything else.
+ */
+static __always_inline bool kp_filter_match(struct kp_filter *f)
+{
+	struct kp_filter_set *s = rcu_dereference_sched(f->set);
+
+	if (likely(!s))
+		return true;
+	return __kp_filter_match(s);
+}
+
+static inline void kp_filter_set_free(struct kp_filter_set *s)
+{
+	if (!s)
+		return;
+	free_cpumask_var(s->cpus);
+	vfree(s->pids);
+	kfree(s);
+}
+
+static inline int kp_filter_add_comm(struct kp_filter_set *s, const char *name)
+{
+	int len = strlen(name);
+	u32 slot;
+
+	if (!len || len >= TASK_COMM_LEN)
+		return -EINVAL;
+	if (name[len - 1] == '*') {
+		if (s->nprefixes >= KP_FILTER_PREFIXES)
+			return -E2BIG;
+		strscpy(s->prefix[s->nprefixes++], name, len);	/* drops the '*' */
+		return 0;
+	}
+	if (s->ncomms >= KP_FILTER_MAX_COMMS)
+		return -E2BIG;
+	for (slot = kp_filter_comm_slot(name, len); s->comm[slot][0];
+	     slot = (slot + 1) & (KP_FILTER_COMMS - 1))
+		if (!strcmp(s->comm[slot], name))
+			return 0;
+	strscpy(s->comm[slot], name, TASK_COMM_LEN);
+	s->ncomms++;
+	return 0;
+}
+
+/* Parse one 'key=value' term of the filter spec into @s */
+static inline int kp_filter_parse_term(struct kp_filter_set *s, char *term)
+{
+	char *key = strsep(&term, "="), *v;
+	int ret = 0, pid;
+
+	if (!term || !*term)
+		return -EINVAL;
+	if (!strcmp(key, "cpus")) {
+		ret = cpulist_parse(term, s->cpus);
+		s->want |= KP_F_CPUS;
+	} else if (!strcmp(key, "pid")) {
+		if (!s->pids) {
+			s->pids = vzalloc(BITS_TO_LONGS(PID_MAX_LIMIT) * sizeof(long));
+			if (!s->pids)
+				return -ENOMEM;
+		}
+		while (!ret && (v = strsep(&term, ",")) != NULL) {
+			ret = kstrtoint(v, 0, &pid);
+			if (!ret && (pid <= 0 || pid >= PID_MAX_LIMIT))
+				ret = -ERANGE;
+			if (!ret)
+				set_bit(pid, s->pids);
+		}
+		s->want |= KP_F_PID;
+	} else if (!strcmp(key, "cgroup")) {
+#ifdef KP_FILTER_HAVE_CGROUP
+		ret = kstrtou64(term, 0, &s->cgroup_id);
+		s->want |= KP_F_CGROUP;
+#else
+		ret = -EOPNOTSUPP;
+#endif
+	} else if (!strcmp(key, "comm")) {
+		while (!ret && (v = strsep(&term, ",")) != NULL)
+			ret = kp_filter_add_comm(s, v);
+		s->want |= KP_F_COMM;
+	} else
+		ret = -EINVAL;
+	return ret;
+}
+
+/*
+ * Replace the filter with the one @spec - whitespace-separated 'key=value'
+ * terms, see the top of this file - describes; a NULL or empty @spec, or
+ * 'clear', removes it.
+ */
+static inline int kp_filter_update(struct kp_filter *f, const char *spec)
+{
+	struct kp_filter_set *s = NULL, *old;
+	char *buf = NULL, *p = NULL, *term;
+	int ret = 0;
+
+	if (spec) {
+		buf = kstrdup(spec, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+		p = strim(buf);
+	}
+	if (p && *p && strcmp(p, "clear")) {
+		s = kzalloc(sizeof(*s), GFP_KERNEL);
+		if (!s || !zalloc_cpumask_var(&s->cpus, GFP_KERNEL)) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		while (!ret && (term = strsep(&p, " \t\n")) != NULL)
+			if (*term)
+				ret = kp_filter_parse_term(s, term);
+		if (ret)
+			goto out;
+		if (!s->want) {		/* nothing to filter on, after all */
+			kp_filter_set_free(s);
+			s = NULL;
+		}
+	}
+
+	mutex_lock(&f->lock);
+	old = rcu_dereference_protected(f->set, lockdep_is_held(&f->lock));
+	rcu_assign_pointer(f->set, s);
+	mutex_unlock(&f->lock);
+	/* wait out the handlers that may still be looking at the old one */
+	synchronize_rcu();
+	s = old;
+ out:
+	kp_filter_set_free(s);
+	kfree(buf);
+	return ret;
+}
+
+static inline int kp_filter_init(struct kp_filter *f, const char *spec)
+{
+	RCU_INIT_POINTER(f->set, NULL);
+	mutex_init(&f->lock);
+	return kp_filter_update(f, spec);
+}
+
+/* Call once the probe(s) using the filter are unregistered */
+static inline void kp_filter_exit(struct kp_filter *f)
+{
+	kp_filter_set_free(rcu_dereference_protected(f->set, 1));
+	RCU_INIT_POINTER(f->set, NULL);
+}
+
+static int kp_filter_seq_show(struct seq_file *m, void *unused)
+{
+	struct kp_filter *f = m->private;
+	struct kp_filter_set *s;
+	int i;
+
+	mutex_lock(&f->lock);
+	s = rcu_dereference_protected(f->set, lockdep_is_held(&f->lock));
+	if (!s) {
+		seq_puts(m, "(none)\n");
+		goto out;
+	}
+	if (s->want & KP_F_CPUS)
+		seq_printf(m, "cpus=%*pbl ", cpumask_pr_args(s->cpus));
+	if (s->want & KP_F_PID) {
+		int pid = 0;
+		char sep = '=';
+
+		seq_puts(m, "pid");
+		for_each_set_bit(pid, s->pids, PID_MAX_LIMIT) {
+			seq_printf(m, "%c%d", sep, pid);
+			sep = ',';
+		}
+		seq_putc(m, ' ');
+	}
+	if (s->want & KP_F_CGROUP)
+		seq_printf(m, "cgroup=%llu ", s->cgroup_id);
+	if (s->want & KP_F_COMM) {
+		char sep = '=';
+
+		seq_puts(m, "comm");
+		for (i = 0; i < s->nprefixes; i++, sep = ',')
+			seq_printf(m, "%c%s*", sep, s->prefix[i]);
+		for (i = 0; i < KP_FILTER_COMMS; i++) {
+			if (!s->comm[i][0])
+				continue;
+			seq_printf(m, "%c%s", sep, s->comm[i]);
+			sep = ',';
+		}
+	}
+	seq_putc(m, '\n');
+ out:
+	mutex_unlock(&f->lock);
+	return 0;
+}
+
+static int kp_filter_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, kp_filter_seq_show, inode->i_private);
+}
+
+static ssize_t kp_filter_write(struct file *file, const char __user *ubuf,
+			       size_t count, loff_t *ppos)
+{
+	struct kp_filter *f = ((struct seq_file *)file->private_data)->private;
+	char *spec;
+	int ret;
+
+	if (count > KP_FILTER_MAX_SPEC)
+		return -E2BIG;
+	spec = memdup_user_nul(ubuf, count);
+	if (IS_ERR(spec))
+		return PTR_ERR(spec);
+	ret = kp_filter_update(f, spec);
+	kfree(spec);
+	return ret ? ret : count;
+}
+
+static const struct file_operations kp_filter_fops = {
+	.owner = THIS_MODULE,
+	.open = kp_filter_open,
+	.read = seq_read,
+	.write = kp_filter_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+#endif				/* #ifndef __KP_FILTER_H__ */
@@ -0,0 +1,175 @@
+/*
+ * ch4/kprobes/common/kp_hist.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Debugging"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Debugging
+ *
+ * From: Ch 4: Debug via Instrumentation - Kprobes
+ ****************************************************************
+ * Brief Description:
+ * Per-cpu, lock-free latency histograms for our kprobe modules.
+ * A probe handler records a value (a latency, in ns) into it's *own CPU's*
+ * histogram: no lock, no shared cache line and no printk. The per-cpu
+ * histograms are folded into one only when they're read, typically via a
+ * debugfs (seq_file) file; see kp_hist_show().
+ * (Kprobe handlers run non-preemptible, and kprobes don't nest on a CPU - a
+ * probe hit while another's handler runs is simply 'missed' - so there's only
+ * ever one writer per CPU; the plain per-cpu updates below are safe).
+ *
+ * The buckets are 'log-linear': values below KP_HIST_SUB get a bucket each;
+ * above that, each power of 2 range is split into KP_HIST_SUB linear
+ * sub-buckets. So the relative error is at most 1/KP_HIST_SUB (12.5%) over the
+ * entire range; values of 2^KP_HIST_MAX_SHIFT ns (~68 s) or more all land in
+ * the last bucket.
+ *
+ * For details, please refer the book, Ch 4.
+ */
+#ifndef __KP_HIST_H__
+#define __KP_HIST_H__
+
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+
+#define KP_HIST_SUB_BITS	3
+#define KP_HIST_SUB		(1 << KP_HIST_SUB_BITS)
+#define KP_HIST_MAX_SHIFT	36
+#define KP_HIST_BUCKETS		((KP_HIST_MAX_SHIFT - KP_HIST_SUB_BITS + 1) * KP_HIST_SUB)
+
+struct kp_hist {
+	u64 cnt[KP_HIST_BUCKETS];
+	u64 n, sum, min, max;
+};
+
+static inline int kp_hist_index(u64 v)
+{
+	int shift;
+
+	if (v < KP_HIST_SUB)
+		return v;
+	if (v >= (1ULL << KP_HIST_MAX_SHIFT))
+		return KP_HIST_BUCKETS - 1;
+	shift = fls64(v) - 1 - KP_HIST_SUB_BITS;
+	return shift * KP_HIST_SUB + (int)(v >> shift);
+}
+
+/* The highest value that maps to bucket @idx */
+static inline u64 kp_hist_value(int idx)
+{
+	int shift = idx / KP_HIST_SUB - 1;
+
+	if (shift <= 0)
+		return idx;
+	return ((u64)(idx - shift * KP_HIST_SUB + 1) << shift) - 1;
+}
+
+/* Record @v into this CPU's histogram; call with preemption disabled */
+static inline void kp_hist_record(struct kp_hist __percpu *h, u64 v)
+{
+	struct kp_hist *p = this_cpu_ptr(h);
+
+	p->cnt[kp_hist_index(v)]++;
+	if (!p->n || v < p->min)
+		p->min = v;
+	if (v > p->max)
+		p->max = v;
+	p->sum += v;
+	p->n++;
+}
+
+static inline void kp_hist_reset(struct kp_hist __percpu *h)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(h, cpu), 0, sizeof(struct kp_hist));
+}
+
+/* Fold the per-cpu histograms into @t */
+static inline void kp_hist_fold(struct kp_hist __percpu *h, struct kp_hist *t)
+{
+	int cpu, i;
+
+	memset(t, 0, sizeof(*t));
+	for_each_possible_cpu(cpu) {
+		const struct kp_hist *p = per_cpu_ptr(h, cpu);
+		u64 n = READ_ONCE(p->n);
+
+		if (!n)
+			continue;
+		for (i = 0; i < KP_HIST_BUCKETS; i++)
+			t->cnt[i] += READ_ONCE(p->cnt[i]);
+		if (!t->n || READ_ONCE(p->min) < t->min)
+			t->min = READ_ONCE(p->min);
+		if (READ_ONCE(p->max) > t->max)
+			t->max = READ_ONCE(p->max);
+		t->sum += READ_ONCE(p->sum);
+		t->n += n;
+	}
+}
+
+/* The value at the @permille'th per-mille (f.e. 500 => p50, 999 => p99.9) */
+static inline u64 kp_hist_pct(const struct kp_hist *t, unsigned int permille)
+{
+	u64 want = div_u64(t->n * permille + 999, 1000), seen = 0;
+	int i;
+
+	for (i = 0; i < KP_HIST_BUCKETS; i++) {
+		seen += t->cnt[i];
+		if (seen && seen >= want)
+			return min(kp_hist_value(i), t->max);
+	}
+	return t->max;
+}
+
+/*
+ * Show the (folded) histogram @h, headed by @title, on the seq_file @m: a
+ * summary line (# of samples, min/avg/max), the percentiles and then the
+ * non-empty buckets, with a bar each.
+ */
+static inline int kp_hist_show(struct seq_file *m, struct kp_hist __percpu *h,
+			       const char *title)
+{
+	struct kp_hist *t;
+	u64 top = 0;
+	int i;
+
+	t = kmalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+	kp_hist_fold(h, t);
+
+	seq_printf(m, "%s\n", title);
+	if (!t->n) {
+		seq_puts(m, " (no samples)\n");
+		goto out;
+	}
+	seq_printf(m, " samples %llu : min %llu  avg %llu  max %llu ns\n",
+		   t->n, t->min, div64_u64(t->sum, t->n), t->max);
+	seq_printf(m, " p50 %llu  p90 %llu  p99 %llu  p99.9 %llu ns\n",
+		   kp_hist_pct(t, 500), kp_hist_pct(t, 900),
+		   kp_hist_pct(t, 990), kp_hist_pct(t, 999));
+
+	for (i = 0; i < KP_HIST_BUCKETS; i++)
+		top = max(top, t->cnt[i]);
+	seq_printf(m, " %25s %12s\n", "ns range", "count");
+	for (i = 0; i < KP_HIST_BUCKETS; i++) {
+		if (!t->cnt[i])
+			continue;
+		seq_printf(m, " [%11llu - %11llu] %12llu |%.*s\n",
+			   i ? kp_hist_value(i - 1) + 1 : 0, kp_hist_value(i), t->cnt[i],
+			   (int)div64_u64(t->cnt[i] * 40 + top - 1, top),
+			   "########################################");
+	}
+ out:
+	kfree(t);
+	return 0;
+}
+
+#endif				/* #ifndef __KP_HIST_H__ */
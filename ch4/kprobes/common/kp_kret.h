@@ -0,0 +1,174 @@
+/*
+ * ch4/kprobes/common/kp_kret.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Debugging"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Debugging
+ *
+ * From: Ch 4: Debug via Instrumentation - Kprobes
+ ****************************************************************
+ * Brief Description:
+ * Measuring a kernel function's *true* duration - from entry to return - via a
+ * kretprobe. (The 'delta' between a kprobe's pre and post handlers just
+ * brackets the single-stepped first instruction of the function, not it's
+ * execution).
+ * The kretprobe's entry handler stamps the time into the per-instance data
+ * area (the kretprobe's 'data_size' bytes); every invocation of the function
+ * gets it's own instance, so recursive calls, and concurrent calls on other
+ * CPUs, never share - or clobber - a timestamp. The return handler records the
+ * delta into a per-cpu histogram (see kp_hist.h); we use the NMI-safe
+ * monotonic clock, as the return may well happen on another CPU.
+ *
+ * Usage:
+ *  static struct kp_kret kr;
+ *  kp_kret_register(&kr, "do_sys_open", NULL);
+ *  debugfs_create_file("duration", 0644, dir, &kr, &kp_kret_fops);
+ *  ...
+ *  kp_kret_unregister(&kr);
+ * Reading the debugfs file shows the min/avg/max and percentiles of the
+ * duration, and the histogram itself; writing to it resets them.
+ *
+ * For details, please refer the book, Ch 4.
+ */
+#ifndef __KP_KRET_H__
+#define __KP_KRET_H__
+
+#include <linux/kprobes.h>
+#include <linux/timekeeping.h>
+#include <linux/debugfs.h>
+#include <linux/version.h>
+#include "kp_hist.h"
+
+struct kp_kret {
+	struct kretprobe krp;
+	struct kp_hist __percpu *hist;
+	/* optional: called on entry; return true to not time this invocation */
+	bool (*skip)(struct kp_kret *k, struct pt_regs *regs);
+};
+
+/* The per-instance data (the kretprobe's 'data_size' area) */
+struct kp_kret_data {
+	u64 entry_ns;
+};
+
+static inline struct kp_kret *kp_kret_of(struct kretprobe_instance *ri)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+	return container_of(get_kretprobe(ri), struct kp_kret, krp);
+#else
+	return container_of(ri->rp, struct kp_kret, krp);
+#endif
+}
+
+static int kp_kret_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct kp_kret *k = kp_kret_of(ri);
+	struct kp_kret_data *d = (struct kp_kret_data *)ri->data;
+
+	/* a non-zero return tells kprobes not to hook this function return */
+	if (k->skip && k->skip(k, regs))
+		return 1;
+	d->entry_ns = ktime_get_mono_fast_ns();
+	return 0;
+}
+NOKPROBE_SYMBOL(kp_kret_entry);
+
+static int kp_kret_ret(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct kp_kret_data *d = (struct kp_kret_data *)ri->data;
+
+	kp_hist_record(kp_kret_of(ri)->hist, ktime_get_mono_fast_ns() - d->entry_ns);
+	return 0;
+}
+NOKPROBE_SYMBOL(kp_kret_ret);
+
+/*
+ * Set up - but don't yet register - a kretprobe on @sym that times it's every
+ * invocation (unless @skip, if non-NULL, says otherwise). Useful to register
+ * several in one go, via register_kretprobes().
+ */
+static inline int kp_kret_init(struct kp_kret *k, const char *sym,
+			       bool (*skip)(struct kp_kret *k, struct pt_regs *regs))
+{
+	k->hist = alloc_percpu(struct kp_hist);
+	if (!k->hist)
+		return -ENOMEM;
+	k->skip = skip;
+	k->krp.kp.symbol_name = sym;
+	k->krp.entry_handler = kp_kret_entry;
+	k->krp.handler = kp_kret_ret;
+	k->krp.data_size = sizeof(struct kp_kret_data);
+	/*
+	 * The # of instances - i.e., of invocations of the function in flight at
+	 * once - we can track; the function may well sleep (like do_sys_open()
+	 * does), so be generous. Invocations beyond this are counted in nmissed.
+	 */
+	k->krp.maxactive = 64 + 4 * num_possible_cpus();
+	return 0;
+}
+
+/* Free the kretprobe's resources; it must not be registered (anymore) */
+static inline void kp_kret_free(struct kp_kret *k)
+{
+	free_percpu(k->hist);
+	k->hist = NULL;
+}
+
+/* Set up and register a kretprobe on @sym; see kp_kret_init() */
+static inline int kp_kret_register(struct kp_kret *k, const char *sym,
+				   bool (*skip)(struct kp_kret *k, struct pt_regs *regs))
+{
+	int ret = kp_kret_init(k, sym, skip);
+
+	if (ret)
+		return ret;
+	ret = register_kretprobe(&k->krp);
+	if (ret)
+		kp_kret_free(k);
+	return ret;
+}
+
+static inline void kp_kret_unregister(struct kp_kret *k)
+{
+	/* waits for any running handlers to complete */
+	unregister_kretprobe(&k->krp);
+	kp_kret_free(k);
+}
+
+static int kp_kret_seq_show(struct seq_file *m, void *unused)
+{
+	struct kp_kret *k = m->private;
+	char title[128];
+
+	snprintf(title, sizeof(title), "kretprobe @ %s : entry -> return duration"
+		 " (missed: %d)", k->krp.kp.symbol_name, k->krp.nmissed);
+	return kp_hist_show(m, k->hist, title);
+}
+
+static int kp_kret_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, kp_kret_seq_show, inode->i_private);
+}
+
+static ssize_t kp_kret_write(struct file *file, const char __user *ubuf,
+			     size_t count, loff_t *ppos)
+{
+	struct kp_kret *k = ((struct seq_file *)file->private_data)->private;
+
+	kp_hist_reset(k->hist);
+	return count;
+}
+
+static const struct file_operations kp_kret_fops = {
+	.owner = THIS_MODULE,
+	.open = kp_kret_open,
+	.read = seq_read,
+	.write = kp_kret_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+#endif				/* #ifndef __KP_KRET_H__ */
@@ -0,0 +1,240 @@
+/*
+ * ch4/kprobes/common/kp_ratectl.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Debugging"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Debugging
+ *
+ * From: Ch 4: Debug via Instrumentation - Kprobes
+ ****************************************************************
+ * Brief Description:
+ * Rate control for what our kprobe handlers report (printk, events, stacks):
+ *  - sampling: report only 1 in every 'sample' hits, and
+ *  - a token bucket: report at most 'max_rate' hits a second.
+ * Both are plain integers, so can be changed at any time (f.e. via a module
+ * parameter or a debugfs file); 0 turns them off.
+ *
+ * Unlike printk_ratelimit() / pr_*_ratelimited() - a shared, spinlock-ed
+ * state - all the state here's per-cpu, so a skipped hit costs a per-cpu
+ * increment and a compare: a few ns. The token bucket too is per-cpu: each
+ * CPU's refills at max_rate / (# of online CPUs) a second (but at least one),
+ * holding at most a second's worth; the clock's only read when it's empty.
+ *
+ * We also measure the handler's own overhead, if asked to:
+ *  u64 t0 = kp_selftime_begin(on);
+ *  ...
+ *  kp_selftime_end(&rc, t0);
+ * (local_clock() twice: some tens of ns, which is included).
+ *
+ * Usage:
+ *  static struct kp_ratectl rc;
+ *  kp_ratectl_init(&rc, sample, max_rate);
+ *  ...in the handler:  if (!kp_rate_allow(&rc)) return 0;
+ *  kp_ratectl_free(&rc);	// after the probe's unregistered
+ *
+ * For details, please refer the book, Ch 4.
+ */
+#ifndef __KP_RATECTL_H__
+#define __KP_RATECTL_H__
+
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/sched/clock.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/kprobes.h>
+
+struct kp_rate_pcpu {
+	u32 count;		/* hits since the last sampled one */
+	u32 tokens;
+	u64 refill_ts;		/* local_clock() of the last refill */
+	u64 passed, sampled_out, limited;
+	u64 self_ns, self_nr;	/* handler overhead */
+};
+
+struct kp_ratectl {
+	unsigned int sample;	/* report 1 in 'sample' hits; 0 or 1 => all of them */
+	unsigned int max_rate;	/* at most these many reports/s (system-wide); 0 => no limit */
+	struct kp_rate_pcpu __percpu *pc;
+};
+
+static inline int kp_ratectl_init(struct kp_ratectl *rc, unsigned int sample,
+				  unsigned int max_rate)
+{
+	rc->sample = sample;
+	rc->max_rate = max_rate;
+	rc->pc = alloc_percpu(struct kp_rate_pcpu);
+	return rc->pc ? 0 : -ENOMEM;
+}
+
+static inline void kp_ratectl_free(struct kp_ratectl *rc)
+{
+	free_percpu(rc->pc);
+	rc->pc = NULL;
+}
+
+/* The bucket's empty: refill it as per the time since the last refill */
+static noinline bool kp_rate_refill(struct kp_rate_pcpu *p, unsigned int max_rate)
+{
+	u64 rate = max_t(u64, max_rate / num_online_cpus(), 1);
+	u64 now = local_clock();
+	u64 elapsed = min_t(u64, now - p->refill_ts, NSEC_PER_SEC);
+	u64 add = div64_u64(elapsed * rate, NSEC_PER_SEC);
+
+	if (!add)
+		return false;
+	p->tokens = add;	/* (<= rate: a second's worth at most) */
+	p->refill_ts = now;
+	return true;
+}
+NOKPROBE_SYMBOL(kp_rate_refill);
+
+/* Should this hit be reported? Call from the probe handler (preemption disabled) */
+static __always_inline bool kp_rate_allow(struct kp_ratectl *rc)
+{
+	struct kp_rate_pcpu *p = this_cpu_ptr(rc->pc);
+	unsigned int n = READ_ONCE(rc->sample);
+	unsigned int max_rate = READ_ONCE(rc->max_rate);
+
+	if (n > 1 && ++p->count < n) {
+		p->sampled_out++;
+		return false;
+	}
+	p->count = 0;
+	if (max_rate && !p->tokens && !kp_rate_refill(p, max_rate)) {
+		p->limited++;
+		return false;
+	}
+	if (max_rate)
+		p->tokens--;
+	p->passed++;
+	return true;
+}
+
+static __always_inline u64 kp_selftime_begin(bool on)
+{
+	return on ? local_clock() : 0;
+}
+
+static __always_inline void kp_selftime_end(struct kp_ratectl *rc, u64 t0)
+{
+	struct kp_rate_pcpu *p;
+
+	if (!t0)
+		return;
+	p = this_cpu_ptr(rc->pc);
+	p->self_ns += local_clock() - t0;
+	p->self_nr++;
+}
+
+/* Zero the counts (not the settings); racy wrt the handlers, fine for stats */
+static inline void kp_ratectl_reset(struct kp_ratectl *rc)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct kp_rate_pcpu *p = per_cpu_ptr(rc->pc, cpu);
+
+		p->passed = p->sampled_out = p->limited = 0;
+		p->self_ns = p->self_nr = 0;
+	}
+}
+
+/*
+ * Parse "sample=N", "rate=N" and "reset" terms (space separated) into @rc;
+ * nothing's changed if any term's invalid. Modifies @buf.
+ */
+static inline int kp_ratectl_parse(struct kp_ratectl *rc, char *buf)
+{
+	unsigned int sample = rc->sample, max_rate = rc->max_rate;
+	bool reset = false;
+	char *term;
+
+	while ((term = strsep(&buf, " \t\n")) != NULL) {
+		if (!*term)
+			continue;
+		if (!strncmp(term, "sample=", 7)) {
+			if (kstrtouint(term + 7, 0, &sample))
+				return -EINVAL;
+		} else if (!strncmp(term, "rate=", 5)) {
+			if (kstrtouint(term + 5, 0, &max_rate))
+				return -EINVAL;
+		} else if (!strcmp(term, "reset"))
+			reset = true;
+		else
+			return -EINVAL;
+	}
+	WRITE_ONCE(rc->sample, sample);
+	WRITE_ONCE(rc->max_rate, max_rate);
+	if (reset)
+		kp_ratectl_reset(rc);
+	return 0;
+}
+
+/* One line: the settings, the per-cpu counts summed, and the handler overhead */
+static inline void kp_ratectl_show(struct seq_file *m, struct kp_ratectl *rc)
+{
+	u64 passed = 0, sampled_out = 0, limited = 0, self_ns = 0, self_nr = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct kp_rate_pcpu *p = per_cpu_ptr(rc->pc, cpu);
+
+		passed += p->passed;
+		sampled_out += p->sampled_out;
+		limited += p->limited;
+		self_ns += p->self_ns;
+		self_nr += p->self_nr;
+	}
+	seq_printf(m, "sample=%u rate=%u  reported %llu sampled_out %llu rate_limited %llu",
+		   READ_ONCE(rc->sample), READ_ONCE(rc->max_rate), passed, sampled_out, limited);
+	if (self_nr)
+		seq_printf(m, "  handler %llu ns avg (%llu timed)", div64_u64(self_ns, self_nr), self_nr);
+	seq_putc(m, '\n');
+}
+
+static int kp_ratectl_seq_show(struct seq_file *m, void *unused)
+{
+	kp_ratectl_show(m, m->private);
+	return 0;
+}
+
+static int kp_ratectl_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, kp_ratectl_seq_show, inode->i_private);
+}
+
+static ssize_t kp_ratectl_write(struct file *file, const char __user *ubuf,
+				size_t count, loff_t *ppos)
+{
+	struct kp_ratectl *rc = ((struct seq_file *)file->private_data)->private;
+	char *buf;
+	int ret;
+
+	if (count > PAGE_SIZE)
+		return -E2BIG;
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+	ret = kp_ratectl_parse(rc, buf);
+	kfree(buf);
+	return ret ? ret : count;
+}
+
+/* For a module with a single kp_ratectl; write "sample=N rate=N" and/or "reset" */
+static const struct file_operations kp_ratectl_fops = {
+	.owner = THIS_MODULE,
+	.open = kp_ratectl_open,
+	.read = seq_read,
+	.write = kp_ratectl_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+#endif				/* #ifndef __KP_RATECTL_H__ */
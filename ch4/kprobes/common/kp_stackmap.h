@@ -0,0 +1,212 @@
+/*
+ * ch4/kprobes/common/kp_stackmap.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Debugging"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Debugging
+ *
+ * From: Ch 4: Debug via Instrumentation - Kprobes
+ ****************************************************************
+ * Brief Description:
+ * Call-path profiling for our kprobe handlers: instead of a dump_stack() on
+ * every hit - catastrophically slow on a hot function, and unreadable - we
+ * save the kernel stack (stack_trace_save(); no symbol lookup, no printk),
+ * hash it, and count it in a table of the unique stacks (much like the
+ * kernel's stackdepot). The table's only symbolized when it's read, as
+ * 'folded' stacks - one line per unique stack:
+ *  outermost_caller;...;caller;probed_function <count>
+ * - ready to feed to Brendan Gregg's flamegraph.pl.
+ *
+ * The table's allocated up front - the handler never allocates - as an open
+ * addressing hash table; a new stack claims a free slot via cmpxchg() and
+ * publishes it, once filled in, with a store-release; so, no locks. When the
+ * table's full (or the probe sequence too long), new stacks are just counted
+ * as dropped.
+ *
+ * Usage:
+ *  static struct kp_stackmap sm;
+ *  kp_stackmap_init(&sm);
+ *  debugfs_create_file("stacks", 0644, dir, &sm, &kp_stackmap_fops);
+ *  ...in the handler:  kp_stackmap_record(&sm, p->addr);
+ *  kp_stackmap_free(&sm);	// after the probe's unregistered
+ * Writing to the debugfs file resets the counts.
+ *
+ * For details, please refer the book, Ch 4.
+ */
+#ifndef __KP_STACKMAP_H__
+#define __KP_STACKMAP_H__
+
+#include <linux/stacktrace.h>
+#include <linux/jhash.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+
+#define KP_STACK_DEPTH		32	/* frames kept per stack */
+#define KP_STACK_SKIP_MAX	16	/* handler & kprobes frames we may trim */
+#define KP_STACKMAP_BITS	12	/* 4096 unique stacks */
+#define KP_STACKMAP_SIZE	(1 << KP_STACKMAP_BITS)
+#define KP_STACKMAP_PROBES	32	/* max slots looked at per lookup */
+/* how far into the probed function its frame's ip may be (the int3's at it's start) */
+#define KP_STACK_FUNC_SLACK	64
+
+struct kp_stack {
+	u32 hash;		/* 0 => a free slot */
+	u32 ready;		/* set (store-release) once ips[] and nr are valid */
+	u32 nr;
+	atomic_long_t hits;
+	unsigned long ips[KP_STACK_DEPTH];	/* ips[0] is the innermost frame */
+};
+
+struct kp_stackmap {
+	struct kp_stack *slots;
+	atomic_long_t dropped;
+	/* per-cpu scratch space for stack_trace_save(): kprobes don't nest */
+	struct kp_stack_scratch {
+		unsigned long ips[KP_STACK_SKIP_MAX + KP_STACK_DEPTH];
+	} __percpu *scratch;
+};
+
+static inline int kp_stackmap_init(struct kp_stackmap *sm)
+{
+	sm->slots = vzalloc(array_size(KP_STACKMAP_SIZE, sizeof(struct kp_stack)));
+	if (!sm->slots)
+		return -ENOMEM;
+	sm->scratch = alloc_percpu(struct kp_stack_scratch);
+	if (!sm->scratch) {
+		vfree(sm->slots);
+		sm->slots = NULL;
+		return -ENOMEM;
+	}
+	atomic_long_set(&sm->dropped, 0);
+	return 0;
+}
+
+static inline void kp_stackmap_free(struct kp_stackmap *sm)
+{
+	free_percpu(sm->scratch);
+	vfree(sm->slots);
+	sm->slots = NULL;
+}
+
+static __always_inline unsigned int kp_stack_save(unsigned long *ips, unsigned int max)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+	return stack_trace_save(ips, max, 0);
+#else
+	struct stack_trace trace = {
+		.entries = ips,
+		.max_entries = max,
+	};
+
+	save_stack_trace(&trace);
+	return trace.nr_entries;
+#endif
+}
+
+/*
+ * Count the current kernel stack; @func is the probed function's (probe)
+ * address: the frames inner to it - our handler's, the kprobes machinery's -
+ * are trimmed off, so the stack 'ends' in the probed function. Call from the
+ * probe handler (preemption disabled).
+ */
+static inline void kp_stackmap_record(struct kp_stackmap *sm, void *func)
+{
+	struct kp_stack_scratch *sc = this_cpu_ptr(sm->scratch);
+	unsigned long *ips = sc->ips;
+	unsigned int nr, i;
+	u32 hash;
+
+	nr = kp_stack_save(ips, ARRAY_SIZE(sc->ips));
+	for (i = 0; i < nr && i < KP_STACK_SKIP_MAX; i++) {
+		if (ips[i] - (unsigned long)func < KP_STACK_FUNC_SLACK) {
+			ips += i;
+			nr -= i;
+			break;
+		}
+	}
+	nr = min_t(unsigned int, nr, KP_STACK_DEPTH);
+	hash = jhash(ips, nr * sizeof(unsigned long), nr) | 1;	/* never 0 */
+
+	for (i = 0; i < KP_STACKMAP_PROBES; i++) {
+		struct kp_stack *s = &sm->slots[(hash + i) & (KP_STACKMAP_SIZE - 1)];
+		u32 cur = READ_ONCE(s->hash);
+
+		if (!cur) {
+			cur = cmpxchg(&s->hash, 0, hash);
+			if (!cur) {	/* it's ours: fill it in and publish it */
+				memcpy(s->ips, ips, nr * sizeof(unsigned long));
+				s->nr = nr;
+				atomic_long_set(&s->hits, 1);
+				smp_store_release(&s->ready, 1);
+				return;
+			}
+		}
+		/* (a stack still being filled in by another CPU doesn't match) */
+		if (cur == hash && smp_load_acquire(&s->ready) && s->nr == nr &&
+		    !memcmp(s->ips, ips, nr * sizeof(unsigned long))) {
+			atomic_long_inc(&s->hits);
+			return;
+		}
+	}
+	atomic_long_inc(&sm->dropped);
+}
+NOKPROBE_SYMBOL(kp_stackmap_record);
+
+/* The folded stacks: outermost caller first, semicolon-separated, then the count */
+static int kp_stackmap_seq_show(struct seq_file *m, void *unused)
+{
+	struct kp_stackmap *sm = m->private;
+	int i, j;
+
+	for (i = 0; i < KP_STACKMAP_SIZE; i++) {
+		struct kp_stack *s = &sm->slots[i];
+		long hits;
+
+		if (!smp_load_acquire(&s->ready))
+			continue;
+		hits = atomic_long_read(&s->hits);
+		if (!hits)
+			continue;
+		for (j = s->nr - 1; j >= 0; j--)
+			seq_printf(m, "%ps%c", (void *)s->ips[j], j ? ';' : ' ');
+		seq_printf(m, "%ld\n", hits);
+	}
+	if (atomic_long_read(&sm->dropped))
+		seq_printf(m, "[dropped:table_full] %ld\n", atomic_long_read(&sm->dropped));
+	return 0;
+}
+
+static int kp_stackmap_open(struct inode *inode, struct file *file)
+{
+	return single_open_size(file, kp_stackmap_seq_show, inode->i_private, 64 * 1024);
+}
+
+/* Reset the counts; the stacks stay put (the handlers may be using the table) */
+static ssize_t kp_stackmap_write(struct file *file, const char __user *ubuf,
+				 size_t count, loff_t *ppos)
+{
+	struct kp_stackmap *sm = ((struct seq_file *)file->private_data)->private;
+	int i;
+
+	for (i = 0; i < KP_STACKMAP_SIZE; i++)
+		atomic_long_set(&sm->slots[i].hits, 0);
+	atomic_long_set(&sm->dropped, 0);
+	return count;
+}
+
+static const struct file_operations kp_stackmap_fops = {
+	.owner = THIS_MODULE,
+	.open = kp_stackmap_open,
+	.read = seq_read,
+	.write = kp_stackmap_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+#endif				/* #ifndef __KP_STACKMAP_H__ */
@@ -20,7 +20,13 @@
  * debugs file - typically
  *  /sys/kernel/debug/test_kmembugs/lkd_dbgfs_run_testcase
  * used to execute individual testcases by writing the testcase # (as a string)
- * to this pseudo-file.
+ * to this pseudo-file; or a batch of them, optionally on all CPUs at once:
+ *  echo "run 4.1-5.4 6 7" > /sys/kernel/debug/test_kmembugs/lkd_dbgfs_run_testcase
+ *  echo "prun kasan" > /sys/kernel/debug/test_kmembugs/lkd_dbgfs_run_testcase
+ * The testcases - and the tool(s) expected to catch each - are listed in
+ *  /sys/kernel/debug/test_kmembugs/testcases
+ * and each run's outcome - timing, and which tools reported a bug - is in
+ *  /sys/kernel/debug/test_kmembugs/results
  *
  * IMP:
  * By default, KASAN will turn off reporting after the very first error
@@ -36,7 +42,21 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/bitmap.h>
+#include <linux/kthread.h>
+#include <linux/cpu.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/console.h>
+#include <linux/spinlock.h>
+#include <linux/timekeeping.h>
 #include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0) && IS_ENABLED(CONFIG_TRACEPOINTS)
+#include <trace/events/error_report.h>
+#endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
 #include <linux/uaccess.h>
 #include <linux/sched/signal.h>
@@ -80,96 +100,697 @@ EXPORT_SYMBOL(gparent);
 
 extern char global_arr1[], global_arr2[], global_arr3[];
 
-#define MAXUPASS 5
+/*
+ * The testcase registry.
+ * Each testcase has an id - "N" or "N.M", as in the run_tests menu - a
+ * description, the function that runs it, and which of the memory debug tools
+ * (KMB_DET_*) are expected to catch the bug. The ids are looked up in O(1),
+ * via tc_index[N][M] (set up from the table at init).
+ */
+#define KMB_DET_KASAN		0x01
+#define KMB_DET_UBSAN		0x02
+#define KMB_DET_KMEMLEAK	0x04
+#define KMB_DET_SLUB_DEBUG	0x08
+#define KMB_DET_KMSAN		0x10
+#define KMB_DET_COMPILER	0x20	/* a compiler warning; nothing at runtime */
+#define KMB_DET_KFENCE		0x40	/* (sampled: it may, or may not, catch a given bug) */
+
+/* the testcase must run in process context - with a user mm - not in a kthread */
+#define KMB_TC_USERCTX		0x01
+
+struct kmembugs_tc {
+	const char *id;
+	const char *name;
+	void (*run)(void);
+	unsigned int detect;	/* KMB_DET_* */
+	unsigned int flags;	/* KMB_TC_* */
+};
+
+/* Adapters for the testcases that take parameters or return something */
+static void tc_umr(void)
+{
+	umr();
+}
+
+static void tc_uar(void)
+{
+	volatile char *res1 = uar();
+
+	pr_info("testcase 2: UAR: res1 = \"%s\"\n",
+		res1 == NULL ? "<whoops, it's NULL; UAR!>" : (char *)res1);
+}
+
+static void tc_leak_simple2(void)
+{
+	volatile char *res2 = (char *)leak_simple2();	// caller's expected to free the memory!
+
+	pr_info(" res2 = \"%s\"\n", res2 == NULL ? "<whoops, it's NULL>" : (char *)res2);
+	if (0)			/* test: ensure it isn't freed by us, the caller */
+		kfree((char *)res2);
+}
+
+static void tc_global_oob_right_rd(void)
+{
+	global_mem_oob_right(READ, global_arr2);
+}
+
+static void tc_global_oob_right_wr(void)
+{
+	global_mem_oob_right(WRITE, global_arr2);
+}
+
+static void tc_global_oob_left_rd(void)
+{
+	global_mem_oob_left(READ, global_arr2);
+}
+
+static void tc_global_oob_left_wr(void)
+{
+	global_mem_oob_left(WRITE, global_arr2);
+}
+
+static void tc_dynamic_oob_right_rd(void)
+{
+	dynamic_mem_oob_right(READ);
+}
+
+static void tc_dynamic_oob_right_wr(void)
+{
+	dynamic_mem_oob_right(WRITE);
+}
+
+static void tc_dynamic_oob_left_rd(void)
+{
+	dynamic_mem_oob_left(READ);
+}
+
+static void tc_dynamic_oob_left_wr(void)
+{
+	dynamic_mem_oob_left(WRITE);
+}
+
+static void tc_uaf(void)
+{
+	uaf();
+}
+
+static void tc_double_free(void)
+{
+	double_free();
+}
+
+static void tc_umr_slub(void)
+{
+	umr_slub();
+}
+
+/* In the run_tests menu order; ranges ("5.1-5.4") are in terms of this order */
+static const struct kmembugs_tc testcases[] = {
+	{ "1", "Uninitialized Memory Read - UMR", tc_umr, KMB_DET_KMSAN | KMB_DET_COMPILER },
+	{ "2", "Use After Return - UAR", tc_uar, KMB_DET_COMPILER },
+	{ "3.1", "simple memory leakage testcase1", leak_simple1, KMB_DET_KMEMLEAK },
+	{ "3.2", "simple memory leakage testcase2 - caller to free memory",
+	  tc_leak_simple2, KMB_DET_KMEMLEAK },
+	{ "3.3", "simple memory leakage testcase3 - memleak in interrupt ctx",
+	  leak_simple3, KMB_DET_KMEMLEAK },
+	{ "4.1", "OOB static global + stack mem: read (right) overflow",
+	  tc_global_oob_right_rd, KMB_DET_KASAN | KMB_DET_UBSAN },
+	{ "4.2", "OOB static global + stack mem: write (right) overflow",
+	  tc_global_oob_right_wr, KMB_DET_KASAN | KMB_DET_UBSAN },
+	{ "4.3", "OOB static global + stack mem: read (left) underflow",
+	  tc_global_oob_left_rd, KMB_DET_KASAN | KMB_DET_UBSAN },
+	{ "4.4", "OOB static global + stack mem: write (left) underflow",
+	  tc_global_oob_left_wr, KMB_DET_KASAN | KMB_DET_UBSAN },
+	{ "5.1", "OOB dynamic (kmalloc-ed) mem: read (right) overflow",
+	  tc_dynamic_oob_right_rd, KMB_DET_KASAN | KMB_DET_UBSAN },
+	{ "5.2", "OOB dynamic (kmalloc-ed) mem: write (right) overflow",
+	  tc_dynamic_oob_right_wr, KMB_DET_KASAN | KMB_DET_UBSAN | KMB_DET_SLUB_DEBUG },
+	{ "5.3", "OOB dynamic (kmalloc-ed) mem: read (left) underflow",
+	  tc_dynamic_oob_left_rd, KMB_DET_KASAN },
+	{ "5.4", "OOB dynamic (kmalloc-ed) mem: write (left) underflow",
+	  tc_dynamic_oob_left_wr, KMB_DET_KASAN | KMB_DET_SLUB_DEBUG },
+	{ "6", "Use After Free - UAF", tc_uaf, KMB_DET_KASAN | KMB_DET_SLUB_DEBUG },
+	{ "7", "Double-free", tc_double_free, KMB_DET_KASAN | KMB_DET_SLUB_DEBUG },
+	{ "8.1", "UBSAN: add overflow", test_ubsan_add_overflow, KMB_DET_UBSAN },
+	{ "8.2", "UBSAN: sub overflow", test_ubsan_sub_overflow, KMB_DET_UBSAN },
+	{ "8.3", "UBSAN: mul overflow", test_ubsan_mul_overflow, KMB_DET_UBSAN },
+	{ "8.4", "UBSAN: negate overflow", test_ubsan_negate_overflow, KMB_DET_UBSAN },
+	{ "8.5", "UBSAN: shift OOB", test_ubsan_shift_out_of_bounds, KMB_DET_UBSAN },
+	{ "8.6", "UBSAN: OOB", test_ubsan_out_of_bounds, KMB_DET_UBSAN },
+	{ "8.7", "UBSAN: load invalid value", test_ubsan_load_invalid_value, KMB_DET_UBSAN },
+	{ "8.8", "UBSAN: misaligned access", test_ubsan_misaligned_access, KMB_DET_UBSAN },
+	{ "8.9", "UBSAN: object size mismatch", test_ubsan_object_size_mismatch, KMB_DET_UBSAN },
+	{ "8.10", "UBSAN: divrem overflow", test_ubsan_divrem_overflow, KMB_DET_UBSAN },
+	{ "9", "copy_[to|from]_user*() tests", oob_copy_user_test, KMB_DET_KASAN,
+	  KMB_TC_USERCTX },
+	{ "10", "UMR on slab (SLUB) memory", tc_umr_slub, KMB_DET_KMSAN | KMB_DET_SLUB_DEBUG },
+};
+
+static const char * const det_names[] = {
+	"kasan", "ubsan", "kmemleak", "slub_debug", "kmsan", "compiler", "kfence"
+};
+
+#define TC_MAX_MAJOR	16
+#define TC_MAX_MINOR	16
+static u8 tc_index[TC_MAX_MAJOR][TC_MAX_MINOR];	/* index into testcases[] + 1; 0 => none */
+static DEFINE_MUTEX(tc_lock);		/* one batch of testcases at a time */
+
+/* Parse a testcase id, "N" or "N.M", into N and M (0 if absent) */
+static int tc_parse_id(const char *id, unsigned int *major, unsigned int *minor)
+{
+	char buf[8], *dot;
+
+	if (strscpy(buf, id, sizeof(buf)) < 0)
+		return -EINVAL;
+	*minor = 0;
+	dot = strchr(buf, '.');
+	if (dot) {
+		*dot = '\0';
+		if (kstrtouint(dot + 1, 10, minor) || !*minor)
+			return -EINVAL;
+	}
+	if (kstrtouint(buf, 10, major))
+		return -EINVAL;
+	if (*major >= TC_MAX_MAJOR || *minor >= TC_MAX_MINOR)
+		return -ERANGE;
+	return 0;
+}
+
+/* Returns the testcase's index into testcases[], or -1 */
+static int tc_lookup(const char *id)
+{
+	unsigned int major, minor;
+
+	if (tc_parse_id(id, &major, &minor))
+		return -1;
+	return (int)tc_index[major][minor] - 1;
+}
+
+static void tc_index_init(void)
+{
+	unsigned int major, minor;
+	int i;
+
+	BUILD_BUG_ON(ARRAY_SIZE(testcases) >= U8_MAX);
+	for (i = 0; i < ARRAY_SIZE(testcases); i++) {
+		if (WARN_ON(tc_parse_id(testcases[i].id, &major, &minor)))
+			continue;
+		WARN_ON(tc_index[major][minor]);	/* a duplicate id */
+		tc_index[major][minor] = i + 1;
+	}
+}
+
+/*
+ * The testcase results.
+ * Each testcase run's recorded - when it started and ended (CLOCK_MONOTONIC,
+ * ns), the CPU it ran on (-1: the writer's context, wherever it ran), and the
+ * memory debug tools that reported a bug meanwhile - into a ring of the last
+ * RES_MAX runs, read via <debugfs>/test_kmembugs/results (see results_show()).
+ * We learn of the reports:
+ *  - via the error_report_end tracepoint (5.14 on): KASAN and KFENCE fire it
+ *    at the end of every report; precise, and it runs in the context of the
+ *    task that hit the bug;
+ *  - via a console of our own, that just scans what's printed for the other
+ *    tools' report headers (UBSAN, SLUB debug, KMSAN; and KASAN / KFENCE on
+ *    older kernels).
+ * A tracepoint-detected report's attributed to the active run of the task it
+ * happens in; failing that, to the one on this CPU; failing that, to the only
+ * active one.
+ * A console's write runs in whoever flushes the printk buffer - another run's
+ * res_end() perhaps - not in the reporter; so, a console-detected report's
+ * attributed by the record's origin, the "[T<pid>]" / "[C<cpu>]" prefix of
+ * CONFIG_PRINTK_CALLER, or, failing that, to the only active run. If there's
+ * no telling - several runs active (prun mode) and no caller prefix - it's
+ * counted as unattributed (shown at the end of the results file).
+ */
+#define RES_MAX		1024
+
+struct tc_result {
+	u64 seq;		/* run #; 0 => unused slot */
+	const struct kmembugs_tc *tc;
+	struct task_struct *task;
+	int cpu;
+	u64 start_ns, end_ns;
+	unsigned int reports;
+	unsigned int detected;	/* KMB_DET_* */
+};
+
+static struct tc_result results[RES_MAX];
+static u64 res_seq;
+static struct tc_result **res_active;	/* the runs in progress; nr_cpu_ids + 1 slots */
+static int res_nactive;
+static unsigned int res_unattributed, res_unattributed_det;
+static DEFINE_RAW_SPINLOCK(res_lock);	/* reports may come in any context */
+
+/*
+ * Credit a report to the active run of task @pid (if not 0), else to the one
+ * on @cpu (if >= 0), else to the only active one; else, to no one.
+ */
+static void res_credit(unsigned int det, pid_t pid, int cpu)
+{
+	struct tc_result *r = NULL;
+	unsigned long flags;
+	int i;
+
+	raw_spin_lock_irqsave(&res_lock, flags);
+	for (i = 0; i < res_nactive && !r && pid; i++)
+		if (task_pid_nr(res_active[i]->task) == pid)
+			r = res_active[i];
+	for (i = 0; i < res_nactive && !r && cpu >= 0; i++)
+		if (res_active[i]->cpu == cpu)
+			r = res_active[i];
+	if (!r && res_nactive == 1)
+		r = res_active[0];
+	if (r) {
+		r->reports++;
+		r->detected |= det;
+	} else if (res_nactive) {
+		res_unattributed++;
+		res_unattributed_det |= det;
+	}
+	raw_spin_unlock_irqrestore(&res_lock, flags);
+}
+
+/* A report from the context that hit the bug */
+static void res_report(unsigned int det)
+{
+	res_credit(det, task_pid_nr(current), raw_smp_processor_id());
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0) && IS_ENABLED(CONFIG_TRACEPOINTS)
+#define HAVE_ERROR_REPORT_TP
+static void res_error_report(void *unused, enum error_detector detector, unsigned long id)
+{
+	switch (detector) {
+	case ERROR_DETECTOR_KASAN:
+		res_report(KMB_DET_KASAN);
+		break;
+	case ERROR_DETECTOR_KFENCE:
+		res_report(KMB_DET_KFENCE);
+		break;
+	default:
+		break;
+	}
+}
+#endif
+
+static const struct {
+	const char *hdr;
+	unsigned int det;
+} con_patterns[] = {
+	{ "UBSAN:", KMB_DET_UBSAN },
+	{ "BUG kmalloc-", KMB_DET_SLUB_DEBUG },	/* SLUB: "BUG <cache> (<taint>): <what>" */
+	{ "BUG: KMSAN:", KMB_DET_KMSAN },
+#ifndef HAVE_ERROR_REPORT_TP
+	{ "BUG: KASAN:", KMB_DET_KASAN },
+	{ "BUG: KFENCE:", KMB_DET_KFENCE },
+#endif
+};
+
+/*
+ * The record's origin, from it's CONFIG_PRINTK_CALLER prefix - f.e.
+ *  "[   12.345678][  T123] UBSAN: ..."  or  "[   12.345678][    C2] ..."
+ * - into @pid or @cpu; false if there's none.
+ */
+static bool con_caller(const char *text, unsigned int len, pid_t *pid, int *cpu)
+{
+	const char *p = text, *end = text + len;
+
+	while (p < end && *p == '[') {
+		const char *q = p + 1;
+
+		while (q < end && *q == ' ')
+			q++;
+		if (q + 1 < end && (*q == 'T' || *q == 'C') && isdigit(q[1])) {
+			unsigned long id = simple_strtoul(q + 1, NULL, 10);
+
+			if (*q == 'T')
+				*pid = id;
+			else
+				*cpu = id;
+			return true;
+		}
+		p = memchr(p, ']', end - p);
+		if (!p)
+			break;
+		p++;
+	}
+	return false;
+}
+
+/* Runs in whoever's flushing the printk buffer: not necessarily the reporter */
+static void res_con_write(struct console *con, const char *text, unsigned int len)
+{
+	pid_t pid = 0;
+	int i, cpu = -1;
+
+	if (!READ_ONCE(res_nactive))
+		return;
+	for (i = 0; i < ARRAY_SIZE(con_patterns); i++) {
+		if (strnstr(text, con_patterns[i].hdr, len)) {
+			/* no prefix: res_credit() falls back to the only active run, if any */
+			con_caller(text, len, &pid, &cpu);
+			res_credit(con_patterns[i].det, pid, cpu);
+		}
+	}
+}
+
+static struct console res_console = {
+	.name = "kmbres",
+	.write = res_con_write,
+	.flags = CON_ENABLED,
+	.index = -1,
+};
+
+static struct tc_result *res_begin(const struct kmembugs_tc *tc, int cpu)
+{
+	struct tc_result *r;
+
+	raw_spin_lock_irq(&res_lock);
+	r = &results[res_seq % RES_MAX];
+	r->seq = ++res_seq;
+	r->tc = tc;
+	r->task = current;
+	r->cpu = cpu;
+	r->reports = r->detected = 0;
+	r->end_ns = 0;
+	r->start_ns = ktime_get_ns();
+	res_active[res_nactive++] = r;
+	raw_spin_unlock_irq(&res_lock);
+	return r;
+}
+
+/* jiffies at the end of the last testcase run; kmembugs_leakscan.c waits on it */
+unsigned long tc_last_run;
+
+static void res_end(struct tc_result *r)
+{
+	int i;
+
+	r->end_ns = ktime_get_ns();
+	WRITE_ONCE(tc_last_run, jiffies);
+	/* get the pending printk's - the reports - out to the consoles (ours too) */
+	console_lock();
+	console_unlock();
+
+	raw_spin_lock_irq(&res_lock);
+	for (i = 0; i < res_nactive; i++) {
+		if (res_active[i] == r) {
+			res_active[i] = res_active[--res_nactive];
+			break;
+		}
+	}
+	r->task = NULL;
+	raw_spin_unlock_irq(&res_lock);
+}
+
+static void res_det_list(struct seq_file *m, unsigned int det)
+{
+	char sep = ' ';
+	int j;
+
+	for (j = 0; j < ARRAY_SIZE(det_names); j++) {
+		if (det & BIT(j)) {
+			seq_printf(m, "%c%s", sep, det_names[j]);
+			sep = ',';
+		}
+	}
+	if (sep == ' ')
+		seq_puts(m, " -");
+}
+
+/*
+ * The 'results' file; one line per (completed) testcase run, oldest first:
+ *  seq id cpu start_ns end_ns runtime_ns reports detected expected
+ * f.e.
+ *  7 5.1 -1 8176253411 8176391806 138395 1 kasan kasan,ubsan
+ * 'detected' and 'expected' are comma-separated tool names ('-' if none).
+ * Writing to the file clears it.
+ */
+static int results_show(struct seq_file *m, void *unused)
+{
+	u64 seq, first;
+
+	seq_puts(m, "# seq id cpu start_ns end_ns runtime_ns reports detected expected\n");
+	mutex_lock(&tc_lock);	/* no runs meanwhile */
+	first = res_seq > RES_MAX ? res_seq - RES_MAX + 1 : 1;
+	for (seq = first; seq <= res_seq; seq++) {
+		struct tc_result *r = &results[(seq - 1) % RES_MAX];
+
+		if (r->seq != seq || !r->end_ns)
+			continue;
+		seq_printf(m, "%llu %s %d %llu %llu %llu %u", r->seq, r->tc->id, r->cpu,
+			   r->start_ns, r->end_ns, r->end_ns - r->start_ns, r->reports);
+		res_det_list(m, r->detected);
+		res_det_list(m, r->tc->detect);
+		seq_putc(m, '\n');
+	}
+	if (res_unattributed) {
+		seq_printf(m, "# unattributed reports (parallel runs, no printk caller id): %u",
+			   res_unattributed);
+		res_det_list(m, res_unattributed_det);
+		seq_putc(m, '\n');
+	}
+	mutex_unlock(&tc_lock);
+	return 0;
+}
+
+static int results_open(struct inode *inode, struct file *file)
+{
+	return single_open_size(file, results_show, NULL, RES_MAX * 96);
+}
+
+static ssize_t results_write(struct file *file, const char __user *ubuf,
+			     size_t count, loff_t *ppos)
+{
+	mutex_lock(&tc_lock);
+	memset(results, 0, sizeof(results));
+	res_unattributed = res_unattributed_det = 0;
+	mutex_unlock(&tc_lock);
+	return count;
+}
+
+static const struct file_operations results_fops = {
+	.open = results_open,
+	.read = seq_read,
+	.write = results_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int results_init(void)
+{
+	int ret;
+
+	res_active = kcalloc(nr_cpu_ids + 1, sizeof(*res_active), GFP_KERNEL);
+	if (!res_active)
+		return -ENOMEM;
+#ifdef HAVE_ERROR_REPORT_TP
+	ret = register_trace_error_report_end(res_error_report, NULL);
+	if (ret) {
+		kfree(res_active);
+		return ret;
+	}
+#endif
+	register_console(&res_console);
+	debugfs_create_file("results", 0644, gparent, NULL, &results_fops);
+	return 0;
+}
+
+static void results_exit(void)
+{
+	unregister_console(&res_console);
+#ifdef HAVE_ERROR_REPORT_TP
+	unregister_trace_error_report_end(res_error_report, NULL);
+	tracepoint_synchronize_unregister();
+#endif
+	kfree(res_active);
+}
+
+static void tc_run(const struct kmembugs_tc *tc, int cpu)
+{
+	struct tc_result *r;
+
+	pr_debug("cpu %d: running testcase %s: %s\n", raw_smp_processor_id(), tc->id, tc->name);
+	r = res_begin(tc, cpu);
+	tc->run();
+	res_end(r);
+}
+
+/*
+ * Select the testcases to run, as per the (whitespace or comma separated)
+ * terms in @spec, into @sel (a bitmap over testcases[]). A term's one of:
+ *  N[.M]          : that testcase
+ *  N[.M]-N[.M]    : that range of testcases (in the table's order)
+ *  all            : all of them
+ *  kasan|ubsan|kmemleak|slub_debug|kmsan|compiler : the ones expected to be
+ *                   caught by that tool
+ */
+static int tc_select(char *spec, unsigned long *sel)
+{
+	char *term, *dash;
+	int i, from, to;
+
+	while ((term = strsep(&spec, " \t\n,")) != NULL) {
+		if (!*term)
+			continue;
+		if (!strcmp(term, "all")) {
+			bitmap_fill(sel, ARRAY_SIZE(testcases));
+			continue;
+		}
+		i = match_string(det_names, ARRAY_SIZE(det_names), term);
+		if (i >= 0) {
+			for (from = 0; from < ARRAY_SIZE(testcases); from++)
+				if (testcases[from].detect & BIT(i))
+					set_bit(from, sel);
+			continue;
+		}
+		dash = strchr(term, '-');
+		if (dash)
+			*dash++ = '\0';
+		from = tc_lookup(term);
+		to = dash ? tc_lookup(dash) : from;
+		if (from < 0 || to < from) {
+			pr_warn("Invalid testcase # (%s%s%s) passed\n", term,
+				dash ? "-" : "", dash ? dash : "");
+			return -EINVAL;
+		}
+		bitmap_set(sel, from, to - from + 1);
+	}
+	return 0;
+}
+
+/* Parallel mode: each online CPU runs the whole batch, in a kthread bound to it */
+struct tc_batch {
+	const unsigned long *sel;
+	struct completion *done;	/* one per CPU id */
+};
+static struct tc_batch batch;
+
+static int tc_thread(void *arg)
+{
+	int cpu = (long)arg, i;
+
+	for_each_set_bit(i, batch.sel, ARRAY_SIZE(testcases))
+		if (!(testcases[i].flags & KMB_TC_USERCTX))
+			tc_run(&testcases[i], cpu);
+	/* complete, and exit, without returning to (possibly unloaded) module text */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+	kthread_complete_and_exit(&batch.done[cpu], 0);
+#else
+	complete_and_exit(&batch.done[cpu], 0);
+#endif
+}
+
+static int tc_run_parallel(const unsigned long *sel)
+{
+	struct task_struct *t;
+	int cpu, i, ret = 0;
+
+	batch.sel = sel;
+	batch.done = kcalloc(nr_cpu_ids, sizeof(struct completion), GFP_KERNEL);
+	if (!batch.done)
+		return -ENOMEM;
+
+	cpus_read_lock();
+	for_each_online_cpu(cpu) {
+		init_completion(&batch.done[cpu]);
+		t = kthread_create_on_node(tc_thread, (void *)(long)cpu, cpu_to_node(cpu),
+					   "kmembugs/%d", cpu);
+		if (IS_ERR(t)) {
+			ret = PTR_ERR(t);
+			complete(&batch.done[cpu]);	/* nothing to wait for */
+			continue;
+		}
+		kthread_bind(t, cpu);
+		wake_up_process(t);
+	}
+	for_each_online_cpu(cpu)
+		wait_for_completion(&batch.done[cpu]);
+	cpus_read_unlock();
+	kfree(batch.done);
+
+	/* and the ones that need a user context, once, here */
+	for_each_set_bit(i, sel, ARRAY_SIZE(testcases))
+		if (testcases[i].flags & KMB_TC_USERCTX)
+			tc_run(&testcases[i], -1);
+	return ret;
+}
+
+/*
+ * Write to the debugfs file to run testcase(s):
+ *  "N[.M]"               : run that testcase, f.e. "5.1"
+ *  "[run] <spec>"        : run the testcases selected by <spec> (see
+ *                          tc_select()), one after the other, f.e.
+ *                          "run 4.1-5.4 8.1-8.10" or "run kasan"
+ *  "prun <spec>"         : ditto, but on all online CPUs at once - each CPU
+ *                          runs the selected testcases in a kthread bound to
+ *                          it - returning when they've all finished
+ */
+#define MAXUPASS 256
 static ssize_t dbgfs_run_testcase(struct file *filp, const char __user *ubuf, size_t count,
 				  loff_t *fpos)
 {
-	char udata[MAXUPASS];
-	volatile char *res1 = NULL, *res2 = NULL;
+	DECLARE_BITMAP(sel, ARRAY_SIZE(testcases)) = { 0 };
+	char *udata, *spec;
+	bool parallel = false;
+	int i, ret;
 
 	if (count > MAXUPASS) {
 		pr_warn("too much data attempted to be passed from userspace to here\n");
 		return -ENOSPC;
 	}
-	if (copy_from_user(udata, ubuf, count))
-		return -EIO;
-	udata[count - 1] = '\0';
-	pr_debug("testcase to run: %s\n", udata);
-
-	/*
-	 * Now udata contains the data passed from userspace - the testcase # to run
-	 * (as a string)
-	 */
-	if (!strncmp(udata, "1", 2))
-		umr();
-	else if (!strncmp(udata, "2", 2)) {
-		res1 = uar();
-		pr_info("testcase 2: UAR: res1 = \"%s\"\n",
-			res1 == NULL ? "<whoops, it's NULL; UAR!>" : (char *)res1);
-	} else if (!strncmp(udata, "3.1", 4))
-		leak_simple1();
-	else if (!strncmp(udata, "3.2", 4)) {
-		res2 = (char *)leak_simple2();	// caller's expected to free the memory!
-		pr_info(" res2 = \"%s\"\n",
-			res2 == NULL ? "<whoops, it's NULL>" : (char *)res2);
-		if (0)		/* test: ensure it isn't freed by us, the caller */
-			kfree((char *)res2);
-	} else if (!strncmp(udata, "3.3", 4))
-		leak_simple3();
-	else if (!strncmp(udata, "4.1", 4))
-		global_mem_oob_right(READ, global_arr2);
-	else if (!strncmp(udata, "4.2", 4))
-		global_mem_oob_right(WRITE, global_arr2);
-	else if (!strncmp(udata, "4.3", 4))
-		global_mem_oob_left(READ, global_arr2);
-	else if (!strncmp(udata, "4.4", 4))
-		global_mem_oob_left(WRITE, global_arr2);
-	else if (!strncmp(udata, "5.1", 4))
-		dynamic_mem_oob_right(READ);
-	else if (!strncmp(udata, "5.2", 4))
-		dynamic_mem_oob_right(WRITE);
-	else if (!strncmp(udata, "5.3", 4))
-		dynamic_mem_oob_left(READ);
-	else if (!strncmp(udata, "5.4", 4))
-		dynamic_mem_oob_left(WRITE);
-	else if (!strncmp(udata, "6", 2))
-		uaf();
-	else if (!strncmp(udata, "7", 2))
-		double_free();
-	else if (!strncmp(udata, "8.1", 4))
-		test_ubsan_add_overflow();
-	else if (!strncmp(udata, "8.2", 4))
-		test_ubsan_sub_overflow();
-	else if (!strncmp(udata, "8.3", 4))
-		test_ubsan_mul_overflow();
-	else if (!strncmp(udata, "8.4", 4))
-		test_ubsan_negate_overflow();
-	else if (!strncmp(udata, "8.4", 4))
-		test_ubsan_divrem_overflow();
-	else if (!strncmp(udata, "8.5", 4))
-		test_ubsan_shift_out_of_bounds();
-	else if (!strncmp(udata, "8.6", 4))
-		test_ubsan_out_of_bounds();
-	else if (!strncmp(udata, "8.7", 4))
-		test_ubsan_load_invalid_value();
-	else if (!strncmp(udata, "8.8", 4))
-		test_ubsan_misaligned_access();
-	else if (!strncmp(udata, "8.9", 4))
-		test_ubsan_object_size_mismatch();
-	else if (!strncmp(udata, "9", 2))
-		oob_copy_user_test();
-	else if (!strncmp(udata, "10", 3))
-		umr_slub();
-	else
-		pr_warn("Invalid testcase # (%s) passed\n", udata);
+	udata = memdup_user_nul(ubuf, count);
+	if (IS_ERR(udata))
+		return PTR_ERR(udata);
+	spec = strim(udata);
+	pr_debug("testcase(s) to run: %s\n", spec);
 
-	return count;
+	if (!strncmp(spec, "run ", 4))
+		spec += 4;
+	else if (!strncmp(spec, "prun ", 5)) {
+		spec += 5;
+		parallel = true;
+	}
+	ret = tc_select(spec, sel);
+	if (!ret) {
+		mutex_lock(&tc_lock);
+		if (parallel)
+			ret = tc_run_parallel(sel);
+		else
+			for_each_set_bit(i, sel, ARRAY_SIZE(testcases))
+				tc_run(&testcases[i], -1);
+		mutex_unlock(&tc_lock);
+	}
+	kfree(udata);
+	return ret ? ret : count;
 }
 
 static const struct file_operations dbgfs_fops = {
 	.write = dbgfs_run_testcase,
 };
 
+/* The 'testcases' file: the registry, one testcase per line: id, detectors, description */
+static int testcases_show(struct seq_file *m, void *unused)
+{
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(testcases); i++) {
+		char sep = ' ';
+
+		seq_printf(m, "%-5s", testcases[i].id);
+		for (j = 0; j < ARRAY_SIZE(det_names); j++) {
+			if (testcases[i].detect & BIT(j)) {
+				seq_printf(m, "%c%s", sep, det_names[j]);
+				sep = ',';
+			}
+		}
+		seq_printf(m, " : %s\n", testcases[i].name);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(testcases);
+
 int debugfs_simple_intf_init(void)
 {
 	int stat = 0;
@@ -201,6 +822,11 @@ int debugfs_simple_intf_init(void)
 	}
 	pr_debug("debugfs file 1 <debugfs_mountpt>/%s/%s created\n",
 		 KBUILD_MODNAME, DBGFS_FILE);
+	tc_index_init();
+	debugfs_create_file("testcases", 0444, gparent, NULL, &testcases_fops);
+	stat = results_init();
+	if (stat)
+		goto out_fail_2;
 
 	pr_info("debugfs entry initialized\n");
 	return 0;
@@ -210,3 +836,10 @@ int debugfs_simple_intf_init(void)
  out_fail_1:
 	return stat;
 }
+
+void debugfs_simple_intf_cleanup(void)
+{
+	/* no testcase can run - and so, report - once the files are gone */
+	debugfs_remove_recursive(gparent);
+	results_exit();
+}
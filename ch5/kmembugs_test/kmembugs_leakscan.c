@@ -0,0 +1,397 @@
+/*
+ * ch5/kmembugs_test/kmembugs_leakscan.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Debugging"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Debugging
+ *
+ * From: Ch 5: Debugging kernel memory issues
+ ****************************************************************
+ * Brief Description:
+ * kmembugs_leakscan.c: this source file:
+ * Verifying the leak testcases (3.1 to 3.3) by hand means an
+ *  echo scan > /sys/kernel/debug/kmemleak
+ * (twice; and only once the objects are old enough), and then reading through
+ * the report. Here, we do all of that in one step:
+ *  echo scan > /sys/kernel/debug/test_kmembugs/leaks
+ *  cat /sys/kernel/debug/test_kmembugs/leaks
+ * The write:
+ *  - waits until the last testcase run is at least leakscan_min_age_ms old
+ *    (kmemleak doesn't report younger objects),
+ *  - has kmemleak scan memory - twice: an object's first seen as 'new' (it's
+ *    checksum changed) and is reported only by the next scan - and
+ *  - parses the report, keeping only the objects allocated by us: those with
+ *    a frame in this module's text in their allocation backtrace.
+ * Reading the file shows the count and the total size of these objects, per
+ * (innermost of our) function, and each object.
+ *
+ *  echo clear > /sys/kernel/debug/test_kmembugs/leaks
+ * has kmemleak clear - ignore from now on - the leaks reported so far; so, a
+ * loop of clear, run the testcase, scan, sees only the leaks of this run.
+ *
+ * The report comes from kmemleak's debugfs file; as it's (debugfs proxied)
+ * file_operations don't support kernel_read()/kernel_write() (5.10 on),
+ * we call them - in the writer's context - with a scratch user buffer.
+ *
+ * For details, please refer the book, Ch 5.
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/fs.h>
+#include <linux/jiffies.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+
+extern struct dentry *gparent;
+extern unsigned long tc_last_run;	/* jiffies; debugfs_kmembugs.c */
+
+static char *kmemleak_file = "/sys/kernel/debug/kmemleak";
+module_param(kmemleak_file, charp, 0644);
+MODULE_PARM_DESC(kmemleak_file, "leaks: kmemleak's debugfs file (defaults to /sys/kernel/debug/kmemleak)");
+
+static unsigned int leakscan_min_age_ms = 5000;
+module_param(leakscan_min_age_ms, uint, 0644);
+MODULE_PARM_DESC(leakscan_min_age_ms, "leaks: wait until the last testcase run is this old before"
+		 " scanning; kmemleak's minimum object age (defaults to 5000)");
+
+#define LS_SCRATCH	PAGE_SIZE
+#define LS_LINE		256
+#define LS_FUNC		64
+#define LS_MAX_OBJS	256	/* objects listed; all of them are counted */
+#define LS_MAX_FUNCS	32
+
+struct ls_obj {
+	unsigned long addr;
+	unsigned long size;
+	char age[16];
+	char func[LS_FUNC];	/* the innermost of our frames */
+};
+
+struct ls_func {
+	char func[LS_FUNC];
+	unsigned long nr, bytes;
+};
+
+/* The last scan's outcome */
+static struct {
+	bool done;
+	unsigned long total;	/* unreferenced objects, anyone's */
+	unsigned long nr, bytes;	/* ours */
+	unsigned int nobjs, nfuncs;
+	struct ls_obj objs[LS_MAX_OBJS];
+	struct ls_func funcs[LS_MAX_FUNCS];
+} *ls;
+static DEFINE_MUTEX(ls_lock);
+
+/* The report parser's state: the object being parsed, and a partial line */
+static struct ls_obj cur;
+static bool in_obj, in_bt, cur_ours;
+static char line[LS_LINE];
+static size_t line_len;
+
+static void ls_obj_done(void)
+{
+	struct ls_func *f;
+	unsigned int i;
+
+	if (!in_obj)
+		return;
+	in_obj = false;
+	ls->total++;
+	if (!cur_ours)
+		return;
+	ls->nr++;
+	ls->bytes += cur.size;
+	if (ls->nobjs < LS_MAX_OBJS)
+		ls->objs[ls->nobjs++] = cur;
+
+	for (i = 0; i < ls->nfuncs; i++)
+		if (!strcmp(ls->funcs[i].func, cur.func))
+			break;
+	if (i == ls->nfuncs) {
+		if (i == LS_MAX_FUNCS)
+			return;
+		strscpy(ls->funcs[i].func, cur.func, LS_FUNC);
+		ls->nfuncs++;
+	}
+	f = &ls->funcs[i];
+	f->nr++;
+	f->bytes += cur.size;
+}
+
+/*
+ * One line of the report (print_unreferenced() in mm/kmemleak.c):
+ *  unreferenced object 0xffff888004a1b800 (size 1520):
+ *    comm "run_tests", pid 1234, jiffies 4294937490 (age 12.345s)
+ *    ...
+ *    backtrace:
+ *      [<ffffffff8135d3a0>] __kmalloc+0x1a0/0x370
+ *      [<ffffffffc0a4e0b5>] leak_simple1+0x35/0x90 [test_kmembugs]
+ * The frame's address may be hashed (%p) or zeroed (kptr_restrict) - but
+ * %pS always tags a module's symbol with "[modname]": that's what we go by.
+ */
+static void ls_parse_line(char *l)
+{
+	static const char tag[] = " [" KBUILD_MODNAME "]";
+	char *p, *q;
+
+	if (!strncmp(l, "unreferenced object ", 20)) {
+		ls_obj_done();
+		memset(&cur, 0, sizeof(cur));
+		if (sscanf(l, "unreferenced object 0x%lx (size %lu)", &cur.addr, &cur.size) != 2)
+			return;
+		in_obj = true;
+		in_bt = cur_ours = false;
+		return;
+	}
+	if (!in_obj)
+		return;
+	/* (not in the hex dump: it's ASCII could be anything) */
+	p = strstr(l, "(age ");
+	if (p && strstr(l, "comm \"")) {
+		p += 5;
+		q = strchr(p, ')');
+		if (q)
+			*q = '\0';
+		strscpy(cur.age, p, sizeof(cur.age));
+		return;
+	}
+	if (!in_bt) {
+		in_bt = !strncmp(skip_spaces(l), "backtrace", 9);
+		return;
+	}
+	if (cur_ours)
+		return;		/* only the innermost of our frames */
+	p = strstr(l, "] ");
+	if (!p || !strstr(p, tag))
+		return;
+	p += 2;
+	q = strpbrk(p, "+ ");	/* just the function's name */
+	if (q)
+		*q = '\0';
+	strscpy(cur.func, p, LS_FUNC);
+	cur_ours = true;
+}
+
+/* Feed a chunk of the report to the parser; lines may span chunks */
+static void ls_parse(const char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] != '\n') {
+			if (line_len < LS_LINE - 1)	/* (an overlong line's truncated) */
+				line[line_len++] = buf[i];
+			continue;
+		}
+		line[line_len] = '\0';
+		ls_parse_line(line);
+		line_len = 0;
+	}
+}
+
+/* Write @cmd to kmemleak's file, via the scratch user buffer @ubuf */
+static int kmemleak_cmd(struct file *f, char __user *ubuf, const char *cmd)
+{
+	size_t len = strlen(cmd);
+	loff_t pos = 0;
+	ssize_t ret;
+
+	if (copy_to_user(ubuf, cmd, len))
+		return -EFAULT;
+	ret = f->f_op->write(f, ubuf, len, &pos);
+	return ret < 0 ? ret : 0;
+}
+
+static int kmemleak_collect(struct file *f, char __user *ubuf, char *kbuf)
+{
+	loff_t pos = 0;
+	ssize_t n;
+
+	memset(ls, 0, sizeof(*ls));
+	in_obj = false;
+	line_len = 0;
+	while ((n = f->f_op->read(f, ubuf, LS_SCRATCH, &pos)) > 0) {
+		if (copy_from_user(kbuf, ubuf, n))
+			return -EFAULT;
+		ls_parse(kbuf, n);
+		cond_resched();
+	}
+	if (n < 0)
+		return n;
+	if (line_len) {
+		line[line_len] = '\0';
+		ls_parse_line(line);
+	}
+	ls_obj_done();
+	ls->done = true;
+	return 0;
+}
+
+/* Wait until the testcases' allocations are old enough to be reported */
+static int leakscan_wait(void)
+{
+	unsigned long last = READ_ONCE(tc_last_run);
+	long left = (long)(last + msecs_to_jiffies(leakscan_min_age_ms) + 1 - jiffies);
+
+	if (!last || left <= 0)		/* no testcase run yet, or long enough ago */
+		return 0;
+	pr_info("waiting %u ms for the objects to age\n", jiffies_to_msecs(left));
+	if (schedule_timeout_interruptible(left))
+		return -EINTR;
+	return 0;
+}
+
+/* The 'scan' and 'clear' commands; in the writer's (process) context */
+static int leakscan(bool scan)
+{
+	char __user *ubuf;
+	unsigned long uaddr;
+	char path[128];
+	struct file *f;
+	char *kbuf;
+	int ret;
+
+	if (!current->mm)
+		return -EINVAL;
+	if (scan) {
+		ret = leakscan_wait();
+		if (ret)
+			return ret;
+	}
+	/* a sysfs write may free the charp param's string meanwhile: copy it */
+	kernel_param_lock(THIS_MODULE);
+	strscpy(path, kmemleak_file, sizeof(path));
+	kernel_param_unlock(THIS_MODULE);
+	f = filp_open(path, O_RDWR, 0);
+	if (IS_ERR(f)) {
+		pr_warn("can't open %s (%ld); is kmemleak enabled?\n", path, PTR_ERR(f));
+		return PTR_ERR(f);
+	}
+	ret = -EINVAL;
+	if (!f->f_op->read || !f->f_op->write)
+		goto out_close;
+
+	kbuf = kmalloc(LS_SCRATCH, GFP_KERNEL);
+	ret = -ENOMEM;
+	if (!kbuf)
+		goto out_close;
+	uaddr = vm_mmap(NULL, 0, LS_SCRATCH, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, 0);
+	if (IS_ERR_VALUE(uaddr)) {
+		ret = (int)uaddr;
+		goto out_kfree;
+	}
+	ubuf = (char __user *)uaddr;
+
+	if (!scan) {
+		ret = kmemleak_cmd(f, ubuf, "clear");
+		if (!ret)
+			ls->done = false;
+		goto out_unmap;
+	}
+	/* the first scan sees new objects as 'changed'; only the second reports them */
+	ret = kmemleak_cmd(f, ubuf, "scan");
+	if (!ret)
+		ret = kmemleak_cmd(f, ubuf, "scan");
+	if (!ret)
+		ret = kmemleak_collect(f, ubuf, kbuf);
+	if (!ret)
+		pr_info("%lu unreferenced objects; %lu of them (%lu bytes) allocated by us\n",
+			ls->total, ls->nr, ls->bytes);
+
+ out_unmap:
+	vm_munmap(uaddr, LS_SCRATCH);
+ out_kfree:
+	kfree(kbuf);
+ out_close:
+	filp_close(f, NULL);
+	return ret;
+}
+
+static int leaks_show(struct seq_file *m, void *unused)
+{
+	unsigned int i;
+
+	mutex_lock(&ls_lock);
+	if (!ls->done) {
+		seq_puts(m, "# no scan yet; echo scan > <debugfs>/" KBUILD_MODNAME "/leaks\n");
+		goto out;
+	}
+	seq_printf(m, "# kmemleak: %lu unreferenced objects; %lu of them allocated by "
+		   KBUILD_MODNAME ", %lu bytes\n", ls->total, ls->nr, ls->bytes);
+	seq_printf(m, "%-32s %8s %10s\n", "# function", "objects", "bytes");
+	for (i = 0; i < ls->nfuncs; i++)
+		seq_printf(m, "%-32s %8lu %10lu\n", ls->funcs[i].func,
+			   ls->funcs[i].nr, ls->funcs[i].bytes);
+	seq_printf(m, "%-20s %10s %12s  %s\n", "# object", "size", "age", "function");
+	for (i = 0; i < ls->nobjs; i++)
+		seq_printf(m, "0x%-18lx %10lu %12s  %s\n", ls->objs[i].addr, ls->objs[i].size,
+			   ls->objs[i].age, ls->objs[i].func);
+	if (ls->nr > ls->nobjs)
+		seq_printf(m, "# (%lu more objects not listed)\n", ls->nr - ls->nobjs);
+ out:
+	mutex_unlock(&ls_lock);
+	return 0;
+}
+
+static int leaks_open(struct inode *inode, struct file *file)
+{
+	return single_open_size(file, leaks_show, NULL, 32 * 1024);
+}
+
+static ssize_t leaks_write(struct file *file, const char __user *ubuf,
+			   size_t count, loff_t *ppos)
+{
+	char cmd[8];
+	int ret;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, ubuf, count))
+		return -EFAULT;
+	cmd[count] = '\0';
+	strim(cmd);
+	if (strcmp(cmd, "scan") && strcmp(cmd, "clear"))
+		return -EINVAL;
+
+	mutex_lock(&ls_lock);
+	ret = leakscan(!strcmp(cmd, "scan"));
+	mutex_unlock(&ls_lock);
+	return ret ? ret : count;
+}
+
+static const struct file_operations leaks_fops = {
+	.open = leaks_open,
+	.read = seq_read,
+	.write = leaks_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+int kmembugs_leakscan_init(void)
+{
+	ls = kvzalloc(sizeof(*ls), GFP_KERNEL);
+	if (!ls)
+		return -ENOMEM;
+	debugfs_create_file("leaks", 0600, gparent, NULL, &leaks_fops);
+	return 0;
+}
+
+/* Call after the debugfs files are removed */
+void kmembugs_leakscan_exit(void)
+{
+	kvfree(ls);
+}
@@ -0,0 +1,563 @@
+/*
+ * ch5/kmembugs_test/kmembugs_stress.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Debugging"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Debugging
+ *
+ * From: Ch 5: Debugging kernel memory issues
+ ****************************************************************
+ * Brief Description:
+ * kmembugs_stress.c: this source file:
+ * An allocation stress (and fragmentation) workload for the kernel memory
+ * allocators - with, and without, the memory debug tools (KASAN, SLUB debug,
+ * KFENCE, ...) - to reproduce allocator contention and fragmentation issues.
+ *
+ * A kthread bound to each online CPU runs a randomized mix of allocations
+ * and frees, across:
+ *  - kmalloc(): the size classes from 16 bytes to 8 KB
+ *  - a custom slab cache ('kmembugs_stress'; stress_cache_size byte objects)
+ *  - the page allocator: order 0 to 3
+ *  - vmalloc(): 16 KB to 128 KB
+ * Each iteration of a thread frees the objects whose time is up - an object
+ * lives for a random 0 to stress_lifetime iterations of it's thread; they're
+ * kept in a min-heap, by expiry - and then allocates one more object, unless
+ * stress_maxlive of them are already alive. stress_xcpu percent of the frees
+ * are done by another (random) CPU's thread: the object's handed over to it,
+ * via a lock-free list.
+ *
+ * It's run - for stress_secs seconds - by writing 'run' to
+ *  /sys/kernel/debug/test_kmembugs/stress
+ * and reading the file shows the results: the throughput, and, per allocator
+ * and operation (alloc/free), the latency: the average, the max and a log2
+ * histogram. The module parameters can be changed in between runs, via
+ * /sys/module/test_kmembugs/parameters/stress_*; a run works on a copy of them.
+ *
+ * For details, please refer the book, Ch 5.
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/kthread.h>
+#include <linux/llist.h>
+#include <linux/cpumask.h>
+#include <linux/delay.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
+#include <linux/sizes.h>
+#include <linux/timekeeping.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+#include <linux/prandom.h>
+#else
+#include <linux/random.h>
+#endif
+
+extern struct dentry *gparent;
+void config_tag(char *buf, size_t sz);
+
+#define STRESS_MAX_SECS	3600
+static unsigned int stress_secs = 10;
+module_param(stress_secs, uint, 0644);
+MODULE_PARM_DESC(stress_secs, "stress: the duration of a run, in seconds, up to 3600 (defaults to 10)");
+
+static char *stress_mix = "70,10,10,10";
+module_param(stress_mix, charp, 0644);
+MODULE_PARM_DESC(stress_mix, "stress: the relative weights of the kmalloc, slab cache, page"
+		 " and vmalloc allocations (defaults to \"70,10,10,10\")");
+
+static unsigned int stress_lifetime = 1000;
+module_param(stress_lifetime, uint, 0644);
+MODULE_PARM_DESC(stress_lifetime, "stress: an object lives for a random 0 to these many"
+		 " iterations of it's thread (defaults to 1000)");
+
+static unsigned int stress_xcpu = 20;
+module_param(stress_xcpu, uint, 0644);
+MODULE_PARM_DESC(stress_xcpu, "stress: the percentage of frees done on another CPU (defaults to 20)");
+
+static unsigned int stress_maxlive = 4096;
+module_param(stress_maxlive, uint, 0644);
+MODULE_PARM_DESC(stress_maxlive, "stress: the max # of live objects, per CPU (defaults to 4096)");
+
+static unsigned int stress_cache_size = 192;
+module_param(stress_cache_size, uint, 0644);
+MODULE_PARM_DESC(stress_cache_size, "stress: the custom slab cache's object size (defaults to 192)");
+
+static unsigned int stress_seed = 1;
+module_param(stress_seed, uint, 0644);
+MODULE_PARM_DESC(stress_seed, "stress: the random seed (each CPU's thread adds it's CPU #);"
+		 " the same seed gives the same sequence of operations (defaults to 1)");
+
+enum { ST_KMALLOC, ST_CACHE, ST_PAGES, ST_VMALLOC, ST_NTYPES };
+static const char * const st_names[ST_NTYPES] = { "kmalloc", "cache", "pages", "vmalloc" };
+
+#define LAT_BUCKETS	32	/* log2(ns) */
+
+struct st_lat {
+	u64 n, fails, sum_ns, max_ns;
+	u64 hist[LAT_BUCKETS];
+};
+
+struct st_stats {
+	struct st_lat alloc, free;
+	u64 xfrees;		/* handed over to another CPU to free */
+};
+
+/* At the start of every object we allocate; it's what gets handed over for a cross-CPU free */
+struct st_hdr {
+	struct llist_node node;
+	u32 type;
+	u32 size;		/* ST_PAGES: the order */
+};
+
+struct st_obj {
+	struct st_hdr *p;
+	u64 expire;		/* it's freed in this iteration */
+};
+
+/*
+ * The other CPUs' threads write only the inbox, so it's on a cacheline of it's
+ * own: the hand-overs mustn't add contention of their own to what we measure.
+ * (kcalloc()-ing an array of these gives aligned ones: the size - a multiple
+ * of the cacheline - goes to a power-of-2, naturally aligned, kmalloc cache.)
+ */
+struct st_thread {
+	struct llist_head inbox ____cacheline_aligned_in_smp;	/* objects handed to us to free */
+	struct task_struct *task ____cacheline_aligned_in_smp;
+	int cpu;
+	struct rnd_state rnd;
+	struct st_obj *live;	/* a min-heap, by expire */
+	unsigned int nlive;
+	u64 iter;
+	struct st_stats st[ST_NTYPES];
+} ____cacheline_aligned_in_smp;
+
+static struct st_thread *thr;
+static int nthr;
+static struct kmem_cache *st_cache;
+static unsigned int mix[ST_NTYPES], mix_total;
+/* this run's settings (the module parameters can change meanwhile) */
+static unsigned int run_maxlive, run_lifetime, run_secs;
+static char run_mix[32];
+static u64 run_ns;
+static char run_config[256];
+static DEFINE_MUTEX(stress_lock);
+
+static inline u32 st_rand(struct st_thread *t)
+{
+	return prandom_u32_state(&t->rnd);
+}
+
+static inline void lat_record(struct st_lat *l, u64 ns)
+{
+	l->n++;
+	l->sum_ns += ns;
+	if (ns > l->max_ns)
+		l->max_ns = ns;
+	l->hist[min_t(int, ilog2(ns | 1), LAT_BUCKETS - 1)]++;
+}
+
+static struct st_hdr *st_alloc(struct st_thread *t, int type)
+{
+	struct st_lat *l = &t->st[type].alloc;
+	struct st_hdr *h = NULL;
+	struct page *pg;
+	u32 size = 0;
+	u64 t0;
+
+	switch (type) {
+	case ST_KMALLOC:
+		size = 16 << (st_rand(t) % 10);		/* 16 .. 8K */
+		break;
+	case ST_PAGES:
+		size = st_rand(t) % 4;			/* the order */
+		break;
+	case ST_VMALLOC:
+		size = SZ_16K << (st_rand(t) % 4);	/* 16K .. 128K */
+		break;
+	}
+
+	t0 = ktime_get_ns();
+	switch (type) {
+	case ST_KMALLOC:
+		h = kmalloc(size, GFP_KERNEL);
+		break;
+	case ST_CACHE:
+		h = kmem_cache_alloc(st_cache, GFP_KERNEL);
+		break;
+	case ST_PAGES:
+		pg = alloc_pages(GFP_KERNEL, size);
+		h = pg ? page_address(pg) : NULL;
+		break;
+	case ST_VMALLOC:
+		h = vmalloc(size);
+		break;
+	}
+	lat_record(l, ktime_get_ns() - t0);
+	if (unlikely(!h)) {
+		l->fails++;
+		return NULL;
+	}
+	h->type = type;
+	h->size = size;
+	return h;
+}
+
+static void st_free(struct st_thread *t, struct st_hdr *h)
+{
+	struct st_lat *l = &t->st[h->type].free;
+	u64 t0 = ktime_get_ns();
+
+	switch (h->type) {
+	case ST_KMALLOC:
+		kfree(h);
+		break;
+	case ST_CACHE:
+		kmem_cache_free(st_cache, h);
+		break;
+	case ST_PAGES:
+		__free_pages(virt_to_page(h), h->size);
+		break;
+	case ST_VMALLOC:
+		vfree(h);
+		break;
+	}
+	lat_record(l, ktime_get_ns() - t0);
+}
+
+/* Free, or hand over to another CPU's thread to free */
+static void st_release(struct st_thread *t, struct st_hdr *h)
+{
+	struct st_thread *to;
+
+	if (nthr > 1 && st_rand(t) % 100 < READ_ONCE(stress_xcpu)) {
+		to = &thr[st_rand(t) % nthr];
+		if (to == t)
+			to = &thr[(to - thr + 1) % nthr];
+		t->st[h->type].xfrees++;
+		llist_add(&h->node, &to->inbox);
+		return;
+	}
+	st_free(t, h);
+}
+
+static void st_drain(struct st_thread *t)
+{
+	struct llist_node *n = llist_del_all(&t->inbox);
+	struct st_hdr *h, *tmp;
+
+	llist_for_each_entry_safe(h, tmp, n, node)
+		st_free(t, h);
+}
+
+static int st_pick_type(struct st_thread *t)
+{
+	u32 r = st_rand(t) % mix_total;
+	int type;
+
+	for (type = 0; type < ST_NTYPES - 1; type++) {
+		if (r < mix[type])
+			break;
+		r -= mix[type];
+	}
+	return type;
+}
+
+/* The live objects' min-heap, by expire */
+static void heap_push(struct st_thread *t, struct st_hdr *p, u64 expire)
+{
+	struct st_obj *h = t->live;
+	unsigned int i = t->nlive++, parent;
+
+	while (i) {
+		parent = (i - 1) / 2;
+		if (h[parent].expire <= expire)
+			break;
+		h[i] = h[parent];
+		i = parent;
+	}
+	h[i].p = p;
+	h[i].expire = expire;
+}
+
+static struct st_hdr *heap_pop(struct st_thread *t)
+{
+	struct st_obj *h = t->live, last = h[--t->nlive];
+	struct st_hdr *top = h[0].p;
+	unsigned int i = 0, c;
+
+	while ((c = 2 * i + 1) < t->nlive) {
+		if (c + 1 < t->nlive && h[c + 1].expire < h[c].expire)
+			c++;
+		if (last.expire <= h[c].expire)
+			break;
+		h[i] = h[c];
+		i = c;
+	}
+	h[i] = last;
+	return top;
+}
+
+static int st_thread_fn(void *arg)
+{
+	struct st_thread *t = arg;
+	unsigned int maxlive = run_maxlive, lifetime = run_lifetime;
+	struct st_hdr *h;
+
+	while (!kthread_should_stop()) {
+		st_drain(t);
+		/* free what's expired... */
+		while (t->nlive && t->live[0].expire <= t->iter)
+			st_release(t, heap_pop(t));
+		/* ...and allocate, if there's room */
+		if (t->nlive < maxlive) {
+			h = st_alloc(t, st_pick_type(t));
+			if (h)
+				heap_push(t, h, t->iter + st_rand(t) % (lifetime + 1));
+		}
+		if (!(++t->iter & 127))
+			cond_resched();
+	}
+	while (t->nlive)
+		st_free(t, heap_pop(t));
+	return 0;
+}
+
+static int parse_mix(void)
+{
+	unsigned int m[ST_NTYPES];
+	int i;
+
+	if (sscanf(run_mix, "%u,%u,%u,%u", &m[0], &m[1], &m[2], &m[3]) != ST_NTYPES)
+		return -EINVAL;
+	mix_total = 0;
+	for (i = 0; i < ST_NTYPES; i++) {
+		mix[i] = m[i];
+		mix_total += m[i];
+	}
+	return mix_total ? 0 : -EINVAL;
+}
+
+static void stress_free_threads(void)
+{
+	int i;
+
+	for (i = 0; i < nthr; i++)
+		vfree(thr[i].live);
+	kfree(thr);
+	thr = NULL;
+	nthr = 0;
+}
+
+static int stress_run(void)
+{
+	char tag[128];
+	u64 t0 = 0;
+	int cpu, i, ret;
+
+	if (!stress_secs || !stress_maxlive || stress_cache_size < sizeof(struct st_hdr))
+		return -EINVAL;
+	/* a sysfs write may free the charp param's string meanwhile: copy it */
+	kernel_param_lock(THIS_MODULE);
+	strscpy(run_mix, stress_mix, sizeof(run_mix));
+	kernel_param_unlock(THIS_MODULE);
+	ret = parse_mix();
+	if (ret)
+		return ret;
+	stress_free_threads();	/* the previous run's results */
+	run_maxlive = stress_maxlive;
+	run_lifetime = stress_lifetime;
+	run_secs = min_t(unsigned int, stress_secs, STRESS_MAX_SECS);
+
+	st_cache = kmem_cache_create("kmembugs_stress", stress_cache_size, 0, 0, NULL);
+	if (!st_cache)
+		return -ENOMEM;
+	cpus_read_lock();
+	thr = kcalloc(num_online_cpus(), sizeof(*thr), GFP_KERNEL);
+	if (!thr) {
+		ret = -ENOMEM;
+		goto out_unlock;
+	}
+	for_each_online_cpu(cpu) {
+		struct st_thread *t = &thr[nthr];
+
+		t->cpu = cpu;
+		prandom_seed_state(&t->rnd, (u64)stress_seed + cpu);
+		init_llist_head(&t->inbox);
+		t->live = vzalloc(array_size(run_maxlive, sizeof(*t->live)));
+		if (!t->live) {
+			ret = -ENOMEM;
+			goto out_unlock;
+		}
+		t->task = kthread_create_on_node(st_thread_fn, t, cpu_to_node(cpu),
+						 "kmembugs_stress/%d", cpu);
+		if (IS_ERR(t->task)) {
+			ret = PTR_ERR(t->task);
+			vfree(t->live);
+			goto out_unlock;
+		}
+		kthread_bind(t->task, cpu);
+		nthr++;
+	}
+
+	config_tag(tag, sizeof(tag));
+	snprintf(run_config, sizeof(run_config),
+		 "config=%s cpus=%d secs=%u mix=%s lifetime=%u xcpu=%u%% maxlive=%u cache_size=%u seed=%u",
+		 tag, nthr, run_secs, run_mix, run_lifetime, stress_xcpu,
+		 run_maxlive, stress_cache_size, stress_seed);
+	pr_info("running: %s\n", run_config);
+	t0 = ktime_get_ns();
+	for (i = 0; i < nthr; i++)
+		wake_up_process(thr[i].task);
+	/*
+	 * The threads are bound and running: don't hold off CPU hotplug for the
+	 * (user-set) duration of the run. A thread whose CPU goes offline
+	 * meanwhile is just migrated elsewhere, and still stopped below.
+	 */
+	cpus_read_unlock();
+	if (msleep_interruptible(run_secs * MSEC_PER_SEC))
+		ret = -EINTR;
+	goto out_stop;
+
+ out_unlock:
+	cpus_read_unlock();
+ out_stop:
+	/* on failure, the threads created so far never ran: kthread_stop() just reaps them */
+	for (i = 0; i < nthr; i++)
+		kthread_stop(thr[i].task);
+	run_ns = t0 ? ktime_get_ns() - t0 : 0;
+	/* the objects handed over to a thread that had already stopped */
+	for (i = 0; i < nthr; i++)
+		st_drain(&thr[i]);
+	kmem_cache_destroy(st_cache);
+	st_cache = NULL;
+	if (ret && ret != -EINTR)
+		stress_free_threads();
+	return ret;
+}
+
+static void lat_show(struct seq_file *m, const char *type, const char *op, struct st_lat *l)
+{
+	int b;
+
+	seq_printf(m, "%-8s %-5s %12llu %8llu %12llu %8llu %10llu  ", type, op, l->n, l->fails,
+		   run_ns ? div64_u64(l->n * NSEC_PER_SEC, run_ns) : 0,
+		   l->n ? div64_u64(l->sum_ns, l->n) : 0, l->max_ns);
+	for (b = 0; b < LAT_BUCKETS; b++)
+		if (l->hist[b])
+			seq_printf(m, " <%llu:%llu", 2ULL << b, l->hist[b]);
+	seq_putc(m, '\n');
+}
+
+/*
+ * The 'stress' file: the last run's results. The throughput - all the
+ * operations, and per allocator and operation - and the latency histograms,
+ * as " <N:count" pairs: 'count' operations took less than N ns (and at least
+ * N/2).
+ */
+static int stress_show(struct seq_file *m, void *unused)
+{
+	struct st_stats *tot;
+	u64 ops = 0, xfrees = 0;
+	int i, type, b;
+
+	tot = kcalloc(ST_NTYPES, sizeof(*tot), GFP_KERNEL);
+	if (!tot)
+		return -ENOMEM;
+	mutex_lock(&stress_lock);
+	if (!nthr) {
+		seq_puts(m, "# not run yet; echo run > <debugfs>/" KBUILD_MODNAME "/stress\n");
+		goto out;
+	}
+	for (i = 0; i < nthr; i++) {
+		for (type = 0; type < ST_NTYPES; type++) {
+			struct st_stats *s = &thr[i].st[type], *d = &tot[type];
+			struct st_lat *sl[2] = { &s->alloc, &s->free }, *dl[2] = { &d->alloc, &d->free };
+			int k;
+
+			for (k = 0; k < 2; k++) {
+				dl[k]->n += sl[k]->n;
+				dl[k]->fails += sl[k]->fails;
+				dl[k]->sum_ns += sl[k]->sum_ns;
+				dl[k]->max_ns = max(dl[k]->max_ns, sl[k]->max_ns);
+				for (b = 0; b < LAT_BUCKETS; b++)
+					dl[k]->hist[b] += sl[k]->hist[b];
+			}
+			d->xfrees += s->xfrees;
+		}
+	}
+	for (type = 0; type < ST_NTYPES; type++) {
+		ops += tot[type].alloc.n + tot[type].free.n;
+		xfrees += tot[type].xfrees;
+	}
+	seq_printf(m, "# %s\n", run_config);
+	seq_printf(m, "# %llu ops in %llu ms: %llu ops/s; %llu cross-cpu frees\n", ops,
+		   div_u64(run_ns, NSEC_PER_MSEC),
+		   run_ns ? div64_u64(ops * NSEC_PER_SEC, run_ns) : 0, xfrees);
+	seq_printf(m, "%-8s %-5s %12s %8s %12s %8s %10s   %s\n", "type", "op", "ops", "fails",
+		   "ops/s", "avg_ns", "max_ns", "histogram(ns)");
+	for (type = 0; type < ST_NTYPES; type++) {
+		lat_show(m, st_names[type], "alloc", &tot[type].alloc);
+		lat_show(m, st_names[type], "free", &tot[type].free);
+	}
+ out:
+	mutex_unlock(&stress_lock);
+	kfree(tot);
+	return 0;
+}
+
+static int stress_open(struct inode *inode, struct file *file)
+{
+	return single_open_size(file, stress_show, NULL, 8192);
+}
+
+static ssize_t stress_write(struct file *file, const char __user *ubuf,
+			    size_t count, loff_t *ppos)
+{
+	char cmd[8];
+	int ret;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, ubuf, count))
+		return -EFAULT;
+	cmd[count] = '\0';
+	if (strcmp(strim(cmd), "run"))
+		return -EINVAL;
+
+	mutex_lock(&stress_lock);
+	ret = stress_run();
+	mutex_unlock(&stress_lock);
+	return ret ? ret : count;
+}
+
+static const struct file_operations stress_fops = {
+	.open = stress_open,
+	.read = seq_read,
+	.write = stress_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+int kmembugs_stress_init(void)
+{
+	debugfs_create_file("stress", 0600, gparent, NULL, &stress_fops);
+	return 0;
+}
+
+/* Call after the debugfs files are removed: no run can be in progress */
+void kmembugs_stress_exit(void)
+{
+	stress_free_threads();
+}
@@ -21,6 +21,15 @@
  *  /sys/kernel/debug/test_kmembugs/lkd_dbgfs_run_testcase
  * used to execute individual testcases by writing the testcase # (as a string)
  * to this pseudo-file.
+ * It also has benchmarks, to measure what the memory debug tools cost; see
+ * bench_all() and <debugfs>/test_kmembugs/bench.
+ *
+ * kmembugs_stress.c:
+ * An allocation stress / fragmentation workload; see <debugfs>/test_kmembugs/stress.
+ *
+ * kmembugs_leakscan.c:
+ * Has kmemleak scan, and collects the leaks of this module; see
+ * <debugfs>/test_kmembugs/leaks.
  *
  * IMP:
  * By default, KASAN will turn off reporting after the very first error
@@ -40,6 +49,14 @@
 #include <linux/mm.h>
 #include <linux/irq_work.h>
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/cpumask.h>
+#include <linux/mutex.h>
+#include <linux/utsname.h>
+#include <linux/version.h>
 #include "../../convenient.h"
 
 MODULE_AUTHOR("Kaiwan N Billimoria");
@@ -54,6 +71,11 @@ void kasan_restore_multi_shot(bool enabled);
 #endif
 
 int debugfs_simple_intf_init(void);
+void debugfs_simple_intf_cleanup(void);
+int kmembugs_stress_init(void);
+void kmembugs_stress_exit(void);
+int kmembugs_leakscan_init(void);
+void kmembugs_leakscan_exit(void);
 extern struct dentry *gparent;
 static struct irq_work irqwork;
 
@@ -533,6 +555,279 @@ noinline void oob_copy_user_test(void)
 	kfree(kmem);
 }
 
+/*------------------ The sanitizer overhead benchmarks ------------------------
+ * How much do KASAN / UBSAN / KMEMLEAK / KFENCE / SLUB debug cost? Run the
+ * same benchmarks - kmalloc/kfree across the size classes, vmalloc/vfree, a
+ * stack-heavy call chain and copy_[to|from]_user() loops - on kernels
+ * configured differently, and diff the results; each's tagged with the memory
+ * debug config we detect (see config_tag()). Run them via
+ *  echo run > /sys/kernel/debug/test_kmembugs/bench ; cat /sys/kernel/debug/test_kmembugs/bench
+ * The benchmarks run in the writer's context, on each online CPU in turn
+ * (we migrate there), bench_iters times each; we report the ns per operation,
+ * averaged over the CPUs, along with the min and max (per-CPU) values.
+ */
+static unsigned int bench_iters = 100000;
+module_param(bench_iters, uint, 0644);
+MODULE_PARM_DESC(bench_iters, "# of iterations of each benchmark, per CPU (defaults to 100000)");
+
+#define BENCH_USER_BUFSZ	4096
+
+enum {
+	BENCH_KMALLOC,		/* .arg is the size */
+	BENCH_VMALLOC,
+	BENCH_STACK,		/* .arg is the call depth */
+	BENCH_COPY_TO_USER,
+	BENCH_COPY_FROM_USER,
+};
+
+static struct bench {
+	const char *name;
+	int type;
+	unsigned int arg;
+	unsigned int iter_div;	/* the expensive ones run bench_iters / iter_div times */
+	/* results */
+	u64 min, max, sum;	/* ns/op, per CPU */
+	unsigned int ncpus;
+} benches[] = {
+	{ "kmalloc-8", BENCH_KMALLOC, 8, 1 },
+	{ "kmalloc-32", BENCH_KMALLOC, 32, 1 },
+	{ "kmalloc-64", BENCH_KMALLOC, 64, 1 },
+	{ "kmalloc-128", BENCH_KMALLOC, 128, 1 },
+	{ "kmalloc-256", BENCH_KMALLOC, 256, 1 },
+	{ "kmalloc-512", BENCH_KMALLOC, 512, 1 },
+	{ "kmalloc-1k", BENCH_KMALLOC, 1024, 1 },
+	{ "kmalloc-2k", BENCH_KMALLOC, 2048, 1 },
+	{ "kmalloc-4k", BENCH_KMALLOC, 4096, 1 },
+	{ "kmalloc-8k", BENCH_KMALLOC, 8192, 1 },
+	{ "vmalloc-16k", BENCH_VMALLOC, 16384, 16 },
+	{ "stack-depth8", BENCH_STACK, 8, 1 },
+	{ "copy_to_user-256", BENCH_COPY_TO_USER, 256, 1 },
+	{ "copy_to_user-4k", BENCH_COPY_TO_USER, 4096, 1 },
+	{ "copy_from_user-256", BENCH_COPY_FROM_USER, 256, 1 },
+	{ "copy_from_user-4k", BENCH_COPY_FROM_USER, 4096, 1 },
+};
+static char bench_config[128];
+static unsigned int bench_done_iters;
+static DEFINE_MUTEX(bench_lock);
+
+/*
+ * The memory debug features this kernel has; f.e. "kasan_generic,ubsan,kmemleak"
+ * (not static: the stress workload - kmembugs_stress.c - tags it's results too)
+ */
+void config_tag(char *buf, size_t sz)
+{
+	static const struct {
+		bool on;
+		const char *name;
+	} conf[] = {
+		{ IS_ENABLED(CONFIG_KASAN_GENERIC), "kasan_generic" },
+		{ IS_ENABLED(CONFIG_KASAN_SW_TAGS), "kasan_sw_tags" },
+		{ IS_ENABLED(CONFIG_KASAN_HW_TAGS), "kasan_hw_tags" },
+		{ IS_ENABLED(CONFIG_UBSAN), "ubsan" },
+		{ IS_ENABLED(CONFIG_DEBUG_KMEMLEAK), "kmemleak" },
+		{ IS_ENABLED(CONFIG_KFENCE), "kfence" },
+		{ IS_ENABLED(CONFIG_SLUB_DEBUG_ON), "slub_debug_on" },
+		{ IS_ENABLED(CONFIG_SLUB_DEBUG) && !IS_ENABLED(CONFIG_SLUB_DEBUG_ON), "slub_debug" },
+		{ IS_ENABLED(CONFIG_KMSAN), "kmsan" },
+	};
+	int i, n = 0;
+
+	buf[0] = '\0';
+	for (i = 0; i < ARRAY_SIZE(conf); i++)
+		if (conf[i].on)
+			n += scnprintf(buf + n, sz - n, "%s%s", n ? "," : "", conf[i].name);
+	if (!n)
+		strscpy(buf, "none", sz);
+}
+
+/* A call chain with a (sanitizer-instrumented) stack frame of ~256 bytes per level */
+static noinline int bench_stack_fn(int depth)
+{
+	volatile char frame[256];
+	int i;
+
+	for (i = 0; i < sizeof(frame); i += 32)
+		frame[i] = (char)i;
+	if (depth > 1)
+		return bench_stack_fn(depth - 1) + frame[32];
+	return frame[64];
+}
+
+/* Run benchmark @b @iters times, on this CPU; returns the ns/op, or 0 on failure */
+static u64 bench_run(struct bench *b, unsigned int iters, char *kbuf, char __user *ubuf)
+{
+	u64 t0, t1;
+	unsigned int i;
+	void *p;
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < iters; i++) {
+		switch (b->type) {
+		case BENCH_KMALLOC:
+			p = kmalloc(b->arg, GFP_KERNEL);
+			if (unlikely(!p))
+				return 0;
+			kfree(p);
+			break;
+		case BENCH_VMALLOC:
+			p = vmalloc(b->arg);
+			if (unlikely(!p))
+				return 0;
+			vfree(p);
+			break;
+		case BENCH_STACK:
+			bench_stack_fn(b->arg);
+			break;
+		case BENCH_COPY_TO_USER:
+			if (copy_to_user(ubuf, kbuf, b->arg))
+				return 0;
+			break;
+		case BENCH_COPY_FROM_USER:
+			if (copy_from_user(kbuf, ubuf, b->arg))
+				return 0;
+			break;
+		}
+	}
+	t1 = ktime_get_ns();
+	return max_t(u64, div_u64(t1 - t0, iters), 1);
+}
+
+static int bench_all(void)
+{
+	cpumask_var_t saved;
+	char __user *ubuf;
+	char *kbuf;
+	int cpu, i, ret = 0;
+
+	if (!alloc_cpumask_var(&saved, GFP_KERNEL))
+		return -ENOMEM;
+	kbuf = kzalloc(BENCH_USER_BUFSZ, GFP_KERNEL);
+	if (!kbuf) {
+		ret = -ENOMEM;
+		goto out_mask;
+	}
+	ubuf = (char __user *)vm_mmap(NULL, 0, BENCH_USER_BUFSZ, PROT_READ | PROT_WRITE,
+				      MAP_ANONYMOUS | MAP_PRIVATE, 0);
+	if (IS_ERR(ubuf)) {
+		ret = PTR_ERR(ubuf);
+		goto out_kbuf;
+	}
+	/* fault the user page in, so that it isn't counted */
+	if (clear_user(ubuf, BENCH_USER_BUFSZ)) {
+		ret = -EFAULT;
+		goto out_unmap;
+	}
+
+	config_tag(bench_config, sizeof(bench_config));
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		benches[i].min = U64_MAX;
+		benches[i].max = benches[i].sum = 0;
+		benches[i].ncpus = 0;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+	cpumask_copy(saved, current->cpus_ptr);
+#else
+	cpumask_copy(saved, &current->cpus_allowed);
+#endif
+	for_each_online_cpu(cpu) {
+		if (set_cpus_allowed_ptr(current, cpumask_of(cpu)))
+			continue;	/* went offline */
+		for (i = 0; i < ARRAY_SIZE(benches); i++) {
+			struct bench *b = &benches[i];
+			u64 ns = bench_run(b, max(bench_iters / b->iter_div, 1U), kbuf, ubuf);
+
+			if (!ns) {
+				pr_warn("benchmark %s failed on cpu %d\n", b->name, cpu);
+				continue;
+			}
+			b->min = min(b->min, ns);
+			b->max = max(b->max, ns);
+			b->sum += ns;
+			b->ncpus++;
+			cond_resched();
+		}
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+	}
+	set_cpus_allowed_ptr(current, saved);
+	bench_done_iters = bench_iters;
+
+ out_unmap:
+	vm_munmap((unsigned long)ubuf, BENCH_USER_BUFSZ);
+ out_kbuf:
+	kfree(kbuf);
+ out_mask:
+	free_cpumask_var(saved);
+	return ret;
+}
+
+/*
+ * The 'bench' debugfs file. Reading it shows the last run's results, one line
+ * per benchmark, tagged with the kernel's memory debug config:
+ *  # config=kasan_generic,ubsan kernel=5.10.60 iters=100000
+ *  kmalloc-32 avg_ns=115 min_ns=110 max_ns=121 cpus=4
+ * Writing 'run' to it (re)runs them.
+ */
+static int bench_show(struct seq_file *m, void *unused)
+{
+	int i;
+
+	mutex_lock(&bench_lock);
+	if (!bench_done_iters) {
+		seq_puts(m, "# not run yet; echo run > <debugfs>/" KBUILD_MODNAME "/bench\n");
+		goto out;
+	}
+	seq_printf(m, "# config=%s kernel=%s iters=%u\n", bench_config,
+		   utsname()->release, bench_done_iters);
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		struct bench *b = &benches[i];
+
+		if (!b->ncpus)
+			continue;
+		seq_printf(m, "%s avg_ns=%llu min_ns=%llu max_ns=%llu cpus=%u\n", b->name,
+			   div_u64(b->sum, b->ncpus), b->min, b->max, b->ncpus);
+	}
+ out:
+	mutex_unlock(&bench_lock);
+	return 0;
+}
+
+static int bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bench_show, NULL);
+}
+
+static ssize_t bench_write(struct file *file, const char __user *ubuf,
+			   size_t count, loff_t *ppos)
+{
+	char cmd[8];
+	int ret;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, ubuf, count))
+		return -EFAULT;
+	cmd[count] = '\0';
+	if (strcmp(strim(cmd), "run"))
+		return -EINVAL;
+
+	mutex_lock(&bench_lock);
+	ret = bench_all();
+	mutex_unlock(&bench_lock);
+	return ret ? ret : count;
+}
+
+static const struct file_operations bench_fops = {
+	.open = bench_open,
+	.read = seq_read,
+	.write = bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+/*---------------- end benchmarks --------------------------------------------*/
+
 #define CHKCONF(option) do {     \
 	if (IS_ENABLED(option))      \
 		pr_info("%s configured\n", #option); \
@@ -557,12 +852,22 @@ static int __init kmembugs_test_init(void)
 #endif
 	CHKCONF(CONFIG_UBSAN);
 	CHKCONF(CONFIG_DEBUG_KMEMLEAK);
+	CHKCONF(CONFIG_KASAN_SW_TAGS);
+	CHKCONF(CONFIG_KFENCE);
+	CHKCONF(CONFIG_SLUB_DEBUG_ON);
 
 	init_irq_work(&irqwork, irq_work_leaky);
 
 	stat = debugfs_simple_intf_init();
 	if (stat < 0)
 		return stat;
+	debugfs_create_file("bench", 0600, gparent, NULL, &bench_fops);
+	kmembugs_stress_init();
+	stat = kmembugs_leakscan_init();
+	if (stat < 0) {
+		debugfs_simple_intf_cleanup();
+		return stat;
+	}
 
 	return 0;		/* success */
 }
@@ -572,7 +877,9 @@ static void __exit kmembugs_test_exit(void)
 #ifdef CONFIG_KASAN_GENERIC
 	kasan_restore_multi_shot(kasan_multishot);
 #endif
-	debugfs_remove_recursive(gparent);
+	debugfs_simple_intf_cleanup();
+	kmembugs_stress_exit();
+	kmembugs_leakscan_exit();
 	pr_info("removed\n");
 }
 